@@ -0,0 +1,299 @@
+#define _POSIX_C_SOURCE 199309L
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#define HM_IMPLEMENTATION
+#define HM_ENABLE_THREADS
+#include "hm.h"
+
+HM_GEN_WRAPPER_PROTOTYPE(int64_t);
+HM_GEN_WRAPPER_IMPLEMENTATION(int64_t);
+
+#define EVENT_COUNT 10000000
+#define KEY_COUNT 100000
+
+static double now(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// xorshift so every run counts the same event stream
+static uint64_t next_key(uint64_t* state){
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state % KEY_COUNT;
+}
+
+static void report(const char* name, double seconds){
+  printf("%-28s %8.3f s  %8.1f ns/event\n", name, seconds, seconds * 1e9 / EVENT_COUNT);
+}
+
+static void combine_add(void* existing, const void* value){
+  *(int64_t*)existing += *(const int64_t*)value;
+}
+
+static void bench_counting(void){
+  printf("--- counting %d events over %d keys ---\n", EVENT_COUNT, KEY_COUNT);
+  HM hm = {0};
+  uint64_t state;
+  double start;
+  int64_t check[3] = {0};
+
+  HM_int64_t_init(&hm, 0);
+  state = 88172645463325252ULL;
+  start = now();
+  for(size_t i = 0; i < EVENT_COUNT; ++i){
+    uint64_t key = next_key(&state);
+    int64_t* count = HM_int64_t_kwl_get(&hm, &key, sizeof(key));
+    HM_int64_t_kwl_set(&hm, &key, sizeof(key), count != NULL ? *count + 1 : 1);
+  }
+  report("HM_kwl_get + HM_kwl_set", now() - start);
+  check[0] = *HM_int64_t_kwl_get(&hm, &(uint64_t){0}, sizeof(uint64_t));
+  HM_deinit(&hm);
+
+  HM_int64_t_init(&hm, 0);
+  state = 88172645463325252ULL;
+  start = now();
+  for(size_t i = 0; i < EVENT_COUNT; ++i){
+    uint64_t key = next_key(&state);
+    HM_sk_add_i64(&hm, key, 1);
+  }
+  report("HM_kwl_add_i64", now() - start);
+  check[1] = *HM_int64_t_kwl_get(&hm, &(uint64_t){0}, sizeof(uint64_t));
+  HM_deinit(&hm);
+
+  HM_int64_t_init(&hm, 0);
+  state = 88172645463325252ULL;
+  start = now();
+  for(size_t i = 0; i < EVENT_COUNT; ++i){
+    uint64_t key = next_key(&state);
+    HM_int64_t_kwl_merge(&hm, &key, sizeof(key), 1, combine_add);
+  }
+  report("HM_kwl_merge", now() - start);
+  check[2] = *HM_int64_t_kwl_get(&hm, &(uint64_t){0}, sizeof(uint64_t));
+  HM_deinit(&hm);
+
+  if(check[0] != check[1] || check[0] != check[2]){
+    printf("mismatching counts: %lld %lld %lld\n", (long long)check[0], (long long)check[1], (long long)check[2]);
+  }
+}
+
+#define SCALING_OPS 8000000
+#define SCALING_KEYS 1000000
+
+typedef struct{
+  HM_Sharded* sharded;
+  HM* global;
+  pthread_mutex_t* global_lock;
+  size_t ops;
+  uint64_t seed;
+} ScalingTask;
+
+// 1 in 4 operations is an insert, the rest are lookups
+static void* scaling_worker(void* arg){
+  ScalingTask* task = (ScalingTask*)arg;
+  uint64_t state = task->seed;
+  int64_t value = 0;
+  for(size_t i = 0; i < task->ops; ++i){
+    uint64_t key = next_key(&state) % SCALING_KEYS;
+    if(task->sharded != NULL){
+      if(i % 4 == 0){
+        HM_sharded_kwl_set(task->sharded, &key, sizeof(key), &value);
+      }else{
+        HM_sharded_kwl_get(task->sharded, &key, sizeof(key), &value);
+      }
+    }else{
+      pthread_mutex_lock(task->global_lock);
+      if(i % 4 == 0){
+        HM_kwl_set(task->global, &key, sizeof(key), &value);
+      }else{
+        int64_t* found = HM_kwl_get(task->global, &key, sizeof(key));
+        if(found != NULL) value = *found;
+      }
+      pthread_mutex_unlock(task->global_lock);
+    }
+  }
+  return NULL;
+}
+
+static double run_scaling(size_t thread_count, HM_Sharded* sharded, HM* global, pthread_mutex_t* global_lock){
+  pthread_t threads[64];
+  ScalingTask tasks[64];
+  double start = now();
+  for(size_t t = 0; t < thread_count; ++t){
+    tasks[t] = (ScalingTask){ sharded, global, global_lock, SCALING_OPS / thread_count, 88172645463325252ULL + t };
+    pthread_create(&threads[t], NULL, scaling_worker, &tasks[t]);
+  }
+  for(size_t t = 0; t < thread_count; ++t){
+    pthread_join(threads[t], NULL);
+  }
+  return now() - start;
+}
+
+static void bench_sharded_scaling(void){
+  printf("--- %d mixed ops (25%% set) over %d keys, Mops/s ---\n", SCALING_OPS, SCALING_KEYS);
+  printf("%8s %14s %14s\n", "threads", "global mutex", "sharded (64)");
+  for(size_t thread_count = 1; thread_count <= 64; thread_count *= 2){
+    HM global;
+    pthread_mutex_t global_lock = PTHREAD_MUTEX_INITIALIZER;
+    HM_init(&global, sizeof(int64_t), 0);
+    double global_time = run_scaling(thread_count, NULL, &global, &global_lock);
+    HM_deinit(&global);
+
+    HM_Sharded sharded;
+    HM_sharded_init(&sharded, sizeof(int64_t), 0, 64);
+    double sharded_time = run_scaling(thread_count, &sharded, NULL, NULL);
+    HM_sharded_deinit(&sharded);
+
+    printf("%8zu %14.2f %14.2f\n", thread_count, SCALING_OPS / global_time * 1e-6, SCALING_OPS / sharded_time * 1e-6);
+  }
+}
+
+#define HOT_OPS 8000000
+#define HOT_KEYS 16
+
+typedef struct{
+  HM_Sharded* map;
+  bool combined;
+  size_t ops;
+} HotTask;
+
+static void* hot_worker(void* arg){
+  HotTask* task = (HotTask*)arg;
+  int64_t one = 1;
+  HM_Combiner combiner;
+  if(task->combined) HM_combiner_init(&combiner, task->map, combine_add, 1024);
+  for(size_t i = 0; i < task->ops; ++i){
+    uint64_t key = i % HOT_KEYS;
+    if(task->combined){
+      HM_combiner_kwl_merge(&combiner, &key, sizeof(key), &one);
+      // flush on a timer-like cadence since the few hot keys never reach the threshold
+      if(i % 4096 == 4095) HM_combiner_flush(&combiner);
+    }else{
+      HM_sharded_kwl_merge(task->map, &key, sizeof(key), &one, combine_add);
+    }
+  }
+  if(task->combined){
+    HM_combiner_flush(&combiner);
+    HM_combiner_deinit(&combiner);
+  }
+  return NULL;
+}
+
+static double run_hot(size_t thread_count, bool combined){
+  HM_Sharded map;
+  HM_sharded_init(&map, sizeof(int64_t), 0, 64);
+  pthread_t threads[64];
+  HotTask tasks[64];
+  double start = now();
+  for(size_t t = 0; t < thread_count; ++t){
+    tasks[t] = (HotTask){ &map, combined, HOT_OPS / thread_count };
+    pthread_create(&threads[t], NULL, hot_worker, &tasks[t]);
+  }
+  for(size_t t = 0; t < thread_count; ++t){
+    pthread_join(threads[t], NULL);
+  }
+  double seconds = now() - start;
+  HM_sharded_deinit(&map);
+  return seconds;
+}
+
+static void bench_hot_counters(void){
+  printf("--- %d increments of %d hot keys, Mops/s ---\n", HOT_OPS, HOT_KEYS);
+  printf("%8s %14s %14s\n", "threads", "sharded merge", "combiner");
+  for(size_t thread_count = 1; thread_count <= 64; thread_count *= 2){
+    double direct = run_hot(thread_count, false);
+    double combined = run_hot(thread_count, true);
+    printf("%8zu %14.2f %14.2f\n", thread_count, HOT_OPS / direct * 1e-6, HOT_OPS / combined * 1e-6);
+  }
+}
+
+#define SNAPSHOT_KEYS 2000000
+
+static void bench_snapshot(void){
+  printf("--- restoring %d keys ---\n", SNAPSHOT_KEYS);
+  HM hm;
+  HM_init(&hm, sizeof(int64_t), 0);
+  double start = now();
+  for(int64_t key = 0; key < SNAPSHOT_KEYS; ++key){
+    HM_kwl_set(&hm, &key, sizeof(key), &key);
+  }
+  printf("%-28s %8.3f s\n", "HM_kwl_set loop", now() - start);
+
+  FILE* file = tmpfile();
+  start = now();
+  HM_save(&hm, file);
+  fflush(file);
+  printf("%-28s %8.3f s\n", "HM_save", now() - start);
+  HM_deinit(&hm);
+
+  rewind(file);
+  start = now();
+  HM_load(&hm, file, NULL);
+  printf("%-28s %8.3f s\n", "HM_load", now() - start);
+  HM_deinit(&hm);
+  fclose(file);
+}
+
+#define LATENCY_KEYS 4000000
+
+static void bench_async_latency(void){
+  printf("--- worst single insert of %d keys ---\n", LATENCY_KEYS);
+  HM hm;
+  HM_init(&hm, sizeof(int64_t), 0);
+  double worst = 0;
+  double start = now();
+  for(int64_t key = 0; key < LATENCY_KEYS; ++key){
+    double insert_start = now();
+    HM_kwl_set(&hm, &key, sizeof(key), &key);
+    double took = now() - insert_start;
+    if(took > worst) worst = took;
+  }
+  printf("%-28s %8.3f s  worst %8.3f ms\n", "HM", now() - start, worst * 1e3);
+  HM_deinit(&hm);
+
+  HM_Async async;
+  HM_async_init(&async, sizeof(int64_t), 0);
+  worst = 0;
+  start = now();
+  for(int64_t key = 0; key < LATENCY_KEYS; ++key){
+    double insert_start = now();
+    HM_async_kwl_set(&async, &key, sizeof(key), &key);
+    double took = now() - insert_start;
+    if(took > worst) worst = took;
+  }
+  printf("%-28s %8.3f s  worst %8.3f ms\n", "HM_Async", now() - start, worst * 1e3);
+  HM_async_deinit(&async);
+}
+
+#define GROW_KEYS 2000000
+
+static void bench_grow(void){
+  printf("--- HM_grow of %d entries ---\n", GROW_KEYS);
+  printf("%8s %14s\n", "threads", "ms");
+  for(size_t thread_count = 1; thread_count <= 8; thread_count *= 2){
+    HM hm;
+    HM_init(&hm, sizeof(int64_t), GROW_KEYS * 2);
+    for(int64_t key = 0; key < GROW_KEYS; ++key){
+      HM_kwl_set(&hm, &key, sizeof(key), &key);
+    }
+    HM_set_grow_threads(&hm, thread_count);
+    double start = now();
+    HM_grow(&hm);
+    printf("%8zu %14.1f\n", thread_count, (now() - start) * 1e3);
+    HM_deinit(&hm);
+  }
+}
+
+int main(void){
+  bench_counting();
+  bench_sharded_scaling();
+  bench_hot_counters();
+  bench_grow();
+  bench_async_latency();
+  bench_snapshot();
+  return 0;
+}
@@ -26,9 +26,11 @@
 #define HM_H_
 
 #include <stddef.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdio.h>
 
 #ifndef HM_CALLOC
 #define HM_CALLOC(n, s) calloc(n, s)
@@ -52,6 +54,72 @@
 #define HM_LOG_ERROR(...) fprintf(stderr, __VA_ARGS__)
 #endif
 
+#ifndef HM_PREFETCH
+#if defined(__GNUC__) || defined(__clang__)
+#define HM_PREFETCH(addr) __builtin_prefetch(addr)
+#else
+#define HM_PREFETCH(addr) ((void)(addr))
+#endif
+#endif
+
+// number of lookups whose slots are prefetched together by the bulk operations
+#ifndef HM_BATCH_SIZE
+#define HM_BATCH_SIZE 16
+#endif
+
+// the parts of hm.h that spawn or synchronize threads require pthreads and C11 atomics,
+// they are only available if HM_ENABLE_THREADS is defined
+#ifdef HM_ENABLE_THREADS
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+
+// maximum number of threads that can be registered as reader of a single HM_RCU
+#ifndef HM_MAX_READERS
+#define HM_MAX_READERS 128
+#endif
+
+#ifndef HM_CACHE_LINE
+#define HM_CACHE_LINE 64
+#endif
+
+// smallest number of entries for which HM_grow() uses the threads set by HM_set_grow_threads()
+#ifndef HM_PARALLEL_GROW_MIN
+#define HM_PARALLEL_GROW_MIN 65536
+#endif
+
+// an HM_Async write waits for the resize once the delta holds capacity/HM_ASYNC_DELTA_DIVISOR 
+// elements, smaller values let more writes through without waiting at the cost of a larger delta
+#ifndef HM_ASYNC_DELTA_DIVISOR
+#define HM_ASYNC_DELTA_DIVISOR 8
+#endif
+#endif
+
+// NUMA placement for HM_Sharded and per node copies with HM_Replicated, Linux only. The node 
+// topology is read from sysfs unless HM_USE_LIBNUMA is defined, in which case libnuma is used
+// and the program has to be linked with -lnuma
+#ifdef HM_ENABLE_NUMA
+#ifndef HM_ENABLE_THREADS
+#error "hm.h: HM_ENABLE_NUMA requires HM_ENABLE_THREADS"
+#endif
+#ifndef _GNU_SOURCE
+#error "hm.h: HM_ENABLE_NUMA requires _GNU_SOURCE to be defined before any header is included"
+#endif
+#include <stdio.h>
+#ifdef HM_USE_LIBNUMA
+#include <numa.h>
+#endif
+#endif
+
+// the parts of hm.h that map files into memory require POSIX,
+// they are only available if HM_ENABLE_POSIX is defined
+#ifdef HM_ENABLE_POSIX
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 // by default HM will panic if an allocation (HM_CALLOC) returns NULL.
 // by defining HM_DISABLE_ALLOC_PANIC, HM_init() and HM_set() will 
 // return false in case of allocation failure
@@ -65,6 +133,7 @@
 #endif
 
 typedef size_t (*HM_HashFunc)(const char* key, size_t key_len);
+typedef void (*HM_CombineFunc)(void* existing, const void* value);
 typedef const size_t* HM_Iterator;
 
 typedef struct{
@@ -81,12 +150,20 @@ typedef struct{
   size_t last;
   size_t element_size;
   size_t count;
+  size_t tombstones;
   size_t capacity;
+  size_t grow_threads;
+  char* key_block;        // keys loaded by HM_load() share this single allocation
+  size_t key_block_size;
 
   HM_HashFunc hash_func;
 } HM;
 
-#define HM_entry_index(self, i) ((HM_Entry*)((self)->entries + ((sizeof(HM_Entry)+self->element_size)*(i))))
+typedef void (*HM_ForEachFunc)(HM* self, HM_Iterator it, void* ctx);
+
+// size of a single slot, values are padded to a multiple of the pointer size to keep entries aligned
+#define HM_entry_size(self) (sizeof(HM_Entry) + (((self)->element_size + sizeof(void*) - 1) & ~(sizeof(void*) - 1)))
+#define HM_entry_index(self, i) ((HM_Entry*)((self)->entries + (HM_entry_size(self)*(i))))
 
 /**
  * \brief                 initializes the hashmap
@@ -106,6 +183,24 @@ bool HM_init(HM* self, size_t element_size, size_t capacity);
  */
 void HM_deinit(HM* self);
 
+/**
+ * \brief         initializes dst as a copy of src with the same capacity and insertion order
+ * \note          the entries are copied with one memcpy and the keys into a single buffer 
+ *                owned by dst, nothing is rehashed
+ * \param dst:    uninitialized hashmap handle
+ * \param src:    hashmap handle
+ * \returns       true if succesful, false if allocation failed **and** HM_DISABLE_ALLOC_PANIC 
+ *                is defined. dst is left uninitialized on failure
+ */
+bool HM_clone(HM* dst, HM* src);
+
+/**
+ * \brief         removes all elements but keeps the capacity, so the map can be refilled 
+ *                without allocating a new table
+ * \param self:   hashmap handle
+ */
+void HM_clear(HM* self);
+
 /**
  * \brief         doubles the hashmaps capacity or allocates its buffers if not previously 
  *                allocated
@@ -116,6 +211,16 @@ void HM_deinit(HM* self);
  */
 bool HM_grow(HM* self);
 
+/**
+ * \brief         makes sure that count elements fit in the hashmap without it having to grow
+ * \note          crashes if allocation failed and HM_DISABLE_ALLOC_PANIC is not defined
+ * \param self:   hashmap handle
+ * \param count:  total number of elements the hashmap should be able to hold
+ * \returns       true if allocation was succesful, false if allocation failed **and** 
+ *                HM_DISABLE_ALLOC_PANIC is defined
+ */
+bool HM_reserve(HM* self, size_t count);
+
 /**
  * \brief         returns pointer to element associated with key if available
  * \param self:   hashmap handle 
@@ -141,10 +246,50 @@ void* HM_kwl_get(HM* self, const void* key, size_t key_len);
 #define HM_sk_get(self, key)\
 HM_kwl_get(self, &(key), sizeof(key))
 
+/**
+ * \brief           returns pointer to element associated with key, inserting a zero initialized
+ *                  element first if the key was not present yet
+ * \note            only hashes and probes once, the returned element can be modified in place
+ * \note            rehashes once count + tombstones reaches capacity/2, at the same capacity if 
+ *                  tombstones outnumber elements and at twice the capacity otherwise, thus will 
+ *                  crash on allocation failure if HM_DISABLE_ALLOC_PANIC is not defined
+ * \param self:     hashmap handle 
+ * \param key:      key to lookup in hashmap 
+ * \param inserted: optional (may be NULL), set to true if the key was newly inserted
+ * \returns         pointer to element in hashmap, NULL if an allocation failed **and** 
+ *                  HM_DISABLE_ALLOC_PANIC is defined
+ */
+void* HM_get_or_insert(HM* self, const char* key, bool* inserted);
+
+/**
+ * \brief           returns pointer to element associated with key, inserting a zero initialized
+ *                  element first if the key was not present yet
+ * \note            only hashes and probes once, the returned element can be modified in place
+ * \note            rehashes once count + tombstones reaches capacity/2, at the same capacity if 
+ *                  tombstones outnumber elements and at twice the capacity otherwise, thus will 
+ *                  crash on allocation failure if HM_DISABLE_ALLOC_PANIC is not defined
+ * \param self:     hashmap handle 
+ * \param key:      key to lookup in hashmap 
+ * \param key_len:  length of key in bytes
+ * \param inserted: optional (may be NULL), set to true if the key was newly inserted
+ * \returns         pointer to element in hashmap, NULL if an allocation failed **and** 
+ *                  HM_DISABLE_ALLOC_PANIC is defined
+ */
+void* HM_kwl_get_or_insert(HM* self, const void* key, size_t key_len, bool* inserted);
+
+/**
+ * \brief   'sized key' convenience macro for HM_kwl_get_or_insert, equivalent to 
+ *          'HM_kwl_get_or_insert(self, &(key), sizeof(key), inserted)'
+ * \note    make sure to dereference if you have a pointer to your key!
+ */
+#define HM_sk_get_or_insert(self, key, inserted)\
+  HM_kwl_get_or_insert(self, &(key), sizeof(key), inserted)
+
 /**
  * \brief         inserts a new key value pair into the hashmap
- * \note          calls HM_grow() if element count > capacity, thus will crash on allocation 
- *                failure if HM_DISABLE_ALLOC_PANIC is not defined
+ * \note          rehashes once count + tombstones reaches capacity/2, at the same capacity if 
+ *                tombstones outnumber elements and at twice the capacity otherwise, thus will 
+ *                crash on allocation failure if HM_DISABLE_ALLOC_PANIC is not defined
  * \param self:   hashmap handle 
  * \param key:    key to lookup in hashmap 
  * \param value:  pointer to value to be inserted 
@@ -155,8 +300,9 @@ bool HM_set(HM* self, const char* key, void* value);
 
 /**
  * \brief           inserts a new key value pair into the hashmap using key with provided lenght
- * \note            calls HM_grow() if element count > capacity, thus will crash on allocation 
- *                  failure if HM_DISABLE_ALLOC_PANIC is not defined
+ * \note            rehashes once count + tombstones reaches capacity/2, at the same capacity if 
+ *                  tombstones outnumber elements and at twice the capacity otherwise, thus will 
+ *                  crash on allocation failure if HM_DISABLE_ALLOC_PANIC is not defined
  * \param self:     hashmap handle 
  * \param key:      key to lookup in hashmap 
  * \param key_len:  length of key in bytes
@@ -174,6 +320,129 @@ bool HM_kwl_set(HM* self, const void* key, size_t key_len, void* value);
 #define HM_sk_set(self, key, value)\
   HM_kwl_set(self, &(key), sizeof(key), value)
 
+/**
+ * \brief         returns pointer to the element slot for key, inserting the key if it was not 
+ *                present yet, the caller is expected to fill in the element directly
+ * \note          the slot of a newly inserted key is **not** initialized
+ * \note          rehashes once count + tombstones reaches capacity/2, at the same capacity if 
+ *                tombstones outnumber elements and at twice the capacity otherwise, thus will 
+ *                crash on allocation failure if HM_DISABLE_ALLOC_PANIC is not defined
+ * \param self:   hashmap handle 
+ * \param key:    key to insert into hashmap 
+ * \returns       pointer to element slot in hashmap, NULL if an allocation failed **and** 
+ *                HM_DISABLE_ALLOC_PANIC is defined
+ */
+void* HM_emplace(HM* self, const char* key);
+
+/**
+ * \brief           returns pointer to the element slot for key, inserting the key if it was not 
+ *                  present yet, the caller is expected to fill in the element directly
+ * \note            the slot of a newly inserted key is **not** initialized
+ * \note            rehashes once count + tombstones reaches capacity/2, at the same capacity if 
+ *                  tombstones outnumber elements and at twice the capacity otherwise, thus will 
+ *                  crash on allocation failure if HM_DISABLE_ALLOC_PANIC is not defined
+ * \param self:     hashmap handle 
+ * \param key:      key to insert into hashmap 
+ * \param key_len:  length of key in bytes
+ * \returns         pointer to element slot in hashmap, NULL if an allocation failed **and** 
+ *                  HM_DISABLE_ALLOC_PANIC is defined
+ */
+void* HM_kwl_emplace(HM* self, const void* key, size_t key_len);
+
+/**
+ * \brief   'sized key' convenience macro for HM_kwl_emplace, equivalent to 
+ *          'HM_kwl_emplace(self, &(key), sizeof(key))'
+ * \note    make sure to dereference if you have a pointer to your key!
+ */
+#define HM_sk_emplace(self, key)\
+  HM_kwl_emplace(self, &(key), sizeof(key))
+
+/**
+ * \brief           inserts value for key if the key is not present yet, otherwise combines the 
+ *                  present element with value in place using combine(existing, value)
+ * \note            only hashes and probes once
+ * \note            rehashes once count + tombstones reaches capacity/2, at the same capacity if 
+ *                  tombstones outnumber elements and at twice the capacity otherwise, thus will 
+ *                  crash on allocation failure if HM_DISABLE_ALLOC_PANIC is not defined
+ * \param self:     hashmap handle 
+ * \param key:      key to insert into hashmap 
+ * \param key_len:  length of key in bytes
+ * \param value:    pointer to value to be inserted or combined
+ * \param combine:  function merging value into the existing element
+ * \returns         pointer to the resulting element, NULL if an allocation failed **and** 
+ *                  HM_DISABLE_ALLOC_PANIC is defined
+ */
+void* HM_kwl_merge(HM* self, const void* key, size_t key_len, const void* value, HM_CombineFunc combine);
+
+/**
+ * \brief   'sized key' convenience macro for HM_kwl_merge, equivalent to 
+ *          'HM_kwl_merge(self, &(key), sizeof(key), value, combine)'
+ * \note    make sure to dereference if you have a pointer to your key!
+ */
+#define HM_sk_merge(self, key, value, combine)\
+  HM_kwl_merge(self, &(key), sizeof(key), value, combine)
+
+/**
+ * \brief           merges every element of src into dst, keys missing in dst are inserted and 
+ *                  present ones are combined using combine(existing, value)
+ * \note            dst is reserved for dst->count + src->count elements up front and every key 
+ *                  is hashed once, the home slots of a batch of HM_BATCH_SIZE keys are prefetched 
+ *                  before they are probed
+ * \param dst:      hashmap handle, must have the same element size as src
+ * \param src:      hashmap handle, left unchanged
+ * \param combine:  function merging a value of src into an element of dst, NULL to overwrite 
+ *                  the element of dst
+ * \returns         true if succesful, false if an allocation failed **and** 
+ *                  HM_DISABLE_ALLOC_PANIC is defined. dst then holds part of src
+ */
+bool HM_merge_map(HM* dst, HM* src, HM_CombineFunc combine);
+
+/**
+ * \brief           like HM_merge_map() but empties src, keys inserted into dst are moved instead of 
+ *                  copied
+ * \returns         true if succesful, false if an allocation failed **and** 
+ *                  HM_DISABLE_ALLOC_PANIC is defined. src then holds exactly the elements that 
+ *                  were not merged yet
+ */
+bool HM_merge_map_move(HM* dst, HM* src, HM_CombineFunc combine);
+
+/**
+ * \brief         adds delta to the int64_t counter for key, a missing counter starts at 0
+ * \note          hashmap must have been initialized with an element size of sizeof(int64_t)
+ * \note          rehashes once count + tombstones reaches capacity/2, at the same capacity if 
+ *                tombstones outnumber elements and at twice the capacity otherwise, thus will 
+ *                crash on allocation failure if HM_DISABLE_ALLOC_PANIC is not defined
+ * \param self:   hashmap handle 
+ * \param key:    key of counter
+ * \param delta:  amount to add
+ * \returns       pointer to the updated counter, NULL if an allocation failed **and** 
+ *                HM_DISABLE_ALLOC_PANIC is defined
+ */
+int64_t* HM_add_i64(HM* self, const char* key, int64_t delta);
+
+/**
+ * \brief           adds delta to the int64_t counter for key, a missing counter starts at 0
+ * \note            hashmap must have been initialized with an element size of sizeof(int64_t)
+ * \note            rehashes once count + tombstones reaches capacity/2, at the same capacity if 
+ *                  tombstones outnumber elements and at twice the capacity otherwise, thus will 
+ *                  crash on allocation failure if HM_DISABLE_ALLOC_PANIC is not defined
+ * \param self:     hashmap handle 
+ * \param key:      key of counter
+ * \param key_len:  length of key in bytes
+ * \param delta:    amount to add
+ * \returns         pointer to the updated counter, NULL if an allocation failed **and** 
+ *                  HM_DISABLE_ALLOC_PANIC is defined
+ */
+int64_t* HM_kwl_add_i64(HM* self, const void* key, size_t key_len, int64_t delta);
+
+/**
+ * \brief   'sized key' convenience macro for HM_kwl_add_i64, equivalent to 
+ *          'HM_kwl_add_i64(self, &(key), sizeof(key), delta)'
+ * \note    make sure to dereference if you have a pointer to your key!
+ */
+#define HM_sk_add_i64(self, key, delta)\
+  HM_kwl_add_i64(self, &(key), sizeof(key), delta)
+
 /**
  * \brief         removes a key value pair from the hashmap
  * \param self:   hashmap handle 
@@ -233,6 +502,22 @@ HM_Iterator HM_kwl_find(HM* self, const void* key, size_t key_len);
  */
 HM_Iterator HM_iterate(HM* self, HM_Iterator current);
 
+/**
+ * \brief           returns HM_Iterator for the next element stored in slot range part of nparts 
+ *                  equally sized ranges
+ * \note            ranges are disjoint and together cover every element, so they can be walked 
+ *                  by different threads at once as long as nobody modifies the map. Elements are 
+ *                  returned in slot order instead of insertion order
+ * \param self:     hashmap handle 
+ * \param current:  NULL to get a HM_Iterator for the first element of the range or previously 
+ *                  returned HM_Iterator for the next element
+ * \param part:     index of the range to walk
+ * \param nparts:   number of ranges the map is split into
+ * \return          HM_Iterator for the next element or NULL if there are no elements left in 
+ *                  the range
+ */
+HM_Iterator HM_iter_range(HM* self, HM_Iterator current, size_t part, size_t nparts);
+
 void HM_swap_order(HM* self, HM_Iterator a_it, HM_Iterator b_it);
 
 /**
@@ -275,282 +560,4754 @@ const size_t* HM_key_len_at(HM* self, HM_Iterator it);
  */
 void* HM_value_at(HM* self, HM_Iterator it);
 
-#define HM_GEN_WRAPPER_PROTOTYPE(type)\
-  bool HM_##type##_init(HM* self, size_t capacity);\
-  bool HM_##type##_set(HM* self, const char* key, type value);\
-  type* HM_##type##_value_at(HM* self, HM_Iterator it);\
-  type* HM_##type##_get(HM* self, const char* key);\
-  bool HM_##type##_kwl_set(HM* self, const void* key, size_t key_len, type value);\
-  type* HM_##type##_kwl_get(HM* self, const void* key, size_t key_len);\
+/**
+ * \brief           writes self to file in a versioned binary snapshot format
+ * \note            the snapshot stores the table as is, including the slot layout and insertion 
+ *                  order, so HM_load() does not need to rehash. It is only meant to be loaded on 
+ *                  a machine with the same byte order and word size
+ * \param self:     hashmap handle
+ * \param file:     file opened for writing in binary mode
+ * \returns         true if succesful, false if writing failed or an allocation failed **and** 
+ *                  HM_DISABLE_ALLOC_PANIC is defined
+ */
+bool HM_save(HM* self, FILE* file);
 
-#define HM_GEN_WRAPPER_IMPLEMENTATION(type)\
-  bool HM_##type##_init(HM* self, size_t capacity)\
-    { return HM_init(self, sizeof(type), capacity); }\
-  bool HM_##type##_set(HM* self, const char* key, type value)\
-    { return HM_set(self, key, &value); }\
-  type* HM_##type##_value_at(HM* self, HM_Iterator it)\
-    { return HM_value_at(self, it); }\
-  type* HM_##type##_get(HM* self, const char* key)\
-    { return HM_get(self, key); }\
-  bool HM_##type##_kwl_set(HM* self, const void* key, size_t key_len, type value)\
-    { return HM_kwl_set(self, key, key_len, &value); }\
-  type* HM_##type##_kwl_get(HM* self, const void* key, size_t key_len)\
-    { return HM_kwl_get(self, key, key_len); }\
+/**
+ * \brief             initializes self from a snapshot written by HM_save()
+ * \note              all keys are loaded into a single buffer owned by self, the snapshot's 
+ *                    checksum is verified before self is initialized
+ * \param self:       uninitialized hashmap handle
+ * \param file:       file opened for reading in binary mode, positioned at the snapshot
+ * \param hash_func:  hash function the saved map used, NULL for the default HM_HASH
+ * \returns           true if succesful, false if the snapshot is invalid, corrupted or was 
+ *                    saved with a different hash function, or if an allocation failed **and** 
+ *                    HM_DISABLE_ALLOC_PANIC is defined. self is left uninitialized on failure
+ */
+bool HM_load(HM* self, FILE* file, HM_HashFunc hash_func);
 
+/**
+ * \brief   parses the text of a value into element, returns false if text is invalid
+ */
+typedef bool (*HM_ParseFunc)(void* element, const char* text, size_t len);
 
-#ifndef HM_HASH
-#if INTPTR_MAX != INT64_MAX
-#error "HM: default hash algo only supports 64-bit, please define custom HM_HASH(str, len)"
-#endif
+/**
+ * \brief           inserts every 'key<tab>value' line of file, later lines overwrite earlier ones
+ * \note            the file is read in large chunks, with HM_ENABLE_THREADS defined on a separate 
+ *                  thread so reading and inserting overlap. Values are parsed straight into the 
+ *                  elements of the map and the map is reserved from the file size after the 
+ *                  first chunk. Empty lines are skipped, a trailing '\r' is dropped
+ * \param self:     initialized hashmap handle
+ * \param file:     file opened for reading
+ * \param parse:    parses the text after the tab into the element of the key
+ * \returns         true if succesful, false if reading failed, a line has no tab, parse failed 
+ *                  or if an allocation failed **and** HM_DISABLE_ALLOC_PANIC is defined. The 
+ *                  lines before the failing one stay inserted
+ */
+bool HM_load_tsv(HM* self, FILE* file, HM_ParseFunc parse);
 
-size_t HM_default_hash(const char *str, size_t len);
-#define HM_HASH HM_default_hash
+/**
+ * \brief           inserts every binary record of file, a record is the key length as a native 
+ *                  uint32_t, the key and the element_size bytes of the value
+ * \note            read the same way as HM_load_tsv()
+ * \param self:     initialized hashmap handle
+ * \param file:     file opened for reading in binary mode
+ * \returns         true if succesful, false if reading failed, the file ends in a partial record 
+ *                  or if an allocation failed **and** HM_DISABLE_ALLOC_PANIC is defined
+ */
+bool HM_load_records(HM* self, FILE* file);
 
-#ifdef HM_IMPLEMENTATION
+/**
+ * Read-only hashmap stored in a single flat buffer that uses offsets instead of pointers, so it 
+ * can be queried straight from a memory mapped file without deserializing it. Written with 
+ * HM_frozen_write() and opened with HM_frozen_from_memory() or HM_frozen_open().
+ */
+typedef struct{
+  const unsigned char* data;
+  size_t size;
+  size_t element_size;
+  size_t capacity;
+  size_t count;
+  size_t slot_size;
+  const unsigned char* slots;
+  const unsigned char* keys;
+  HM_HashFunc hash_func;
+  bool mapped;
+} HM_Frozen;
 
-// 64-bit fnv-1a hash function (http://isthe.com/chongo/tech/comp/fnv/)
-// !! use other version in case of non 64-bit architecture !!
-#define HM_FNV_PRIME 0x00000100000001b3
-#define HM_FNV_BASIS 0xcbf29ce484222325
-size_t HM_default_hash(const char *str, size_t len){
-    size_t hash = HM_FNV_BASIS;
-    const char* end = str + len;
-    while (str < end){
-      hash = (hash ^ (unsigned char)(*str++)) * HM_FNV_PRIME;
-    }
-    return hash;
-}
-#endif // HM_IMPLEMENTATION
-#endif // HM_HASH
+/**
+ * \brief           writes the elements of self to file in the frozen format
+ * \param self:     hashmap handle
+ * \param file:     file opened for writing in binary mode
+ * \returns         true if succesful, false if writing failed or an allocation failed **and** 
+ *                  HM_DISABLE_ALLOC_PANIC is defined
+ */
+bool HM_frozen_write(HM* self, FILE* file);
 
+/**
+ * \brief             opens a frozen map stored in memory, nothing is copied so data has to 
+ *                    outlive self and must be aligned to at least 8 bytes
+ * \param self:       handle
+ * \param data:       buffer holding what HM_frozen_write() wrote
+ * \param size:       size of data in bytes
+ * \param hash_func:  hash function of the map that was written, NULL for the default HM_HASH
+ * \returns           true if succesful, false if data is not a valid frozen map for hash_func
+ */
+bool HM_frozen_from_memory(HM_Frozen* self, const void* data, size_t size, HM_HashFunc hash_func);
 
-#ifdef HM_IMPLEMENTATION
+/**
+ * \brief           returns pointer to the element of key inside the frozen data
+ * \param self:     handle
+ * \param key:      key of the element
+ * \param key_len:  length of the key in bytes
+ * \returns         pointer to the read-only element, or NULL if not found
+ */
+const void* HM_frozen_kwl_get(const HM_Frozen* self, const void* key, size_t key_len);
+const void* HM_frozen_get(const HM_Frozen* self, const char* key);
 
-HM_Iterator HM_iterate(HM* self, HM_Iterator current){
-  if(self->count == 0) return NULL;
-  if(current == NULL){
-    return &self->first;
-  }else if(*current == self->last){
-    return NULL;
-  }else{
-    return &HM_entry_index(self, *current)->next;
-  }
-}
+/**
+ * \brief   'sized key' convenience macro for HM_frozen_kwl_get, equivalent to 
+ *          'HM_frozen_kwl_get(self, &(key), sizeof(key))'
+ * \note    make sure to dereference if you have a pointer to your key!
+ */
+#define HM_frozen_sk_get(self, key)\
+  HM_frozen_kwl_get(self, &(key), sizeof(key))
 
-void HM_swap_order(HM* self, HM_Iterator a_it, HM_Iterator b_it){
-  HM_ASSERT(a_it != NULL);
-  HM_ASSERT(b_it != NULL);
-  
-  int a = *a_it;
-  int b = *b_it;
+typedef struct{
+  const char* key;
+  size_t key_len;
+} HM_PerfectKey;
 
-  int a_prev = HM_entry_index(self, a)->prev;
-  int a_next = HM_entry_index(self, a)->next;
-  int b_prev = HM_entry_index(self, b)->prev;
-  int b_next = HM_entry_index(self, b)->next;
+/**
+ * Read-only hashmap built on a minimal perfect hash (CHD, hash and displace) of a fixed key set. 
+ * Keys are grouped into buckets and every bucket gets a displacement that sends its keys to 
+ * free positions, so the table has exactly one slot per key and a lookup is a single slot access 
+ * plus one key compare. Slot i holds keys[i] and the element at values + i*element_size.
+ * The displacements address table_size positions, slightly more than count so the last buckets 
+ * still find free positions quickly. The few keys placed at a position p >= count are stored in 
+ * slot remap[p - count], one of the slots no key was placed at.
+ */
+typedef struct{
+  const HM_PerfectKey* keys;
+  const unsigned char* values;
+  const uint32_t* displacements;
+  const size_t* remap;
+  size_t count;
+  size_t table_size;
+  size_t bucket_count;
+  size_t element_size;
+  uint64_t seed;
+  HM_HashFunc hash_func;
+  void* buffer;           // single allocation holding all of the above, NULL for static tables
+} HM_Perfect;
 
-  HM_entry_index(self, a_prev)->next = b; 
-  HM_entry_index(self, a)->prev = b_prev;
-  HM_entry_index(self, a)->next = b_next;
-  HM_entry_index(self, a_next)->prev = b;
-  
-  HM_entry_index(self, b_next)->prev = a;
-  HM_entry_index(self, b)->prev = a_prev;
-  HM_entry_index(self, b)->next = a_next;
-  HM_entry_index(self, b_prev)->next = a; 
-}
+/**
+ * \brief           builds a minimal perfect hashmap holding all elements of source
+ * \note            the keys and elements are copied, source is not modified
+ * \param self:     handle
+ * \param source:   hashmap whose elements to take, its hash function is used for the lookups
+ * \returns         true if succesful, false if an allocation failed **and** HM_DISABLE_ALLOC_PANIC 
+ *                  is defined, or if for each of HM_PERFECT_MAX_SEEDS seeds some bucket found no 
+ *                  free positions within HM_PERFECT_MAX_DISPLACEMENT displacements. With keys 
+ *                  of distinct hashes that is vanishingly unlikely, it is what happens when 
+ *                  different keys of source have identical hashes
+ */
+bool HM_perfect_build(HM_Perfect* self, HM* source);
 
-bool HM_kwl_set(HM* self, const void* key, size_t key_len, void* value){
-  if(self->count >= self->capacity/2){
-    if(!HM_grow(self)) return false;
-  }
-
-  size_t hash = self->hash_func((const char*)key, key_len) % self->capacity;
-  size_t i = hash;
-  HM_Entry* entry = HM_entry_index(self, i);
-  while(entry->key != NULL && 
-      (entry->key_len != key_len || 
-      (entry->key[0] != ((const char*)key)[0] ||
-       memcmp(entry->key, key, key_len) != 0))
-  ){
-    i = (i+1) % self->capacity;
-    HM_ASSERT(i != hash && "map is full!");
-    entry = HM_entry_index(self, i);
-  }
+/**
+ * \brief         frees a hashmap built by HM_perfect_build()
+ * \param self:   handle
+ */
+void HM_perfect_deinit(HM_Perfect* self);
 
-  // only update entries when new key is inserted
-  if(entry->key == NULL){
-    if(self->count == 0){
-      self->first = i;
-      self->last = i;
-    }else{
-      entry->prev = self->last;
-      HM_entry_index(self, self->last)->next = i;
-      self->last = i;
-    }
+/**
+ * \brief           returns pointer to the element of key
+ * \param self:     handle
+ * \param key:      key of the element
+ * \param key_len:  length of the key in bytes
+ * \returns         pointer to the read-only element, or NULL if not found
+ */
+const void* HM_perfect_kwl_get(const HM_Perfect* self, const void* key, size_t key_len);
+const void* HM_perfect_get(const HM_Perfect* self, const char* key);
 
-    // TODO use internal buffer instead of seperate heap buffer for keys
-    entry->key = (char*)HM_CALLOC(key_len, sizeof(char));
-    entry->key_len = key_len;
-    HM_CHECK_ALLOC(entry->key);
-    memcpy(entry->key, key, key_len);
-    self->count++;
-  }else{
-    HM_ASSERT(entry->key_len == key_len);
-    HM_ASSERT(memcmp(entry->key, key, key_len) == 0);
-  }
-  
-  memcpy(entry->value, value, self->element_size);
+/**
+ * \brief   'sized key' convenience macro for HM_perfect_kwl_get, equivalent to 
+ *          'HM_perfect_kwl_get(self, &(key), sizeof(key))'
+ * \note    make sure to dereference if you have a pointer to your key!
+ */
+#define HM_perfect_sk_get(self, key)\
+  HM_perfect_kwl_get(self, &(key), sizeof(key))
 
-  return true;
-}
+typedef struct HM_CowChunk HM_CowChunk;
 
-bool HM_set(HM* self, const char* key, void* value){
-  return HM_kwl_set(self, key, strlen(key), value);
-}
+/**
+ * Hashmap whose slots are split into reference counted chunks of HM_COW_CHUNK slots, so 
+ * HM_cow_fork() can hand out a logically independent copy that shares every chunk and key with 
+ * the original. Whichever side writes to a shared chunk first copies just that chunk, the memory 
+ * cost of a fork is proportional to what changes afterwards. Unlike HM the elements are not kept 
+ * in insertion order.
+ * A fork may be used on another thread than the original if HM_ENABLE_THREADS is defined, the 
+ * fork itself has to be taken while nothing writes to self.
+ */
+typedef struct{
+  HM_CowChunk** chunks;
+  size_t chunk_count;
+  size_t capacity;
+  size_t count;
+  size_t tombstones;
+  size_t element_size;
+  HM_HashFunc hash_func;
+} HM_Cow;
 
-const char* HM_key_at(HM* self, HM_Iterator it){
-  if(it == NULL) return NULL;
-  return HM_entry_index(self, *it)->key;
-}
+/**
+ * \brief                 initializes the copy-on-write hashmap
+ * \param self:           handle
+ * \param element_size:   size of the elements
+ * \param capacity:       initial capacity, 0 for HM_DEFAULT_CAPACITY
+ * \returns               true if succesful, false if an allocation failed **and** 
+ *                        HM_DISABLE_ALLOC_PANIC is defined
+ */
+bool HM_cow_init(HM_Cow* self, size_t element_size, size_t capacity);
 
-const size_t* HM_key_len_at(HM* self, HM_Iterator it){
+/**
+ * \brief         drops self's references to its chunks and keys, freeing those no fork shares
+ * \param self:   handle
+ */
+void HM_cow_deinit(HM_Cow* self);
+
+/**
+ * \brief         makes fork a snapshot of self that shares all chunks and keys with it, only 
+ *                the table of chunk pointers (capacity / HM_COW_CHUNK entries) is copied
+ * \param self:   handle
+ * \param fork:   uninitialized handle, deinitialize it with HM_cow_deinit()
+ * \returns       true if succesful, false if an allocation failed **and** 
+ *                HM_DISABLE_ALLOC_PANIC is defined
+ */
+bool HM_cow_fork(HM_Cow* self, HM_Cow* fork);
+
+/**
+ * \brief           sets value of key, copying the chunk it lands in if a fork shares it, 
+ *                  see HM_kwl_set()
+ * \returns         true if succesful, false if an allocation failed **and** 
+ *                  HM_DISABLE_ALLOC_PANIC is defined
+ */
+bool HM_cow_kwl_set(HM_Cow* self, const void* key, size_t key_len, const void* value);
+bool HM_cow_set(HM_Cow* self, const char* key, const void* value);
+
+/**
+ * \brief           returns pointer to the read-only element of key, or NULL if not found
+ * \note            the element may be shared with forks, change it through HM_cow_kwl_set()
+ */
+const void* HM_cow_kwl_get(const HM_Cow* self, const void* key, size_t key_len);
+const void* HM_cow_get(const HM_Cow* self, const char* key);
+
+/**
+ * \brief           removes a key value pair, see HM_kwl_remove()
+ * \returns         false if the chunk of key had to be copied and that allocation failed 
+ *                  **and** HM_DISABLE_ALLOC_PANIC is defined, true otherwise
+ */
+bool HM_cow_kwl_remove(HM_Cow* self, const void* key, size_t key_len);
+bool HM_cow_remove(HM_Cow* self, const char* key);
+
+/**
+ * \brief           advances to the next element, start with *position set to 0
+ * \param position: slot to continue from, updated to follow the returned element
+ * \param key:      set to the key of the element
+ * \param key_len:  set to the length of the key
+ * \param value:    set to the read-only element
+ * \returns         false if there are no more elements
+ */
+bool HM_cow_next(const HM_Cow* self, size_t* position, const char** key, size_t* key_len, const void** value);
+
+#define HM_cow_sk_set(self, key, value)\
+  HM_cow_kwl_set(self, &(key), sizeof(key), value)
+
+#define HM_cow_sk_get(self, key)\
+  HM_cow_kwl_get(self, &(key), sizeof(key))
+
+#define HM_cow_sk_remove(self, key)\
+  HM_cow_kwl_remove(self, &(key), sizeof(key))
+
+/**
+ * HS is a hashset, it shares its implementation with HM but stores no value payload at all.
+ * Iteration and the key accessors of HM (e.g. HM_iterate() and HM_key_at()) work on it as well.
+ */
+typedef HM HS;
+
+/**
+ * \brief             initializes the hashset
+ * \note              crashes if allocation failed and HM_DISABLE_ALLOC_PANIC is not defined
+ * \param self:       hashset handle
+ * \param capacity:   initial capacity of the hashset
+ * \returns           true if initialization was succesful, false if allocation failed **and** 
+ *                    HM_DISABLE_ALLOC_PANIC is defined
+ */
+bool HS_init(HS* self, size_t capacity);
+
+/**
+ * \brief         frees internal buffers
+ * \param self:   hashset handle
+ */
+void HS_deinit(HS* self);
+
+/**
+ * \brief         inserts key into the hashset, does nothing if it is already present
+ * \param self:   hashset handle 
+ * \param key:    key to insert
+ * \returns       true if insertion was succesful, false if an allocation failed **and** 
+ *                HM_DISABLE_ALLOC_PANIC is defined
+ */
+bool HS_insert(HS* self, const char* key);
+
+/**
+ * \brief           inserts key into the hashset, does nothing if it is already present
+ * \param self:     hashset handle 
+ * \param key:      key to insert
+ * \param key_len:  length of key in bytes
+ * \returns         true if insertion was succesful, false if an allocation failed **and** 
+ *                  HM_DISABLE_ALLOC_PANIC is defined
+ */
+bool HS_kwl_insert(HS* self, const void* key, size_t key_len);
+
+/**
+ * \brief   'sized key' convenience macro for HS_kwl_insert, equivalent to 
+ *          'HS_kwl_insert(self, &(key), sizeof(key))'
+ * \note    make sure to dereference if you have a pointer to your key!
+ */
+#define HS_sk_insert(self, key)\
+  HS_kwl_insert(self, &(key), sizeof(key))
+
+/**
+ * \brief         returns whether key is present in the hashset
+ * \param self:   hashset handle 
+ * \param key:    key to lookup
+ */
+bool HS_contains(HS* self, const char* key);
+
+/**
+ * \brief           returns whether key is present in the hashset
+ * \param self:     hashset handle 
+ * \param key:      key to lookup
+ * \param key_len:  length of key in bytes
+ */
+bool HS_kwl_contains(HS* self, const void* key, size_t key_len);
+
+/**
+ * \brief   'sized key' convenience macro for HS_kwl_contains, equivalent to 
+ *          'HS_kwl_contains(self, &(key), sizeof(key))'
+ * \note    make sure to dereference if you have a pointer to your key!
+ */
+#define HS_sk_contains(self, key)\
+  HS_kwl_contains(self, &(key), sizeof(key))
+
+/**
+ * \brief         removes key from the hashset
+ * \param self:   hashset handle 
+ * \param key:    key to remove
+ */
+void HS_remove(HS* self, const char* key);
+
+/**
+ * \brief           removes key from the hashset
+ * \param self:     hashset handle 
+ * \param key:      key to remove
+ * \param key_len:  length of key in bytes
+ */
+void HS_kwl_remove(HS* self, const void* key, size_t key_len);
+
+/**
+ * \brief   'sized key' convenience macro for HS_kwl_remove, equivalent to 
+ *          'HS_kwl_remove(self, &(key), sizeof(key))'
+ * \note    make sure to dereference if you have a pointer to your key!
+ */
+#define HS_sk_remove(self, key)\
+  HS_kwl_remove(self, &(key), sizeof(key))
+
+/**
+ * \brief         initializes out as the intersection of a and b
+ * \note          iterates the smaller set and probes the larger one in prefetched batches, 
+ *                out is pre-sized so it never has to grow
+ * \param out:    uninitialized hashset handle for the result
+ * \param a:      hashset handle
+ * \param b:      hashset handle
+ * \returns       true if succesful, false if an allocation failed **and** HM_DISABLE_ALLOC_PANIC 
+ *                is defined, in which case out is left uninitialized
+ */
+bool HS_intersect(HS* out, HS* a, HS* b);
+
+/**
+ * \brief         initializes out as the union of a and b
+ * \param out:    uninitialized hashset handle for the result
+ * \param a:      hashset handle
+ * \param b:      hashset handle
+ * \returns       true if succesful, false if an allocation failed **and** HM_DISABLE_ALLOC_PANIC 
+ *                is defined, in which case out is left uninitialized
+ */
+bool HS_union(HS* out, HS* a, HS* b);
+
+/**
+ * \brief         initializes out as the keys of a that are not in b
+ * \param out:    uninitialized hashset handle for the result
+ * \param a:      hashset handle
+ * \param b:      hashset handle
+ * \returns       true if succesful, false if an allocation failed **and** HM_DISABLE_ALLOC_PANIC 
+ *                is defined, in which case out is left uninitialized
+ */
+bool HS_difference(HS* out, HS* a, HS* b);
+
+#define HM_GEN_WRAPPER_PROTOTYPE(type)\
+  bool HM_##type##_init(HM* self, size_t capacity);\
+  bool HM_##type##_set(HM* self, const char* key, type value);\
+  type* HM_##type##_value_at(HM* self, HM_Iterator it);\
+  type* HM_##type##_get(HM* self, const char* key);\
+  bool HM_##type##_kwl_set(HM* self, const void* key, size_t key_len, type value);\
+  type* HM_##type##_kwl_get(HM* self, const void* key, size_t key_len);\
+  type* HM_##type##_get_or_insert(HM* self, const char* key, bool* inserted);\
+  type* HM_##type##_kwl_get_or_insert(HM* self, const void* key, size_t key_len, bool* inserted);\
+  type* HM_##type##_emplace(HM* self, const char* key);\
+  type* HM_##type##_kwl_emplace(HM* self, const void* key, size_t key_len);\
+  type* HM_##type##_kwl_merge(HM* self, const void* key, size_t key_len, type value, HM_CombineFunc combine);\
+
+#define HM_GEN_WRAPPER_IMPLEMENTATION(type)\
+  bool HM_##type##_init(HM* self, size_t capacity)\
+    { return HM_init(self, sizeof(type), capacity); }\
+  bool HM_##type##_set(HM* self, const char* key, type value)\
+    { return HM_set(self, key, &value); }\
+  type* HM_##type##_value_at(HM* self, HM_Iterator it)\
+    { return HM_value_at(self, it); }\
+  type* HM_##type##_get(HM* self, const char* key)\
+    { return HM_get(self, key); }\
+  bool HM_##type##_kwl_set(HM* self, const void* key, size_t key_len, type value)\
+    { return HM_kwl_set(self, key, key_len, &value); }\
+  type* HM_##type##_kwl_get(HM* self, const void* key, size_t key_len)\
+    { return HM_kwl_get(self, key, key_len); }\
+  type* HM_##type##_get_or_insert(HM* self, const char* key, bool* inserted)\
+    { return HM_get_or_insert(self, key, inserted); }\
+  type* HM_##type##_kwl_get_or_insert(HM* self, const void* key, size_t key_len, bool* inserted)\
+    { return HM_kwl_get_or_insert(self, key, key_len, inserted); }\
+  type* HM_##type##_emplace(HM* self, const char* key)\
+    { return HM_emplace(self, key); }\
+  type* HM_##type##_kwl_emplace(HM* self, const void* key, size_t key_len)\
+    { return HM_kwl_emplace(self, key, key_len); }\
+  type* HM_##type##_kwl_merge(HM* self, const void* key, size_t key_len, type value, HM_CombineFunc combine)\
+    { return HM_kwl_merge(self, key, key_len, &value, combine); }\
+
+
+#ifdef HM_ENABLE_THREADS
+
+/**
+ * \brief                 like HS_intersect() but probes disjoint slot ranges of the smaller set 
+ *                        on thread_count threads, the result is inserted by the calling thread
+ * \param thread_count:   number of threads to use, 0 or 1 behaves like HS_intersect()
+ */
+bool HS_intersect_parallel(HS* out, HS* a, HS* b, size_t thread_count);
+
+/**
+ * \brief                 like HS_union() but probes on thread_count threads
+ * \param thread_count:   number of threads to use, 0 or 1 behaves like HS_union()
+ */
+bool HS_union_parallel(HS* out, HS* a, HS* b, size_t thread_count);
+
+/**
+ * \brief                 like HS_difference() but probes on thread_count threads
+ * \param thread_count:   number of threads to use, 0 or 1 behaves like HS_difference()
+ */
+bool HS_difference_parallel(HS* out, HS* a, HS* b, size_t thread_count);
+
+typedef struct{
+  _Alignas(HM_CACHE_LINE) _Atomic size_t epoch; // 0 while the reader is outside of a read section
+  atomic_bool in_use;
+} HM_ReaderSlot;
+
+/**
+ * Epoch based reclamation: readers announce the epoch they entered in, a writer that unpublished
+ * something waits in HM_epoch_synchronize() until no reader can still be looking at it.
+ * Every reader gets its own cache line so readers never write to shared memory.
+ */
+typedef struct{
+  _Alignas(HM_CACHE_LINE) _Atomic size_t global;
+  HM_ReaderSlot readers[HM_MAX_READERS];
+} HM_Epoch;
+
+void HM_epoch_init(HM_Epoch* self);
+int HM_epoch_register(HM_Epoch* self);
+void HM_epoch_unregister(HM_Epoch* self, int reader);
+void HM_epoch_enter(HM_Epoch* self, int reader);
+void HM_epoch_exit(HM_Epoch* self, int reader);
+void HM_epoch_synchronize(HM_Epoch* self);
+
+/**
+ * Read-mostly hashmap where lookups take no lock. Writers work on a private copy of the 
+ * current table and publish it with a single atomic store, the previous table is freed once 
+ * every reader has left the epoch it may have seen it in.
+ */
+typedef struct{
+  _Alignas(HM_CACHE_LINE) _Atomic(HM*) table;   // read by every lookup, kept off the writer's lines
+  _Alignas(HM_CACHE_LINE) pthread_mutex_t write_lock;
+  HM_Epoch epoch;
+} HM_RCU;
+
+/**
+ * \brief                 initializes the read-mostly hashmap
+ * \param self:           handle
+ * \param element_size:   size of the element type the hashmap will store
+ * \param capacity:       initial capacity of the hashmap
+ * \returns               true if initialization was succesful, false if allocation failed **and** 
+ *                        HM_DISABLE_ALLOC_PANIC is defined
+ */
+bool HM_rcu_init(HM_RCU* self, size_t element_size, size_t capacity);
+
+/**
+ * \brief         frees the published table, no readers or writers may be active
+ * \param self:   handle
+ */
+void HM_rcu_deinit(HM_RCU* self);
+
+/**
+ * \brief         registers the calling thread as reader, every reading thread needs its own id
+ * \param self:   handle
+ * \returns       reader id, -1 if HM_MAX_READERS readers are already registered
+ */
+int HM_rcu_register_reader(HM_RCU* self);
+
+/**
+ * \brief           releases a reader id obtained by HM_rcu_register_reader()
+ * \param self:     handle
+ * \param reader:   reader id
+ */
+void HM_rcu_unregister_reader(HM_RCU* self, int reader);
+
+/**
+ * \brief           enters a read section and returns the current table, the table stays valid 
+ *                  and unchanged until HM_rcu_read_unlock() so multiple lookups can be done on it
+ * \note            the returned table must only be read from
+ * \param self:     handle
+ * \param reader:   reader id of the calling thread
+ */
+HM* HM_rcu_read_lock(HM_RCU* self, int reader);
+
+/**
+ * \brief           leaves the read section entered by HM_rcu_read_lock()
+ * \param self:     handle
+ * \param reader:   reader id of the calling thread
+ */
+void HM_rcu_read_unlock(HM_RCU* self, int reader);
+
+/**
+ * \brief           copies the element associated with key into value if available
+ * \param self:     handle
+ * \param reader:   reader id of the calling thread
+ * \param key:      key to lookup
+ * \param key_len:  length of the given key
+ * \param value:    output buffer of at least element_size bytes
+ * \returns         true if the key was found
+ */
+bool HM_rcu_kwl_get(HM_RCU* self, int reader, const void* key, size_t key_len, void* value);
+
+/**
+ * \brief           copies the element associated with key into value if available
+ * \returns         true if the key was found
+ */
+bool HM_rcu_get(HM_RCU* self, int reader, const char* key, void* value);
+
+/**
+ * \brief         starts a batch of writes, blocks other writers until HM_rcu_write_commit()
+ * \param self:   handle
+ * \returns       private copy of the current table that can be modified with the regular HM api,
+ *                NULL if an allocation failed **and** HM_DISABLE_ALLOC_PANIC is defined
+ */
+HM* HM_rcu_write_begin(HM_RCU* self);
+
+/**
+ * \brief         publishes the table returned by HM_rcu_write_begin() and frees the previous one
+ *                after all readers that could see it have left their read section
+ * \param self:   handle
+ * \param table:  table returned by HM_rcu_write_begin()
+ */
+void HM_rcu_write_commit(HM_RCU* self, HM* table);
+
+/**
+ * \brief         inserts a single key value pair, equivalent to a write batch of one HM_kwl_set()
+ * \note          copies the whole table so every call is O(n), use HM_rcu_write_begin() and 
+ *                HM_rcu_write_commit() to pay for the copy once per batch of writes
+ * \returns       true if insertion was succesful, false if an allocation failed **and** 
+ *                HM_DISABLE_ALLOC_PANIC is defined
+ */
+bool HM_rcu_kwl_set(HM_RCU* self, const void* key, size_t key_len, void* value);
+
+/**
+ * \brief         removes a single key, equivalent to a write batch of one HM_kwl_remove()
+ * \note          O(n) like HM_rcu_kwl_set()
+ * \returns       true if succesful, false if an allocation failed **and** 
+ *                HM_DISABLE_ALLOC_PANIC is defined
+ */
+bool HM_rcu_kwl_remove(HM_RCU* self, const void* key, size_t key_len);
+
+/**
+ * Double buffered map for data that is rebuilt from scratch rather than updated, e.g. a config 
+ * reloaded every few seconds. The writer fills a fresh HM on its own and publishes it in one 
+ * atomic swap, readers never see a partially built table. HM_DoubleBuffer is an HM_RCU so it 
+ * is initialized and read with the HM_rcu_* functions.
+ */
+typedef HM_RCU HM_DoubleBuffer;
+
+/**
+ * \brief         replaces the published table with fresh and frees the previous table once no 
+ *                reader can still be using it
+ * \note          blocks until every reader that might see the previous table has left its read 
+ *                section, only one publish or HM_rcu write runs at a time
+ * \param self:   handle
+ * \param fresh:  fully built hashmap, its buffers are taken over and the handle is zeroed so it 
+ *                must not be deinitialized by the caller
+ * \returns       true if succesful, false if an allocation failed **and** 
+ *                HM_DISABLE_ALLOC_PANIC is defined, fresh is left untouched in that case
+ */
+bool HM_double_buffer_publish(HM_DoubleBuffer* self, HM* fresh);
+
+typedef struct{
+  pthread_mutex_t lock;
+  HM map;
+  char padding[HM_CACHE_LINE];
+} HM_Shard;
+
+/**
+ * Thread-safe hashmap made up of independent HM shards with a lock each, the shard of a key is 
+ * picked by the high bits of its hash while the shard itself uses the low bits. A shard grows 
+ * on its own so a resize only blocks the keys that live in that shard.
+ */
+typedef struct{
+  HM_Shard* shards;
+  size_t shard_count;
+  size_t shard_shift;
+  size_t element_size;
+  HM_HashFunc hash_func;
+} HM_Sharded;
+
+/**
+ * \brief                 initializes the sharded hashmap
+ * \param self:           handle
+ * \param element_size:   size of the element type the hashmap will store
+ * \param capacity:       initial capacity of the whole hashmap, split over the shards
+ * \param shard_count:    number of shards, rounded up to a power of two
+ * \returns               true if initialization was succesful, false if allocation failed **and** 
+ *                        HM_DISABLE_ALLOC_PANIC is defined
+ */
+bool HM_sharded_init(HM_Sharded* self, size_t element_size, size_t capacity, size_t shard_count);
+
+/**
+ * \brief         frees all shards, no other thread may be using the hashmap
+ * \param self:   handle
+ */
+void HM_sharded_deinit(HM_Sharded* self);
+
+/**
+ * \brief         returns the shard index responsible for hash
+ */
+size_t HM_sharded_shard_of(HM_Sharded* self, size_t hash);
+
+/**
+ * \brief           inserts a key value pair, see HM_kwl_set()
+ * \returns         true if insertion was succesful, false if an allocation failed **and** 
+ *                  HM_DISABLE_ALLOC_PANIC is defined
+ */
+bool HM_sharded_kwl_set(HM_Sharded* self, const void* key, size_t key_len, void* value);
+bool HM_sharded_set(HM_Sharded* self, const char* key, void* value);
+
+/**
+ * \brief           copies the element associated with key into value if available
+ * \param value:    output buffer of at least element_size bytes
+ * \returns         true if the key was found
+ */
+bool HM_sharded_kwl_get(HM_Sharded* self, const void* key, size_t key_len, void* value);
+bool HM_sharded_get(HM_Sharded* self, const char* key, void* value);
+
+/**
+ * \brief           removes a key value pair, see HM_kwl_remove()
+ */
+void HM_sharded_kwl_remove(HM_Sharded* self, const void* key, size_t key_len);
+void HM_sharded_remove(HM_Sharded* self, const char* key);
+
+/**
+ * \brief           inserts or combines value into the element of key, see HM_kwl_merge()
+ * \returns         true if succesful, false if an allocation failed **and** 
+ *                  HM_DISABLE_ALLOC_PANIC is defined
+ */
+bool HM_sharded_kwl_merge(HM_Sharded* self, const void* key, size_t key_len, const void* value, HM_CombineFunc combine);
+
+/**
+ * \brief         calls fn for every element, one shard at a time while holding that shard's lock
+ * \note          fn receives the shard's HM so the regular HM_key_at()/HM_value_at() can be used
+ * \param self:   handle
+ * \param fn:     function called for every element
+ * \param ctx:    passed to fn
+ */
+void HM_sharded_for_each(HM_Sharded* self, HM_ForEachFunc fn, void* ctx);
+
+/**
+ * Per-thread write-combining buffer in front of an HM_Sharded. Updates are combined into a 
+ * private HM without any locking and flushed into the shared map in batches, taking every 
+ * shard lock at most once per flush. Each thread owns its own HM_Combiner.
+ */
+typedef struct{
+  HM local;
+  HM_Sharded* target;
+  HM_CombineFunc combine;
+  size_t flush_threshold;
+} HM_Combiner;
+
+/**
+ * \brief                   initializes a combiner for target
+ * \note                    combine has to be associative, e.g. adding counters, so that combining 
+ *                          the deltas locally first gives the same result as merging them one by one
+ * \param self:             handle
+ * \param target:           shared map the deltas are flushed into
+ * \param combine:          combines a delta into an existing element, used both locally and on flush
+ * \param flush_threshold:  number of distinct buffered keys at which the buffer is flushed 
+ *                          automatically, 0 to only flush on HM_combiner_flush()
+ * \returns                 true if initialization was succesful, false if allocation failed **and** 
+ *                          HM_DISABLE_ALLOC_PANIC is defined
+ */
+bool HM_combiner_init(HM_Combiner* self, HM_Sharded* target, HM_CombineFunc combine, size_t flush_threshold);
+
+/**
+ * \brief         frees the buffer, deltas that were not flushed are discarded
+ * \param self:   handle
+ */
+void HM_combiner_deinit(HM_Combiner* self);
+
+/**
+ * \brief           buffers value as a delta for key, flushing if the threshold is reached
+ * \returns         true if succesful, false if an allocation failed **and** 
+ *                  HM_DISABLE_ALLOC_PANIC is defined
+ */
+bool HM_combiner_kwl_merge(HM_Combiner* self, const void* key, size_t key_len, const void* value);
+bool HM_combiner_merge(HM_Combiner* self, const char* key, const void* value);
+
+/**
+ * \brief   'sized key' convenience macro for HM_combiner_kwl_merge, equivalent to 
+ *          'HM_combiner_kwl_merge(self, &(key), sizeof(key), value)'
+ * \note    make sure to dereference if you have a pointer to your key!
+ */
+#define HM_combiner_sk_merge(self, key, value)\
+  HM_combiner_kwl_merge(self, &(key), sizeof(key), value)
+
+/**
+ * \brief         merges all buffered deltas into the target map and empties the buffer
+ * \note          if an allocation fails the deltas that were not merged yet stay buffered
+ * \param self:   handle
+ * \returns       true if succesful, false if an allocation failed **and** 
+ *                HM_DISABLE_ALLOC_PANIC is defined
+ */
+bool HM_combiner_flush(HM_Combiner* self);
+
+/**
+ * Hashmap that grows on a helper thread instead of stalling the inserting thread. Once the 
+ * table is 3/4 of the way to its growth point a helper thread starts building the bigger 
+ * table, meanwhile the table is only read and writes go to a small delta map whose entries are 
+ * moved into the new table when it is swapped in. Once the delta holds 
+ * capacity/HM_ASYNC_DELTA_DIVISOR elements writes make the caller wait for the helper, and 
+ * without a resize in progress the table grows synchronously like a regular HM.
+ * Like HM it is meant to be used by a single thread, the helper thread is internal.
+ */
+typedef struct{
+  HM table;
+  HM delta;       // writes made while the table is being resized
+  HS removed;     // keys of table removed while it is being resized
+  HM resized;     // built by the helper thread
+  pthread_t helper;
+  atomic_bool ready;
+  bool resizing;
+  bool resize_ok;
+  size_t resize_capacity;
+  size_t delta_limit;
+  size_t count;
+} HM_Async;
+
+/**
+ * \brief                 initializes the hashmap, see HM_init()
+ * \returns               true if initialization was succesful, false if allocation failed **and** 
+ *                        HM_DISABLE_ALLOC_PANIC is defined
+ */
+bool HM_async_init(HM_Async* self, size_t element_size, size_t capacity);
+
+/**
+ * \brief         waits for a running resize and frees all buffers
+ * \param self:   handle
+ */
+void HM_async_deinit(HM_Async* self);
+
+/**
+ * \brief           inserts a key value pair, see HM_kwl_set()
+ * \returns         true if insertion was succesful, false if an allocation failed **and** 
+ *                  HM_DISABLE_ALLOC_PANIC is defined
+ */
+bool HM_async_kwl_set(HM_Async* self, const void* key, size_t key_len, void* value);
+bool HM_async_set(HM_Async* self, const char* key, void* value);
+
+/**
+ * \brief           copies the element associated with key into value if available
+ * \note            elements are copied out because the table may be read by the helper thread
+ * \param value:    output buffer of at least element_size bytes
+ * \returns         true if the key was found
+ */
+bool HM_async_kwl_get(HM_Async* self, const void* key, size_t key_len, void* value);
+bool HM_async_get(HM_Async* self, const char* key, void* value);
+
+/**
+ * \brief           removes a key value pair, see HM_kwl_remove()
+ * \returns         true if succesful, false if an allocation failed **and** 
+ *                  HM_DISABLE_ALLOC_PANIC is defined
+ */
+bool HM_async_kwl_remove(HM_Async* self, const void* key, size_t key_len);
+bool HM_async_remove(HM_Async* self, const char* key);
+
+/**
+ * \brief         waits for a running resize and swaps the new table in, afterwards self->table 
+ *                holds every element and can be iterated or read directly until the next write
+ * \param self:   handle
+ * \returns       true if succesful, false if an allocation failed **and** 
+ *                HM_DISABLE_ALLOC_PANIC is defined
+ */
+bool HM_async_finish(HM_Async* self);
+
+#ifdef HM_ENABLE_NUMA
+/**
+ * \brief                 initializes the sharded hashmap like HM_sharded_init() but spreads the 
+ *                        shard tables evenly over the NUMA nodes, shard i is placed on node 
+ *                        i % node count
+ * \note                  keys are spread over all shards by hash, so this balances memory and 
+ *                        memory bandwidth across the nodes rather than making lookups local, see 
+ *                        HM_Replicated for node local reads
+ * \note                  tables are placed when they are allocated, a shard that grows later 
+ *                        allocates on the inserting thread's node and keys are always allocated 
+ *                        by the inserting thread. Pass a capacity that fits the expected data
+ * \returns               true if initialization was succesful, false if allocation failed **and** 
+ *                        HM_DISABLE_ALLOC_PANIC is defined
+ */
+bool HM_sharded_init_numa(HM_Sharded* self, size_t element_size, size_t capacity, size_t shard_count);
+
+/**
+ * Read-only copies of an HM, one per NUMA node, each allocated by a thread running on that node 
+ * so the table and its keys live in the node's local memory. Lookups go to the copy of the node 
+ * the calling thread currently runs on. To change the data build a new HM_Replicated.
+ */
+typedef struct{
+  HM* replicas;
+  size_t node_count;
+  int* cpu_nodes;
+  size_t cpu_count;
+} HM_Replicated;
+
+/**
+ * \brief           creates a copy of source on every NUMA node
+ * \param self:     handle
+ * \param source:   hashmap to copy, it is not modified and can be deinitialized afterwards
+ * \returns         true if succesful, false if allocation failed **and** 
+ *                  HM_DISABLE_ALLOC_PANIC is defined
+ */
+bool HM_replicated_init(HM_Replicated* self, HM* source);
+
+/**
+ * \brief         frees all copies, no other thread may be using them
+ * \param self:   handle
+ */
+void HM_replicated_deinit(HM_Replicated* self);
+
+/**
+ * \brief         returns the copy local to the node the calling thread runs on
+ * \note          the returned HM must only be read from
+ * \param self:   handle
+ */
+HM* HM_replicated_local(HM_Replicated* self);
+
+/**
+ * \brief           looks up key in the copy local to the calling thread, see HM_kwl_get()
+ * \returns         pointer to the element inside the local copy, or NULL if not found
+ */
+void* HM_replicated_kwl_get(HM_Replicated* self, const void* key, size_t key_len);
+void* HM_replicated_get(HM_Replicated* self, const char* key);
+
+/**
+ * \brief   'sized key' convenience macro for HM_replicated_kwl_get, equivalent to 
+ *          'HM_replicated_kwl_get(self, &(key), sizeof(key))'
+ * \note    make sure to dereference if you have a pointer to your key!
+ */
+#define HM_replicated_sk_get(self, key)\
+  HM_replicated_kwl_get(self, &(key), sizeof(key))
+#endif // HM_ENABLE_NUMA
+
+/**
+ * \brief                 initializes self with count key value pairs, inserting them concurrently
+ * \note                  the input is partitioned by the home slot of each key's hash so every 
+ *                        thread fills its own range of the table, keys that overflow their range 
+ *                        are placed afterwards. The result is identical to calling HM_kwl_set() 
+ *                        for every pair in order, including insertion order and duplicate keys
+ * \note                  HM_CALLOC and HM_FREE have to be thread-safe
+ * \param self:           uninitialized hashmap handle
+ * \param element_size:   size of the element type the hashmap will store
+ * \param keys:           array of count keys
+ * \param key_lens:       array of count key lengths, NULL if the keys are null terminated strings
+ * \param values:         array of count elements of element_size bytes each
+ * \param count:          number of key value pairs
+ * \param thread_count:   number of threads to use
+ * \returns               true if succesful, false if an allocation failed **and** 
+ *                        HM_DISABLE_ALLOC_PANIC is defined, in which case self is left uninitialized
+ */
+bool HM_build_parallel(HM* self, size_t element_size, const void* const* keys, const size_t* key_lens, 
+    const void* values, size_t count, size_t thread_count);
+
+/**
+ * \brief                 calls func for every element of self, splitting the slots into 
+ *                        thread_count ranges that are each walked by their own thread
+ * \note                  self must not be modified until the call returns, the HM_Iterator 
+ *                        passed to func is only valid for the duration of that call
+ * \param self:           hashmap handle
+ * \param func:           function called for every element
+ * \param ctxs:           array of thread_count contexts of ctx_size bytes, the thread walking 
+ *                        range t passes the context at ctxs + t*ctx_size to func. Results can be 
+ *                        accumulated per context and combined afterwards without locking
+ * \param ctx_size:       size of a single context, 0 to pass ctxs to every call
+ * \param thread_count:   number of threads to use
+ */
+void HM_parallel_for_each(HM* self, HM_ForEachFunc func, void* ctxs, size_t ctx_size, size_t thread_count);
+
+/**
+ * \brief                 makes every following rehash of self, by HM_grow(), HM_reserve() or an 
+ *                        insert, reinsert the entries with thread_count threads once self holds 
+ *                        at least HM_PARALLEL_GROW_MIN entries
+ * \note                  the table is split into slot ranges that are filled concurrently, the 
+ *                        insertion order is carried over unchanged
+ * \note                  HM_CALLOC and HM_FREE have to be thread-safe
+ * \param self:           hashmap handle
+ * \param thread_count:   number of threads to rehash with, 0 or 1 to rehash serially (default)
+ */
+void HM_set_grow_threads(HM* self, size_t thread_count);
+
+// key reserved to mark unclaimed slots of HM_LockFree
+#define HM_LF_EMPTY_KEY 0
+// largest value HM_LockFree can store, the values above it are used as slot states
+#define HM_LF_VALUE_MAX ((uint64_t)INT64_MAX - 2)
+
+typedef struct{
+  _Atomic uint64_t key;
+  _Atomic uint64_t value;
+} HM_LFSlot;
+
+typedef struct HM_LFTable{
+  size_t capacity;
+  _Atomic size_t used;
+  _Atomic size_t copy_index;
+  _Atomic size_t copied;
+  _Atomic(struct HM_LFTable*) next;
+  struct HM_LFTable* retired_next;
+  size_t retired_epoch;
+  HM_LFSlot slots[];
+} HM_LFTable;
+
+// operations in flight of the threads sharing this slot, by the epoch they started in modulo 3
+typedef struct{
+  _Alignas(HM_CACHE_LINE) _Atomic size_t active[3];
+} HM_LFReaderSlot;
+
+/**
+ * Lock-free open addressing hashmap from uint64_t keys to uint64_t values built on C11 atomics.
+ * Slot keys are claimed with CAS and values are updated with CAS, so every operation is 
+ * linearizable. When a table fills up a larger one is linked behind it and every thread that 
+ * touches the old table helps moving its slots over, a slot's value is marked while it is 
+ * being copied so no update can get lost in between.
+ * Tables that have been migrated away from are retired and freed by epoch based reclamation 
+ * once no operation that could still reach them is running. Every operation counts itself 
+ * in the slot of its thread (threads share slots beyond HM_MAX_READERS), so there is nothing 
+ * to register.
+ * \note keys must not be HM_LF_EMPTY_KEY and values must not exceed HM_LF_VALUE_MAX
+ */
+typedef struct{
+  _Atomic(HM_LFTable*) top;
+  _Atomic(HM_LFTable*) retired;
+  _Atomic size_t epoch;
+  _Atomic size_t count;
+  _Atomic size_t table_count;   // tables allocated and not freed yet, including retired ones
+  HM_LFReaderSlot readers[HM_MAX_READERS];
+} HM_LockFree;
+
+/**
+ * \brief             initializes the lock-free hashmap
+ * \param self:       handle
+ * \param capacity:   initial capacity, rounded up to a power of two
+ * \returns           true if initialization was succesful, false if allocation failed **and** 
+ *                    HM_DISABLE_ALLOC_PANIC is defined
+ */
+bool HM_lf_init(HM_LockFree* self, size_t capacity);
+
+/**
+ * \brief         frees all tables, no other thread may be using the hashmap
+ * \param self:   handle
+ */
+void HM_lf_deinit(HM_LockFree* self);
+
+/**
+ * \brief         looks up the value of key
+ * \param value:  set to the value of key if found
+ * \returns       true if the key was found
+ */
+bool HM_lf_get(HM_LockFree* self, uint64_t key, uint64_t* value);
+
+/**
+ * \brief         sets the value of key
+ * \returns       true if succesful, false if a resize failed to allocate **and** 
+ *                HM_DISABLE_ALLOC_PANIC is defined
+ */
+bool HM_lf_set(HM_LockFree* self, uint64_t key, uint64_t value);
+
+/**
+ * \brief         atomically adds delta to the value of key, a missing key starts at 0
+ * \param result: optional (may be NULL), set to the value after the addition
+ * \returns       true if succesful, false if a resize failed to allocate **and** 
+ *                HM_DISABLE_ALLOC_PANIC is defined
+ */
+bool HM_lf_add(HM_LockFree* self, uint64_t key, uint64_t delta, uint64_t* result);
+
+/**
+ * \brief         removes key from the hashmap
+ */
+void HM_lf_remove(HM_LockFree* self, uint64_t key);
+
+/**
+ * \brief         returns the number of keys that currently have a value
+ */
+size_t HM_lf_count(HM_LockFree* self);
+
+#endif // HM_ENABLE_THREADS
+
+#ifdef HM_ENABLE_POSIX
+/**
+ * \brief             maps the frozen map file at path read-only into memory, the pages are 
+ *                    shared with every other process that maps the same file
+ * \param self:       handle
+ * \param path:       file written by HM_frozen_write()
+ * \param hash_func:  hash function of the map that was written, NULL for the default HM_HASH
+ * \returns           true if succesful, false if the file could not be mapped or is not a valid 
+ *                    frozen map for hash_func
+ */
+bool HM_frozen_open(HM_Frozen* self, const char* path, HM_HashFunc hash_func);
+
+/**
+ * \brief         unmaps a frozen map opened with HM_frozen_open()
+ * \param self:   handle
+ */
+void HM_frozen_close(HM_Frozen* self);
+
+/**
+ * Hashmap that lives in two memory mapped files, the table at path and the key heap at 
+ * path + ".keys". Slots refer to keys by offset instead of by pointer, so the map survives 
+ * restarts without a reload and may be larger than RAM, the page cache decides which parts 
+ * are resident. Both files grow with ftruncate() and are mapped again when they run full.
+ */
+typedef struct{
+  int fd;
+  int key_fd;
+  unsigned char* table;   // header followed by the slots
+  size_t table_size;
+  char* keys;
+  size_t keys_size;
+  size_t element_size;
+  size_t slot_size;
+  HM_HashFunc hash_func;
+} HM_Persistent;
+
+/**
+ * \brief               opens the persistent map at path, creating it if it does not exist
+ * \param self:         handle
+ * \param path:         table file, the keys are stored in path + ".keys"
+ * \param element_size: size of the elements, must match the size the map was created with
+ * \param hash_func:    hash function, NULL for the default HM_HASH, must match the function the 
+ *                      map was created with
+ * \returns             true if succesful, false if the files could not be opened or mapped or 
+ *                      do not hold a valid map for element_size and hash_func
+ */
+bool HM_persistent_open(HM_Persistent* self, const char* path, size_t element_size, HM_HashFunc hash_func);
+
+/**
+ * \brief         unmaps the map and closes its files, call HM_persistent_sync() first if the 
+ *                changes have to be on disk rather than in the page cache
+ * \param self:   handle
+ */
+void HM_persistent_close(HM_Persistent* self);
+
+/**
+ * \brief         writes all changes of the mapped files to disk
+ * \note          a crash while the table grows leaves the table file inconsistent, sync before 
+ *                relying on the file after a crash
+ * \returns       true if succesful, false if msync() failed
+ */
+bool HM_persistent_sync(HM_Persistent* self);
+
+/**
+ * \brief           sets value of key, see HM_kwl_set()
+ * \note            may grow and remap the files, which invalidates pointers returned by 
+ *                  HM_persistent_kwl_get()
+ * \returns         true if succesful, false if a file could not be grown or mapped
+ */
+bool HM_persistent_kwl_set(HM_Persistent* self, const void* key, size_t key_len, const void* value);
+bool HM_persistent_set(HM_Persistent* self, const char* key, const void* value);
+
+/**
+ * \brief           returns pointer to the element of key inside the mapped table, see HM_kwl_get()
+ */
+void* HM_persistent_kwl_get(HM_Persistent* self, const void* key, size_t key_len);
+void* HM_persistent_get(HM_Persistent* self, const char* key);
+
+/**
+ * \brief           removes a key value pair, see HM_kwl_remove()
+ * \note            the key heap is append only, the bytes of removed keys are not reused
+ */
+void HM_persistent_kwl_remove(HM_Persistent* self, const void* key, size_t key_len);
+void HM_persistent_remove(HM_Persistent* self, const char* key);
+
+/**
+ * \brief         returns the number of elements in the map
+ */
+size_t HM_persistent_count(HM_Persistent* self);
+
+#define HM_persistent_sk_set(self, key, value)\
+  HM_persistent_kwl_set(self, &(key), sizeof(key), value)
+
+#define HM_persistent_sk_get(self, key)\
+  HM_persistent_kwl_get(self, &(key), sizeof(key))
+
+#define HM_persistent_sk_remove(self, key)\
+  HM_persistent_kwl_remove(self, &(key), sizeof(key))
+
+/**
+ * Hashmap made durable by an append-only write-ahead log. Every change appends a compact 
+ * set or remove record (type, key length, key, value and a checksum) to the log, fsync() is 
+ * batched over group_size records (group commit) and HM_journal_compact() folds the log into 
+ * an HM_save() snapshot. Opening loads the snapshot and replays the log, a record torn by a 
+ * crash is cut off.
+ */
+typedef struct{
+  HM map;
+  FILE* log;
+  char* snapshot_path;
+  size_t pending;       // records appended since the last commit
+  size_t group_size;    // records per fsync(), 0 to only commit in HM_journal_commit()
+} HM_Journal;
+
+/**
+ * \brief               opens a journaled map, restoring the state of the snapshot and the log 
+ *                      if they exist and creating them otherwise
+ * \param self:         handle
+ * \param snapshot_path:snapshot written by HM_journal_compact()
+ * \param log_path:     write-ahead log
+ * \param element_size: size of the elements, must match the size the map was created with
+ * \param hash_func:    hash function, NULL for the default HM_HASH
+ * \returns             true if succesful, false if a file could not be opened or is invalid, or 
+ *                      if an allocation failed **and** HM_DISABLE_ALLOC_PANIC is defined
+ */
+bool HM_journal_open(HM_Journal* self, const char* snapshot_path, const char* log_path, size_t element_size, HM_HashFunc hash_func);
+
+/**
+ * \brief         commits the pending records, closes the log and frees the map
+ * \param self:   handle
+ */
+void HM_journal_close(HM_Journal* self);
+
+/**
+ * \brief         flushes the appended records and fsync()s the log, changes before this call 
+ *                survive a crash
+ * \returns       true if succesful, false if writing the log failed
+ */
+bool HM_journal_commit(HM_Journal* self);
+
+/**
+ * \brief         writes the map to a new snapshot and empties the log
+ * \note          the snapshot is written next to snapshot_path and renamed over it, so a crash 
+ *                leaves either the old or the new snapshot
+ * \returns       true if succesful, false if writing a file failed
+ */
+bool HM_journal_compact(HM_Journal* self);
+
+/**
+ * \brief           logs and sets value of key, see HM_kwl_set()
+ * \returns         true if succesful, false if the log could not be written or an allocation 
+ *                  failed **and** HM_DISABLE_ALLOC_PANIC is defined
+ */
+bool HM_journal_kwl_set(HM_Journal* self, const void* key, size_t key_len, const void* value);
+bool HM_journal_set(HM_Journal* self, const char* key, const void* value);
+
+/**
+ * \brief           combines value into the element of key and logs the result, see HM_kwl_merge()
+ * \returns         pointer to the combined element, or NULL if the log could not be written or 
+ *                  an allocation failed **and** HM_DISABLE_ALLOC_PANIC is defined
+ */
+void* HM_journal_kwl_merge(HM_Journal* self, const void* key, size_t key_len, const void* value, HM_CombineFunc combine);
+void* HM_journal_merge(HM_Journal* self, const char* key, const void* value, HM_CombineFunc combine);
+
+/**
+ * \brief           logs and removes a key value pair, see HM_kwl_remove()
+ * \returns         true if succesful, false if the log could not be written
+ */
+bool HM_journal_kwl_remove(HM_Journal* self, const void* key, size_t key_len);
+bool HM_journal_remove(HM_Journal* self, const char* key);
+
+/**
+ * \brief           returns pointer to the element of key, see HM_kwl_get()
+ * \note            changing the element through this pointer is not logged
+ */
+void* HM_journal_kwl_get(HM_Journal* self, const void* key, size_t key_len);
+void* HM_journal_get(HM_Journal* self, const char* key);
+
+#define HM_journal_sk_set(self, key, value)\
+  HM_journal_kwl_set(self, &(key), sizeof(key), value)
+
+#define HM_journal_sk_merge(self, key, value, combine)\
+  HM_journal_kwl_merge(self, &(key), sizeof(key), value, combine)
+
+#define HM_journal_sk_remove(self, key)\
+  HM_journal_kwl_remove(self, &(key), sizeof(key))
+
+#define HM_journal_sk_get(self, key)\
+  HM_journal_kwl_get(self, &(key), sizeof(key))
+#endif // HM_ENABLE_POSIX
+
+#ifndef HM_HASH
+#if INTPTR_MAX != INT64_MAX
+#error "HM: default hash algo only supports 64-bit, please define custom HM_HASH(str, len)"
+#endif
+
+size_t HM_default_hash(const char *str, size_t len);
+#define HM_HASH HM_default_hash
+
+#ifdef HM_IMPLEMENTATION
+
+// 64-bit fnv-1a hash function (http://isthe.com/chongo/tech/comp/fnv/)
+// !! use other version in case of non 64-bit architecture !!
+#define HM_FNV_PRIME 0x00000100000001b3
+#define HM_FNV_BASIS 0xcbf29ce484222325
+size_t HM_default_hash(const char *str, size_t len){
+    size_t hash = HM_FNV_BASIS;
+    const char* end = str + len;
+    while (str < end){
+      hash = (hash ^ (unsigned char)(*str++)) * HM_FNV_PRIME;
+    }
+    return hash;
+}
+#endif // HM_IMPLEMENTATION
+#endif // HM_HASH
+
+
+#ifdef HM_IMPLEMENTATION
+
+HM_Iterator HM_iterate(HM* self, HM_Iterator current){
+  if(self->count == 0) return NULL;
+  if(current == NULL){
+    return &self->first;
+  }else if(*current == self->last){
+    return NULL;
+  }else{
+    return &HM_entry_index(self, *current)->next;
+  }
+}
+
+void HM_swap_order(HM* self, HM_Iterator a_it, HM_Iterator b_it){
+  HM_ASSERT(a_it != NULL);
+  HM_ASSERT(b_it != NULL);
+  
+  int a = *a_it;
+  int b = *b_it;
+
+  int a_prev = HM_entry_index(self, a)->prev;
+  int a_next = HM_entry_index(self, a)->next;
+  int b_prev = HM_entry_index(self, b)->prev;
+  int b_next = HM_entry_index(self, b)->next;
+
+  HM_entry_index(self, a_prev)->next = b; 
+  HM_entry_index(self, a)->prev = b_prev;
+  HM_entry_index(self, a)->next = b_next;
+  HM_entry_index(self, a_next)->prev = b;
+  
+  HM_entry_index(self, b_next)->prev = a;
+  HM_entry_index(self, b)->prev = a_prev;
+  HM_entry_index(self, b)->next = a_next;
+  HM_entry_index(self, b_prev)->next = a; 
+}
+
+// key_len marker for slots whose entry was removed, probing has to continue past these
+#define HM_TOMBSTONE ((size_t)-1)
+
+bool HM_allocate(HM* self, size_t element_size, size_t capacity);
+static bool HM_rehash(HM* self, size_t capacity);
+#ifdef HM_ENABLE_THREADS
+static bool HM_rehash_parallel_to(HM* self, size_t capacity, size_t thread_count, HM* out);
+#endif
+
+static bool HM_key_eq(const HM_Entry* entry, const void* key, size_t key_len){
+  return entry->key_len == key_len && 
+    (key_len == 0 ||
+     (entry->key[0] == ((const char*)key)[0] &&
+      memcmp(entry->key, key, key_len) == 0));
+}
+
+// returns slot index of key or self->capacity if the key is not present
+static size_t HM_probe(HM* self, const void* key, size_t key_len, size_t hash){
+  size_t start = hash % self->capacity;
+  size_t i = start;
+  do{
+    HM_Entry* entry = HM_entry_index(self, i);
+    if(entry->key == NULL){
+      if(entry->key_len != HM_TOMBSTONE) break;
+    }else if(HM_key_eq(entry, key, key_len)){
+      return i;
+    }
+    i = (i+1) % self->capacity;
+  }while(i != start);
+  return self->capacity;
+}
+
+static bool HM_in_key_block(HM* self, const char* key){
+  uintptr_t block = (uintptr_t)self->key_block;
+  return (uintptr_t)key >= block && (uintptr_t)key < block + self->key_block_size;
+}
+
+// frees a key unless it lives in the key block of a loaded map
+static void HM_free_key(HM* self, char* key){
+  if(HM_in_key_block(self, key)) return;
+  HM_FREE(key);
+}
+
+// appends slot i to the insertion order
+static void HM_link(HM* self, size_t i){
+  if(self->count == 0){
+    self->first = i;
+    self->last = i;
+  }else{
+    HM_entry_index(self, i)->prev = self->last;
+    HM_entry_index(self, self->last)->next = i;
+    self->last = i;
+  }
+  self->count++;
+}
+
+static bool HM_store_key(HM_Entry* entry, const void* key, size_t key_len){
+  // TODO use internal buffer instead of seperate heap buffer for keys
+  char* copy = (char*)HM_CALLOC(key_len, sizeof(char));
+  HM_CHECK_ALLOC(copy);
+  memcpy(copy, key, key_len);
+  entry->key = copy;
+  entry->key_len = key_len;
+  return true;
+}
+
+// returns the entry for key, claiming a free slot for it if the key was not present,
+// the value of a newly claimed entry is left uninitialized
+// like HM_claim(), but a newly inserted entry takes ownership of owned_key instead of copying 
+// key if owned_key is not NULL
+static HM_Entry* HM_claim_owned(HM* self, const void* key, size_t key_len, size_t hash, bool* inserted, char* owned_key){
+  if(self->count + self->tombstones >= self->capacity/2){
+    // mostly tombstones means rehashing at the same capacity is enough to make room
+    size_t capacity = self->tombstones > self->count ? self->capacity : self->capacity*2;
+    if(!HM_rehash(self, capacity)) return NULL;
+  }
+
+  size_t start = hash % self->capacity;
+  size_t i = start;
+  size_t target = self->capacity;
+  do{
+    HM_Entry* entry = HM_entry_index(self, i);
+    if(entry->key == NULL){
+      // reuse the first tombstone on the way but only once we know the key is absent
+      if(target == self->capacity) target = i;
+      if(entry->key_len != HM_TOMBSTONE) break;
+    }else if(HM_key_eq(entry, key, key_len)){
+      if(inserted != NULL) *inserted = false;
+      return entry;
+    }
+    i = (i+1) % self->capacity;
+  }while(i != start);
+  HM_ASSERT(target != self->capacity && "map is full!");
+
+  HM_Entry* entry = HM_entry_index(self, target);
+  bool was_tombstone = entry->key_len == HM_TOMBSTONE;
+  if(owned_key != NULL){
+    entry->key = owned_key;
+    entry->key_len = key_len;
+  }else if(!HM_store_key(entry, key, key_len)){
+    return NULL;
+  }
+  if(was_tombstone) self->tombstones--;
+  HM_link(self, target);
+
+  if(inserted != NULL) *inserted = true;
+  return entry;
+}
+
+static HM_Entry* HM_claim(HM* self, const void* key, size_t key_len, size_t hash, bool* inserted){
+  return HM_claim_owned(self, key, key_len, hash, inserted, NULL);
+}
+
+void* HM_kwl_emplace(HM* self, const void* key, size_t key_len){
+  HM_Entry* entry = HM_claim(self, key, key_len, self->hash_func((const char*)key, key_len), NULL);
+  if(entry == NULL) return NULL;
+  return entry->value;
+}
+
+void* HM_emplace(HM* self, const char* key){
+  return HM_kwl_emplace(self, key, strlen(key));
+}
+
+bool HM_kwl_set(HM* self, const void* key, size_t key_len, void* value){
+  void* slot = HM_kwl_emplace(self, key, key_len);
+  if(slot == NULL) return false;
+  memcpy(slot, value, self->element_size);
+  return true;
+}
+
+void* HM_kwl_get_or_insert(HM* self, const void* key, size_t key_len, bool* inserted){
+  bool is_new = false;
+  HM_Entry* entry = HM_claim(self, key, key_len, self->hash_func((const char*)key, key_len), &is_new);
+  if(entry == NULL) return NULL;
+  if(is_new) memset(entry->value, 0, self->element_size);
+  if(inserted != NULL) *inserted = is_new;
+  return entry->value;
+}
+
+void* HM_get_or_insert(HM* self, const char* key, bool* inserted){
+  return HM_kwl_get_or_insert(self, key, strlen(key), inserted);
+}
+
+void* HM_kwl_merge(HM* self, const void* key, size_t key_len, const void* value, HM_CombineFunc combine){
+  bool inserted = false;
+  HM_Entry* entry = HM_claim(self, key, key_len, self->hash_func((const char*)key, key_len), &inserted);
+  if(entry == NULL) return NULL;
+  if(inserted){
+    memcpy(entry->value, value, self->element_size);
+  }else{
+    combine(entry->value, value);
+  }
+  return entry->value;
+}
+
+// merges src into dst in batches whose home slots in dst are prefetched before any of them is 
+// probed. With move every merged entry is popped off the front of src, so src always holds 
+// what is left to merge
+static bool HM_merge_entries(HM* dst, HM* src, HM_CombineFunc combine, bool move){
+  HM_ASSERT(dst != src && dst->element_size == src->element_size);
+  if(src->count == 0) return true;
+  if(!HM_reserve(dst, dst->count + src->count)) return false;
+
+  size_t slots[HM_BATCH_SIZE];
+  size_t hashes[HM_BATCH_SIZE];
+  HM_Iterator it = HM_iterate(src, NULL);
+  while(it != NULL){
+    size_t n = 0;
+    for(; it != NULL && n < HM_BATCH_SIZE; it = HM_iterate(src, it)){
+      HM_Entry* entry = HM_entry_index(src, *it);
+      hashes[n] = dst->hash_func(entry->key, entry->key_len);
+      HM_PREFETCH(HM_entry_index(dst, hashes[n] % dst->capacity));
+      slots[n++] = *it;
+    }
+
+    for(size_t j = 0; j < n; ++j){
+      HM_Entry* entry = HM_entry_index(src, slots[j]);
+      // keys in the key block of src are freed with it and have to be copied
+      char* owned_key = move && !HM_in_key_block(src, entry->key) ? entry->key : NULL;
+      bool inserted = false;
+      HM_Entry* merged = HM_claim_owned(dst, entry->key, entry->key_len, hashes[j], &inserted, owned_key);
+      if(merged == NULL) return false;
+      if(inserted || combine == NULL){
+        memcpy(merged->value, entry->value, dst->element_size);
+      }else{
+        combine(merged->value, entry->value);
+      }
+      if(move){
+        if(!inserted) HM_free_key(src, entry->key);
+        entry->key = NULL;
+        entry->key_len = HM_TOMBSTONE;
+        src->first = entry->next;
+        src->tombstones++;
+        src->count--;
+      }
+    }
+  }
+  if(move) HM_clear(src);
+  return true;
+}
+
+bool HM_merge_map(HM* dst, HM* src, HM_CombineFunc combine){
+  return HM_merge_entries(dst, src, combine, false);
+}
+
+bool HM_merge_map_move(HM* dst, HM* src, HM_CombineFunc combine){
+  return HM_merge_entries(dst, src, combine, true);
+}
+
+int64_t* HM_kwl_add_i64(HM* self, const void* key, size_t key_len, int64_t delta){
+  HM_ASSERT(self->element_size == sizeof(int64_t));
+  int64_t* counter = (int64_t*)HM_kwl_get_or_insert(self, key, key_len, NULL);
+  if(counter == NULL) return NULL;
+  *counter += delta;
+  return counter;
+}
+
+int64_t* HM_add_i64(HM* self, const char* key, int64_t delta){
+  return HM_kwl_add_i64(self, key, strlen(key), delta);
+}
+
+bool HM_set(HM* self, const char* key, void* value){
+  return HM_kwl_set(self, key, strlen(key), value);
+}
+
+const char* HM_key_at(HM* self, HM_Iterator it){
+  if(it == NULL) return NULL;
+  return HM_entry_index(self, *it)->key;
+}
+
+const size_t* HM_key_len_at(HM* self, HM_Iterator it){
   if(it == NULL) return NULL;
   return &HM_entry_index(self, *it)->key_len;
 }
 
-void* HM_value_at(HM* self, HM_Iterator it){
-  if(it == NULL) return NULL;
-  return HM_entry_index(self, *it)->value;
+void* HM_value_at(HM* self, HM_Iterator it){
+  if(it == NULL) return NULL;
+  return HM_entry_index(self, *it)->value;
+}
+
+// returns the HM_Iterator referring to slot i
+static HM_Iterator HM_slot_iterator(HM* self, size_t i){
+  if(i == self->first) return &self->first;
+  return &HM_entry_index(self, HM_entry_index(self, i)->prev)->next;
+}
+
+// splits capacity slots into nparts contiguous ranges and returns the bounds of range part
+static void HM_part_bounds(size_t capacity, size_t part, size_t nparts, size_t* begin, size_t* end){
+  size_t part_size = capacity / nparts;
+  *begin = part * part_size;
+  *end = part + 1 == nparts ? capacity : *begin + part_size;
+}
+
+HM_Iterator HM_iter_range(HM* self, HM_Iterator current, size_t part, size_t nparts){
+  size_t begin, end;
+  HM_part_bounds(self->capacity, part, nparts, &begin, &end);
+  for(size_t i = current == NULL ? begin : *current + 1; i < end; ++i){
+    if(HM_entry_index(self, i)->key != NULL) return HM_slot_iterator(self, i);
+  }
+  return NULL;
+}
+
+HM_Iterator HM_kwl_find(HM* self, const void* key, size_t key_len){
+  if(self->count == 0) return NULL;
+  size_t i = HM_probe(self, key, key_len, self->hash_func((const char*)key, key_len));
+  if(i == self->capacity) return NULL;
+  return HM_slot_iterator(self, i);
+}
+
+HM_Iterator HM_find(HM* self, const char* key){
+  return HM_kwl_find(self, key, strlen(key));
+}
+
+void* HM_kwl_get(HM* self, const void* key, size_t key_len){
+  if(self->count == 0) return NULL;
+  size_t i = HM_probe(self, key, key_len, self->hash_func((const char*)key, key_len));
+  if(i == self->capacity) return NULL;
+  return HM_entry_index(self, i)->value;
+}
+
+void* HM_get(HM* self, const char* key){
+  return HM_kwl_get(self, key, strlen(key));
+}
+
+void HM_kwl_remove(HM* self, const void* key, size_t key_len){
+  if(self->count == 0) return;
+
+  size_t i = HM_probe(self, key, key_len, self->hash_func((const char*)key, key_len));
+  if(i == self->capacity) return;
+
+  HM_free_key(self, HM_entry_index(self, i)->key);
+  HM_entry_index(self, i)->key = NULL;
+  HM_entry_index(self, i)->key_len = HM_TOMBSTONE;
+  self->tombstones++;
+  
+  size_t prev_index = HM_entry_index(self, i)->prev;
+  size_t next_index = HM_entry_index(self, i)->next;
+  
+  if(i == self->first){
+    self->first = next_index;
+  }else if (i == self->last){
+    self->last = prev_index;
+  }else{
+    HM_entry_index(self, next_index)->prev = prev_index;
+    HM_entry_index(self, prev_index)->next = next_index;
+  }
+
+  self->count--;
+}
+
+void HM_remove(HM* self, const char* key){
+  HM_kwl_remove(self, key, strlen(key));
+}
+
+bool HM_allocate(HM* self, size_t element_size, size_t capacity){
+  self->capacity = capacity;
+  self->element_size = element_size;
+  
+  self->entries = (unsigned char*)HM_CALLOC(capacity, HM_entry_size(self));
+  HM_CHECK_ALLOC(self->entries);
+  memset(self->entries, 0, capacity*HM_entry_size(self));
+ return true;
+}
+
+// fills out with a freshly allocated table of the given capacity holding all entries of self,
+// keys are handed over instead of copied and tombstones are dropped. self is only read, but 
+// afterwards its entries array is the only thing left for it to free
+static bool HM_rehash_to(HM* self, size_t capacity, HM* out){
+#ifdef HM_ENABLE_THREADS
+  if(self->grow_threads > 1 && self->count >= HM_PARALLEL_GROW_MIN){
+    return HM_rehash_parallel_to(self, capacity, self->grow_threads, out);
+  }
+#endif
+  memset(out, 0, sizeof(*out));
+  out->hash_func = self->hash_func != NULL ? self->hash_func : HM_HASH;
+  out->grow_threads = self->grow_threads;
+  out->key_block = self->key_block;
+  out->key_block_size = self->key_block_size;
+  if(!HM_allocate(out, self->element_size, capacity)){
+    return false;
+  }
+
+  for(HM_Iterator it = HM_iterate(self, NULL); it != NULL; it = HM_iterate(self, it)){
+    HM_Entry* entry = HM_entry_index(self, *it);
+    size_t i = out->hash_func(entry->key, entry->key_len) % capacity;
+    while(HM_entry_index(out, i)->key != NULL){
+      i = (i+1) % capacity;
+    }
+    HM_Entry* new_entry = HM_entry_index(out, i);
+    new_entry->key = entry->key;
+    new_entry->key_len = entry->key_len;
+    memcpy(new_entry->value, entry->value, self->element_size);
+    HM_link(out, i);
+  }
+  return true;
+}
+
+// moves all entries into a freshly allocated table of the given capacity
+static bool HM_rehash(HM* self, size_t capacity){
+  HM new_hm;
+  if(!HM_rehash_to(self, capacity, &new_hm)) return false;
+  HM_FREE(self->entries);
+  
+  *self = new_hm;
+  return true;
+}
+
+bool HM_grow(HM* self){
+  return HM_rehash(self, self->capacity > 0 ? self->capacity * 2 : HM_DEFAULT_CAPACITY);
+}
+
+bool HM_reserve(HM* self, size_t count){
+  if(count < self->count) count = self->count;
+  // inserts grow once count + tombstones reaches half the capacity
+  if(count + self->tombstones <= self->capacity/2) return true;
+  size_t capacity = self->capacity;
+  if(capacity < count*2) capacity = count*2;
+  return HM_rehash(self, capacity);
+}
+
+void HM_override_hash_func(HM* self, HM_HashFunc func){
+  self->hash_func = func;
+}
+
+bool HM_init(HM* self, size_t element_size, size_t capacity){
+  memset(self, 0, sizeof(*self));
+  self->hash_func = HM_HASH;
+  return HM_allocate(self, element_size, capacity > 0 ? capacity : HM_DEFAULT_CAPACITY);
+}
+
+void HM_deinit(HM* self){
+  for(HM_Iterator i = HM_iterate(self, NULL); i != NULL; i = HM_iterate(self, i)){
+    HM_free_key(self, (char*)HM_key_at(self, i));
+  }
+  HM_FREE(self->key_block);
+  HM_FREE(self->entries);
+}
+
+bool HM_clone(HM* dst, HM* src){
+  size_t key_bytes = 0;
+  for(HM_Iterator it = HM_iterate(src, NULL); it != NULL; it = HM_iterate(src, it)){
+    key_bytes += *HM_key_len_at(src, it);
+  }
+  *dst = *src;
+  dst->entries = (unsigned char*)HM_CALLOC(src->capacity, HM_entry_size(src));
+  // one spare byte so a zero-length key at the end still points into the block
+  dst->key_block = (char*)HM_CALLOC(key_bytes + 1, 1);
+  dst->key_block_size = key_bytes + 1;
+  if(dst->entries == NULL || dst->key_block == NULL){
+    HM_FREE(dst->key_block);
+    HM_FREE(dst->entries);
+    memset(dst, 0, sizeof(*dst));
+    HM* cloned = NULL;
+    HM_CHECK_ALLOC(cloned);
+  }
+  memcpy(dst->entries, src->entries, src->capacity*HM_entry_size(src));
+  char* key = dst->key_block;
+  for(HM_Iterator it = HM_iterate(dst, NULL); it != NULL; it = HM_iterate(dst, it)){
+    HM_Entry* entry = HM_entry_index(dst, *it);
+    memcpy(key, entry->key, entry->key_len);
+    entry->key = key;
+    key += entry->key_len;
+  }
+  return true;
+}
+
+void HM_clear(HM* self){
+  for(HM_Iterator i = HM_iterate(self, NULL); i != NULL; i = HM_iterate(self, i)){
+    HM_free_key(self, (char*)HM_key_at(self, i));
+  }
+  HM_FREE(self->key_block);
+  self->key_block = NULL;
+  self->key_block_size = 0;
+  memset(self->entries, 0, self->capacity*HM_entry_size(self));
+  self->count = 0;
+  self->tombstones = 0;
+  self->first = 0;
+  self->last = 0;
+}
+
+#define HM_SNAPSHOT_VERSION 1
+
+typedef struct{
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint64_t entry_header_size;
+  uint64_t element_size;
+  uint64_t capacity;
+  uint64_t count;
+  uint64_t tombstones;
+  uint64_t first;
+  uint64_t last;
+  uint64_t key_bytes;
+  uint64_t hash_check;
+} HM_SnapshotHeader;
+
+// number of bytes HM_save() and HM_load() checksum and transfer at once
+#define HM_SNAPSHOT_CHUNK 65536
+
+// FNV-1a like checksum that consumes a word at a time
+static uint64_t HM_checksum(uint64_t hash, const void* data, size_t len){
+  const unsigned char* bytes = (const unsigned char*)data;
+  size_t i = 0;
+  for(; i + 8 <= len; i += 8){
+    uint64_t word;
+    memcpy(&word, bytes + i, 8);
+    hash = (hash ^ word) * 0x100000001b3ULL;
+    hash ^= hash >> 29;
+  }
+  for(; i < len; ++i){
+    hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+// fingerprints hash_func so a snapshot is never loaded with a different one
+static uint64_t HM_hash_check(HM_HashFunc hash_func){
+  return (uint64_t)hash_func("hm.h snapshot", 13);
+}
+
+static bool HM_write_checked(FILE* file, const void* data, size_t len, uint64_t* checksum){
+  *checksum = HM_checksum(*checksum, data, len);
+  return fwrite(data, 1, len, file) == len;
+}
+
+static bool HM_read_checked(FILE* file, void* data, size_t len, uint64_t* checksum){
+  if(fread(data, 1, len, file) != len) return false;
+  *checksum = HM_checksum(*checksum, data, len);
+  return true;
+}
+
+// both sides transfer the entries and the key bytes in the same chunks, which is what
+// makes the checksums comparable
+static size_t HM_snapshot_chunk_entries(size_t stride){
+  return HM_SNAPSHOT_CHUNK / stride > 0 ? HM_SNAPSHOT_CHUNK / stride : 1;
+}
+
+bool HM_save(HM* self, FILE* file){
+  size_t stride = HM_entry_size(self);
+  HM_SnapshotHeader header = {{'H', 'M', 'S', 'N', 'A', 'P', '\0', '\0'}, HM_SNAPSHOT_VERSION, 0x01020304, 
+    sizeof(HM_Entry), self->element_size, self->capacity, self->count, self->tombstones, self->first, 
+    self->last, 0, HM_hash_check(self->hash_func)};
+  for(HM_Iterator it = HM_iterate(self, NULL); it != NULL; it = HM_iterate(self, it)){
+    header.key_bytes += *HM_key_len_at(self, it);
+  }
+
+  size_t chunk_entries = HM_snapshot_chunk_entries(stride);
+  unsigned char* buffer = (unsigned char*)HM_CALLOC(chunk_entries*stride > HM_SNAPSHOT_CHUNK ? 
+      chunk_entries*stride : HM_SNAPSHOT_CHUNK, 1);
+  HM_CHECK_ALLOC(buffer);
+
+  uint64_t checksum = 0xcbf29ce484222325ULL;
+  bool ok = HM_write_checked(file, &header, sizeof(header), &checksum);
+
+  // entries are written as is, except that keys are replaced by their offset + 1 into the key bytes
+  uint64_t offset = 1;
+  for(size_t begin = 0; begin < self->capacity && ok; begin += chunk_entries){
+    size_t end = begin + chunk_entries < self->capacity ? begin + chunk_entries : self->capacity;
+    memcpy(buffer, HM_entry_index(self, begin), (end - begin)*stride);
+    for(size_t i = begin; i < end; ++i){
+      HM_Entry* entry = (HM_Entry*)(buffer + (i - begin)*stride);
+      if(entry->key == NULL) continue;
+      entry->key = (char*)(uintptr_t)offset;
+      offset += entry->key_len;
+    }
+    ok = HM_write_checked(file, buffer, (end - begin)*stride, &checksum);
+  }
+
+  // key bytes in slot order
+  size_t staged = 0;
+  for(size_t i = 0; i < self->capacity && ok; ++i){
+    HM_Entry* entry = HM_entry_index(self, i);
+    if(entry->key == NULL) continue;
+    for(size_t done = 0; done < entry->key_len && ok; ){
+      size_t n = entry->key_len - done;
+      if(n > HM_SNAPSHOT_CHUNK - staged) n = HM_SNAPSHOT_CHUNK - staged;
+      memcpy(buffer + staged, entry->key + done, n);
+      staged += n;
+      done += n;
+      if(staged == HM_SNAPSHOT_CHUNK){
+        ok = HM_write_checked(file, buffer, staged, &checksum);
+        staged = 0;
+      }
+    }
+  }
+  if(ok) ok = HM_write_checked(file, buffer, staged, &checksum);
+  if(ok) ok = fwrite(&checksum, sizeof(checksum), 1, file) == 1;
+  HM_FREE(buffer);
+  return ok;
+}
+
+bool HM_load(HM* self, FILE* file, HM_HashFunc hash_func){
+  memset(self, 0, sizeof(*self));
+  self->hash_func = hash_func != NULL ? hash_func : HM_HASH;
+
+  uint64_t checksum = 0xcbf29ce484222325ULL;
+  HM_SnapshotHeader header;
+  if(!HM_read_checked(file, &header, sizeof(header), &checksum)) return false;
+  if(memcmp(header.magic, "HMSNAP", 7) != 0 || header.version != HM_SNAPSHOT_VERSION || 
+      header.byte_order != 0x01020304 || header.entry_header_size != sizeof(HM_Entry) ||
+      header.hash_check != HM_hash_check(self->hash_func) || header.capacity == 0 ||
+      header.key_bytes >= SIZE_MAX || header.count + header.tombstones > header.capacity || 
+      (header.count > 0 && (header.first >= header.capacity || header.last >= header.capacity))){
+    return false;
+  }
+
+  self->element_size = header.element_size;
+  self->capacity = header.capacity;
+  size_t stride = HM_entry_size(self);
+  self->entries = (unsigned char*)HM_CALLOC(self->capacity, stride);
+  // one spare byte so a zero-length key at offset key_bytes still points into the block
+  self->key_block = (char*)HM_CALLOC(header.key_bytes + 1, 1);
+  self->key_block_size = header.key_bytes + 1;
+  bool allocated = self->entries != NULL && self->key_block != NULL;
+  bool ok = allocated;
+
+  size_t chunk_entries = HM_snapshot_chunk_entries(stride);
+  for(size_t begin = 0; begin < self->capacity && ok; begin += chunk_entries){
+    size_t n = self->capacity - begin < chunk_entries ? self->capacity - begin : chunk_entries;
+    ok = HM_read_checked(file, HM_entry_index(self, begin), n*stride, &checksum);
+  }
+  for(size_t begin = 0; ok; begin += HM_SNAPSHOT_CHUNK){
+    size_t n = header.key_bytes - begin < HM_SNAPSHOT_CHUNK ? header.key_bytes - begin : HM_SNAPSHOT_CHUNK;
+    ok = HM_read_checked(file, self->key_block + begin, n, &checksum);
+    if(n < HM_SNAPSHOT_CHUNK) break;
+  }
+  uint64_t saved;
+  ok = ok && fread(&saved, sizeof(saved), 1, file) == 1 && saved == checksum;
+
+  // turn the saved key offsets back into pointers
+  for(size_t i = 0; i < self->capacity && ok; ++i){
+    HM_Entry* entry = HM_entry_index(self, i);
+    if(entry->key == NULL) continue;
+    uint64_t offset = (uint64_t)(uintptr_t)entry->key - 1;
+    ok = offset <= header.key_bytes && entry->key_len <= header.key_bytes - offset &&
+      entry->next < self->capacity && entry->prev < self->capacity;
+    entry->key = self->key_block + offset;
+  }
+
+  if(!ok){
+    HM_FREE(self->key_block);
+    HM_FREE(self->entries);
+    memset(self, 0, sizeof(*self));
+    HM* loaded = allocated ? self : NULL;
+    HM_CHECK_ALLOC(loaded);
+    return false;
+  }
+  self->count = header.count;
+  self->tombstones = header.tombstones;
+  self->first = header.first;
+  self->last = header.last;
+  return true;
+}
+
+// bytes HM_load_tsv() and HM_load_records() read at once
+#ifndef HM_LOAD_CHUNK
+#define HM_LOAD_CHUNK ((size_t)1 << 20)
+#endif
+#define HM_LOAD_CHUNKS 3
+
+typedef struct{
+  char* data;
+  size_t capacity;
+  size_t size;
+  size_t records;   // bytes of whole records at the start of data, the rest is carried over
+} HM_LoadChunk;
+
+// chunk n is filled in chunks[n % HM_LOAD_CHUNKS] and starts with the partial record that 
+// ended chunk n - 1, so every chunk handed to the inserting side holds whole records only
+typedef struct{
+  FILE* file;
+  size_t element_size;
+  bool binary;
+  HM_LoadChunk chunks[HM_LOAD_CHUNKS];
+  size_t filled;
+  size_t consumed;
+  bool end;
+  bool failed;
+  bool stop;
+  bool allocation_failed;
+#ifdef HM_ENABLE_THREADS
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+#endif
+} HM_Loader;
+
+static size_t HM_load_boundary(HM_Loader* self, const char* data, size_t size){
+  if(!self->binary){
+    size_t end = size;
+    while(end > 0 && data[end - 1] != '\n') end--;
+    return end;
+  }
+  size_t offset = 0;
+  while(size - offset >= sizeof(uint32_t)){
+    uint32_t key_len;
+    memcpy(&key_len, data + offset, sizeof(key_len));
+    size_t record = sizeof(uint32_t) + key_len + self->element_size;
+    if(size - offset < record) break;
+    offset += record;
+  }
+  return offset;
+}
+
+static bool HM_load_fill(HM_Loader* self, size_t n, bool* end){
+  HM_LoadChunk* chunk = &self->chunks[n % HM_LOAD_CHUNKS];
+  const HM_LoadChunk* previous = n > 0 ? &self->chunks[(n - 1) % HM_LOAD_CHUNKS] : NULL;
+  size_t carry = previous != NULL ? previous->size - previous->records : 0;
+  if(chunk->capacity < carry + HM_LOAD_CHUNK){
+    HM_FREE(chunk->data);
+    chunk->capacity = carry + HM_LOAD_CHUNK;
+    chunk->data = (char*)HM_CALLOC(chunk->capacity, 1);
+    if(chunk->data == NULL){
+      chunk->capacity = 0;
+      self->allocation_failed = true;
+      return false;
+    }
+  }
+  if(carry > 0) memcpy(chunk->data, previous->data + previous->records, carry);
+  size_t got = fread(chunk->data + carry, 1, HM_LOAD_CHUNK, self->file);
+  chunk->size = carry + got;
+  chunk->records = HM_load_boundary(self, chunk->data, chunk->size);
+  *end = got < HM_LOAD_CHUNK;
+  if(*end){
+    if(ferror(self->file)) return false;
+    // the last line may lack its newline, a partial binary record is an error
+    if(!self->binary) chunk->records = chunk->size;
+    else if(chunk->records != chunk->size) return false;
+  }
+  return true;
+}
+
+#ifdef HM_ENABLE_THREADS
+static void* HM_load_reader(void* arg){
+  HM_Loader* self = (HM_Loader*)arg;
+  for(size_t n = 0; ; ++n){
+    pthread_mutex_lock(&self->lock);
+    while(n >= self->consumed + HM_LOAD_CHUNKS && !self->stop){
+      pthread_cond_wait(&self->changed, &self->lock);
+    }
+    bool stop = self->stop;
+    pthread_mutex_unlock(&self->lock);
+    if(stop) break;
+
+    bool end = false;
+    bool ok = HM_load_fill(self, n, &end);
+    pthread_mutex_lock(&self->lock);
+    if(ok) self->filled = n + 1;
+    else self->failed = true;
+    self->end = end;
+    end = end || !ok;
+    pthread_cond_broadcast(&self->changed);
+    pthread_mutex_unlock(&self->lock);
+    if(end) break;
+  }
+  return NULL;
+}
+#endif
+
+// returns the next chunk to insert, or NULL once the file is exhausted or reading failed
+static HM_LoadChunk* HM_load_next(HM_Loader* self){
+#ifdef HM_ENABLE_THREADS
+  pthread_mutex_lock(&self->lock);
+  while(self->consumed == self->filled && !self->end && !self->failed){
+    pthread_cond_wait(&self->changed, &self->lock);
+  }
+  bool available = self->consumed < self->filled;
+  pthread_mutex_unlock(&self->lock);
+  return available ? &self->chunks[self->consumed % HM_LOAD_CHUNKS] : NULL;
+#else
+  if(self->end || self->failed) return NULL;
+  if(!HM_load_fill(self, self->filled, &self->end)){
+    self->failed = true;
+    return NULL;
+  }
+  return &self->chunks[self->filled++ % HM_LOAD_CHUNKS];
+#endif
+}
+
+static void HM_load_done(HM_Loader* self){
+#ifdef HM_ENABLE_THREADS
+  pthread_mutex_lock(&self->lock);
+  self->consumed++;
+  pthread_cond_broadcast(&self->changed);
+  pthread_mutex_unlock(&self->lock);
+#else
+  self->consumed++;
+#endif
+}
+
+static bool HM_load_insert(HM* self, const char* data, size_t size, bool binary, HM_ParseFunc parse){
+  const char* end = data + size;
+  while(data < end){
+    if(binary){
+      uint32_t key_len;
+      memcpy(&key_len, data, sizeof(key_len));
+      const char* key = data + sizeof(key_len);
+      data = key + key_len + self->element_size;
+      if(!HM_kwl_set(self, key, key_len, (void*)(key + key_len))) return false;
+      continue;
+    }
+    const char* line_end = (const char*)memchr(data, '\n', (size_t)(end - data));
+    if(line_end == NULL) line_end = end;
+    const char* line = data;
+    data = line_end < end ? line_end + 1 : end;
+    if(line_end > line && line_end[-1] == '\r') line_end--;
+    if(line_end == line) continue;
+    const char* tab = (const char*)memchr(line, '\t', (size_t)(line_end - line));
+    if(tab == NULL) return false;
+    bool inserted;
+    void* element = HM_kwl_get_or_insert(self, line, (size_t)(tab - line), &inserted);
+    if(element == NULL) return false;
+    if(!parse(element, tab + 1, (size_t)(line_end - tab - 1))){
+      if(inserted) HM_kwl_remove(self, line, (size_t)(tab - line));
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool HM_load_stream(HM* self, FILE* file, bool binary, HM_ParseFunc parse){
+  HM_Loader loader;
+  memset(&loader, 0, sizeof(loader));
+  loader.file = file;
+  loader.element_size = self->element_size;
+  loader.binary = binary;
+
+  // the rest of the file, or -1 for streams that cannot seek
+  long remaining = -1;
+  long start = ftell(file);
+  if(start >= 0 && fseek(file, 0, SEEK_END) == 0){
+    long size = ftell(file);
+    remaining = fseek(file, start, SEEK_SET) == 0 && size >= start ? size - start : -1;
+  }
+  if(remaining < 0) clearerr(file);
+
+#ifdef HM_ENABLE_THREADS
+  pthread_t reader;
+  pthread_mutex_init(&loader.lock, NULL);
+  pthread_cond_init(&loader.changed, NULL);
+  bool started = pthread_create(&reader, NULL, HM_load_reader, &loader) == 0;
+  if(!started) loader.failed = true;
+#endif
+
+  bool ok = true;
+  bool reserved = false;
+  HM_LoadChunk* chunk;
+  while(ok && (chunk = HM_load_next(&loader)) != NULL){
+    size_t count = self->count;
+    ok = HM_load_insert(self, chunk->data, chunk->records, binary, parse);
+    // extrapolate the number of keys from the records of the first chunk
+    if(ok && !reserved && chunk->records > 0 && remaining > (long)chunk->records){
+      reserved = true;
+      double per_byte = (double)(self->count - count) / (double)chunk->records;
+      ok = HM_reserve(self, self->count + (size_t)(per_byte * (double)((size_t)remaining - chunk->records)));
+    }
+    HM_load_done(&loader);
+  }
+
+#ifdef HM_ENABLE_THREADS
+  pthread_mutex_lock(&loader.lock);
+  loader.stop = true;
+  pthread_cond_broadcast(&loader.changed);
+  pthread_mutex_unlock(&loader.lock);
+  if(started) pthread_join(reader, NULL);
+  pthread_cond_destroy(&loader.changed);
+  pthread_mutex_destroy(&loader.lock);
+#endif
+
+  for(size_t i = 0; i < HM_LOAD_CHUNKS; ++i){
+    HM_FREE(loader.chunks[i].data);
+  }
+  HM* allocated = loader.allocation_failed ? NULL : self;
+  HM_CHECK_ALLOC(allocated);
+  return ok && !loader.failed;
+}
+
+bool HM_load_tsv(HM* self, FILE* file, HM_ParseFunc parse){
+  return HM_load_stream(self, file, false, parse);
+}
+
+bool HM_load_records(HM* self, FILE* file){
+  return HM_load_stream(self, file, true, NULL);
+}
+
+#define HM_FROZEN_VERSION 1
+
+typedef struct{
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint64_t word_size;
+  uint64_t element_size;
+  uint64_t capacity;
+  uint64_t count;
+  uint64_t key_bytes;
+  uint64_t hash_check;
+} HM_FrozenHeader;
+
+// every slot starts with the key offset + 1 into the key bytes (0 for empty) and the key length,
+// followed by the value padded to 8 bytes
+#define HM_frozen_slot_size(element_size) (2*sizeof(uint64_t) + (((element_size) + 7) & ~(size_t)7))
+
+bool HM_frozen_write(HM* self, FILE* file){
+  HM_FrozenHeader header = {{'H', 'M', 'F', 'R', 'O', 'Z', 'E', 'N'}, HM_FROZEN_VERSION, 0x01020304, 
+    sizeof(size_t), self->element_size, self->count > 0 ? self->count*2 : 1, self->count, 0, 
+    HM_hash_check(self->hash_func)};
+  size_t slot_size = HM_frozen_slot_size(self->element_size);
+  unsigned char* slots = (unsigned char*)HM_CALLOC(header.capacity, slot_size);
+  HM_CHECK_ALLOC(slots);
+
+  // keys are laid out in insertion order, each padded to 8 bytes
+  for(HM_Iterator it = HM_iterate(self, NULL); it != NULL; it = HM_iterate(self, it)){
+    HM_Entry* entry = HM_entry_index(self, *it);
+    size_t i = self->hash_func(entry->key, entry->key_len) % header.capacity;
+    uint64_t* slot = (uint64_t*)(slots + i*slot_size);
+    while(slot[0] != 0){
+      i = (i+1) % header.capacity;
+      slot = (uint64_t*)(slots + i*slot_size);
+    }
+    slot[0] = header.key_bytes + 1;
+    slot[1] = entry->key_len;
+    memcpy(slot + 2, entry->value, self->element_size);
+    header.key_bytes += (entry->key_len + 7) & ~(size_t)7;
+  }
+
+  static const unsigned char padding[8] = {0};
+  bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+    fwrite(slots, slot_size, header.capacity, file) == header.capacity;
+  for(HM_Iterator it = HM_iterate(self, NULL); it != NULL && ok; it = HM_iterate(self, it)){
+    HM_Entry* entry = HM_entry_index(self, *it);
+    size_t pad = ((entry->key_len + 7) & ~(size_t)7) - entry->key_len;
+    ok = fwrite(entry->key, 1, entry->key_len, file) == entry->key_len &&
+      fwrite(padding, 1, pad, file) == pad;
+  }
+  HM_FREE(slots);
+  return ok;
+}
+
+bool HM_frozen_from_memory(HM_Frozen* self, const void* data, size_t size, HM_HashFunc hash_func){
+  memset(self, 0, sizeof(*self));
+  self->hash_func = hash_func != NULL ? hash_func : HM_HASH;
+  const HM_FrozenHeader* header = (const HM_FrozenHeader*)data;
+  if(size < sizeof(*header) || memcmp(header->magic, "HMFROZEN", 8) != 0 || 
+      header->version != HM_FROZEN_VERSION || header->byte_order != 0x01020304 || 
+      header->word_size != sizeof(size_t) || header->hash_check != HM_hash_check(self->hash_func) ||
+      header->capacity == 0 || header->count >= header->capacity){
+    return false;
+  }
+  size_t slot_size = HM_frozen_slot_size(header->element_size);
+  if((size - sizeof(*header)) / slot_size < header->capacity || 
+      size - sizeof(*header) - header->capacity*slot_size < header->key_bytes){
+    return false;
+  }
+
+  self->data = (const unsigned char*)data;
+  self->size = size;
+  self->element_size = header->element_size;
+  self->capacity = header->capacity;
+  self->count = header->count;
+  self->slot_size = slot_size;
+  self->slots = self->data + sizeof(*header);
+  self->keys = self->slots + header->capacity*slot_size;
+  return true;
+}
+
+const void* HM_frozen_kwl_get(const HM_Frozen* self, const void* key, size_t key_len){
+  if(self->count == 0) return NULL;
+  size_t key_bytes = self->size - (size_t)(self->keys - self->data);
+  if(key_len > key_bytes) return NULL;
+  size_t i = self->hash_func((const char*)key, key_len) % self->capacity;
+  for(size_t probes = 0; probes < self->capacity; ++probes){
+    const uint64_t* slot = (const uint64_t*)(self->slots + i*self->slot_size);
+    if(slot[0] == 0) return NULL;
+    if(slot[1] == key_len && slot[0] - 1 <= key_bytes - key_len &&
+        memcmp(self->keys + slot[0] - 1, key, key_len) == 0){
+      return slot + 2;
+    }
+    i = (i+1) % self->capacity;
+  }
+  return NULL;
+}
+
+const void* HM_frozen_get(const HM_Frozen* self, const char* key){
+  return HM_frozen_kwl_get(self, key, strlen(key));
+}
+
+// average number of keys per CHD bucket
+#ifndef HM_PERFECT_BUCKET_SIZE
+#define HM_PERFECT_BUCKET_SIZE 4
+#endif
+
+// percentage of the displacement table's positions that hold a key, at 100 the last buckets 
+// have to try ever more displacements to hit one of the few free positions
+#ifndef HM_PERFECT_LOAD_PERCENT
+#define HM_PERFECT_LOAD_PERCENT 99
+#endif
+
+#define HM_PERFECT_MAX_SEEDS 16
+#define HM_PERFECT_MAX_DISPLACEMENT ((uint32_t)1 << 20)
+
+static uint64_t HM_mix64(uint64_t x){
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ULL;
+  x ^= x >> 33;
+  return x;
+}
+
+static size_t HM_perfect_bucket(uint64_t hash, uint64_t seed, size_t bucket_count){
+  return (size_t)(HM_mix64(hash ^ seed) % bucket_count);
+}
+
+static size_t HM_perfect_position(uint64_t hash, uint64_t seed, uint32_t displacement, size_t table_size){
+  return (size_t)(HM_mix64((hash ^ seed) + (uint64_t)(displacement + 1) * 0x9e3779b97f4a7c15ULL) % table_size);
+}
+
+static size_t HM_perfect_slot(const HM_Perfect* self, uint64_t hash){
+  size_t b = HM_perfect_bucket(hash, self->seed, self->bucket_count);
+  size_t position = HM_perfect_position(hash, self->seed, self->displacements[b], self->table_size);
+  return position < self->count ? position : self->remap[position - self->count];
+}
+
+// finds a displacement for every bucket, biggest buckets first while the table is still empty
+static bool HM_perfect_search(const uint64_t* hashes, size_t count, size_t table_size, size_t bucket_count, uint64_t seed, 
+    uint32_t* displacements, size_t* order, size_t* starts, size_t* by_size, unsigned char* taken, size_t* positions){
+  memset(starts, 0, (bucket_count + 1)*sizeof(size_t));
+  for(size_t k = 0; k < count; ++k){
+    starts[HM_perfect_bucket(hashes[k], seed, bucket_count) + 1]++;
+  }
+  size_t largest = 0;
+  for(size_t b = 0; b < bucket_count; ++b){
+    if(starts[b + 1] > largest) largest = starts[b + 1];
+    starts[b + 1] += starts[b];
+  }
+  for(size_t k = 0; k < count; ++k){
+    order[starts[HM_perfect_bucket(hashes[k], seed, bucket_count)]++] = k;
+  }
+  // starts[b] is now the end of bucket b, shift back so it is its start
+  memmove(starts + 1, starts, bucket_count*sizeof(size_t));
+  starts[0] = 0;
+
+  size_t n = 0;
+  for(size_t size = largest; size > 0; --size){
+    for(size_t b = 0; b < bucket_count; ++b){
+      if(starts[b + 1] - starts[b] == size) by_size[n++] = b;
+    }
+  }
+
+  memset(taken, 0, table_size);
+  for(size_t i = 0; i < n; ++i){
+    size_t b = by_size[i];
+    size_t size = starts[b + 1] - starts[b];
+    uint32_t d = 0;
+    for(; d < HM_PERFECT_MAX_DISPLACEMENT; ++d){
+      size_t placed = 0;
+      for(; placed < size; ++placed){
+        size_t slot = HM_perfect_position(hashes[order[starts[b] + placed]], seed, d, table_size);
+        if(taken[slot]) break;
+        taken[slot] = 1;
+        positions[placed] = slot;
+      }
+      if(placed == size) break;
+      for(size_t j = 0; j < placed; ++j){
+        taken[positions[j]] = 0;
+      }
+    }
+    if(d == HM_PERFECT_MAX_DISPLACEMENT) return false;
+    displacements[b] = d;
+  }
+  return true;
+}
+
+bool HM_perfect_build(HM_Perfect* self, HM* source){
+  memset(self, 0, sizeof(*self));
+  self->hash_func = source->hash_func;
+  self->element_size = source->element_size;
+  self->count = source->count;
+  self->table_size = (source->count*100 + HM_PERFECT_LOAD_PERCENT - 1) / HM_PERFECT_LOAD_PERCENT;
+  self->bucket_count = (source->count + HM_PERFECT_BUCKET_SIZE - 1) / HM_PERFECT_BUCKET_SIZE;
+  if(self->bucket_count == 0) self->bucket_count = 1;
+  size_t count = self->count > 0 ? self->count : 1;
+
+  size_t key_bytes = 0;
+  for(HM_Iterator it = HM_iterate(source, NULL); it != NULL; it = HM_iterate(source, it)){
+    key_bytes += *HM_key_len_at(source, it);
+  }
+
+  size_t table_size = self->table_size > 0 ? self->table_size : 1;
+
+  // one buffer holding values, keys, displacements, remap and key bytes, each part aligned to 16 bytes
+  size_t values_size = (count*self->element_size + 15) & ~(size_t)15;
+  size_t keys_size = (count*sizeof(HM_PerfectKey) + 15) & ~(size_t)15;
+  size_t displacements_size = (self->bucket_count*sizeof(uint32_t) + 15) & ~(size_t)15;
+  size_t remap_size = ((self->table_size - self->count)*sizeof(size_t) + 15) & ~(size_t)15;
+  unsigned char* buffer = (unsigned char*)HM_CALLOC(values_size + keys_size + displacements_size + remap_size + key_bytes + 1, 1);
+  HM_CHECK_ALLOC(buffer);
+
+  uint64_t* hashes = (uint64_t*)HM_CALLOC(count, sizeof(uint64_t));
+  size_t* scratch = (size_t*)HM_CALLOC(count*2 + self->bucket_count*2 + 1, sizeof(size_t));
+  size_t* slots = (size_t*)HM_CALLOC(count, sizeof(size_t));
+  unsigned char* taken = (unsigned char*)HM_CALLOC(table_size, 1);
+  bool ok = hashes != NULL && scratch != NULL && slots != NULL && taken != NULL;
+  bool found = false;
+  uint32_t* displacements = (uint32_t*)(buffer + values_size + keys_size);
+  size_t* remap = (size_t*)(buffer + values_size + keys_size + displacements_size);
+
+  size_t n = 0;
+  for(HM_Iterator it = HM_iterate(source, NULL); it != NULL && ok; it = HM_iterate(source, it)){
+    slots[n] = *it;
+    hashes[n++] = (uint64_t)source->hash_func(HM_key_at(source, it), *HM_key_len_at(source, it));
+  }
+  for(uint64_t attempt = 0; attempt < HM_PERFECT_MAX_SEEDS && ok && !found && self->count > 0; ++attempt){
+    self->seed = HM_mix64(attempt + 1);
+    size_t* order = scratch;
+    size_t* positions = order + count;
+    size_t* starts = positions + count;
+    size_t* by_size = starts + self->bucket_count + 1;
+    found = HM_perfect_search(hashes, self->count, self->table_size, self->bucket_count, self->seed, 
+        displacements, order, starts, by_size, taken, positions);
+  }
+
+  if(found){
+    // as many positions past count are taken as slots below count are free, pair them up
+    size_t free_slot = 0;
+    for(size_t position = self->count; position < self->table_size; ++position){
+      if(!taken[position]) continue;
+      while(taken[free_slot]) free_slot++;
+      remap[position - self->count] = free_slot++;
+    }
+    self->displacements = displacements;
+    self->remap = remap;
+
+    HM_PerfectKey* keys = (HM_PerfectKey*)(buffer + values_size);
+    char* key_block = (char*)(buffer + values_size + keys_size + displacements_size + remap_size);
+    for(size_t k = 0; k < self->count; ++k){
+      HM_Entry* entry = HM_entry_index(source, slots[k]);
+      size_t slot = HM_perfect_slot(self, hashes[k]);
+      memcpy(key_block, entry->key, entry->key_len);
+      keys[slot].key = key_block;
+      keys[slot].key_len = entry->key_len;
+      key_block += entry->key_len;
+      memcpy(buffer + slot*self->element_size, entry->value, self->element_size);
+    }
+  }
+  HM_FREE(taken);
+  HM_FREE(slots);
+  HM_FREE(scratch);
+  HM_FREE(hashes);
+
+  if(!found && self->count > 0){
+    HM_FREE(buffer);
+    HM* allocated = ok ? source : NULL;
+    HM_CHECK_ALLOC(allocated);
+    return false;
+  }
+  self->values = buffer;
+  self->keys = (const HM_PerfectKey*)(buffer + values_size);
+  self->buffer = buffer;
+  return true;
+}
+
+void HM_perfect_deinit(HM_Perfect* self){
+  HM_FREE(self->buffer);
+  memset(self, 0, sizeof(*self));
+}
+
+const void* HM_perfect_kwl_get(const HM_Perfect* self, const void* key, size_t key_len){
+  if(self->count == 0) return NULL;
+  size_t slot = HM_perfect_slot(self, (uint64_t)self->hash_func((const char*)key, key_len));
+  const HM_PerfectKey* stored = &self->keys[slot];
+  if(stored->key_len != key_len || memcmp(stored->key, key, key_len) != 0) return NULL;
+  return self->values + slot*self->element_size;
+}
+
+const void* HM_perfect_get(const HM_Perfect* self, const char* key){
+  return HM_perfect_kwl_get(self, key, strlen(key));
+}
+
+// slots per copy-on-write chunk
+#ifndef HM_COW_CHUNK
+#define HM_COW_CHUNK 64
+#endif
+
+// chunks and keys can be shared with forks living on other threads
+#ifdef HM_ENABLE_THREADS
+typedef atomic_size_t HM_RefCount;
+#define HM_ref_init(refs) atomic_init(refs, 1)
+#define HM_ref_inc(refs) atomic_fetch_add_explicit(refs, 1, memory_order_relaxed)
+#define HM_ref_dec(refs) (atomic_fetch_sub_explicit(refs, 1, memory_order_acq_rel) == 1)
+#define HM_ref_shared(refs) (atomic_load_explicit(refs, memory_order_acquire) > 1)
+#else
+typedef size_t HM_RefCount;
+#define HM_ref_init(refs) (*(refs) = 1)
+#define HM_ref_inc(refs) ((*(refs))++)
+#define HM_ref_dec(refs) (--(*(refs)) == 0)
+#define HM_ref_shared(refs) (*(refs) > 1)
+#endif
+
+typedef struct{
+  HM_RefCount refs;
+  char bytes[];
+} HM_CowKey;
+
+struct HM_CowChunk{
+  HM_RefCount refs;
+  unsigned char slots[];
+};
+
+typedef struct{
+  HM_CowKey* key;       // NULL for empty slots and tombstones
+  size_t key_len;       // HM_TOMBSTONE for tombstones
+  unsigned char value[];
+} HM_CowSlot;
+
+#define HM_cow_stride(self) (sizeof(HM_CowSlot) + (((self)->element_size + sizeof(void*) - 1) & ~(sizeof(void*) - 1)))
+
+static HM_CowSlot* HM_cow_slot(const HM_Cow* self, size_t i){
+  return (HM_CowSlot*)(self->chunks[i / HM_COW_CHUNK]->slots + (i % HM_COW_CHUNK)*HM_cow_stride(self));
+}
+
+static void HM_cow_release_chunk(const HM_Cow* self, HM_CowChunk* chunk){
+  if(chunk == NULL || !HM_ref_dec(&chunk->refs)) return;
+  for(size_t i = 0; i < HM_COW_CHUNK; ++i){
+    HM_CowSlot* slot = (HM_CowSlot*)(chunk->slots + i*HM_cow_stride(self));
+    if(slot->key != NULL && HM_ref_dec(&slot->key->refs)) HM_FREE(slot->key);
+  }
+  HM_FREE(chunk);
+}
+
+static HM_CowChunk* HM_cow_new_chunk(const HM_Cow* self){
+  HM_CowChunk* chunk = (HM_CowChunk*)HM_CALLOC(1, sizeof(HM_CowChunk) + HM_COW_CHUNK*HM_cow_stride(self));
+  if(chunk != NULL) HM_ref_init(&chunk->refs);
+  return chunk;
+}
+
+static void HM_cow_free_chunks(HM_Cow* self){
+  for(size_t c = 0; c < self->chunk_count && self->chunks != NULL; ++c){
+    HM_cow_release_chunk(self, self->chunks[c]);
+  }
+  HM_FREE(self->chunks);
+  self->chunks = NULL;
+}
+
+// gives self empty chunks for at least capacity slots
+static bool HM_cow_allocate(HM_Cow* self, size_t capacity){
+  self->chunk_count = (capacity + HM_COW_CHUNK - 1) / HM_COW_CHUNK;
+  self->capacity = self->chunk_count*HM_COW_CHUNK;
+  self->chunks = (HM_CowChunk**)HM_CALLOC(self->chunk_count, sizeof(HM_CowChunk*));
+  bool ok = self->chunks != NULL;
+  for(size_t c = 0; c < self->chunk_count && ok; ++c){
+    self->chunks[c] = HM_cow_new_chunk(self);
+    ok = self->chunks[c] != NULL;
+  }
+  if(!ok) HM_cow_free_chunks(self);
+  return ok;
+}
+
+// makes the chunk holding slot i private to self before it is written
+static bool HM_cow_own(HM_Cow* self, size_t i){
+  HM_CowChunk* chunk = self->chunks[i / HM_COW_CHUNK];
+  if(!HM_ref_shared(&chunk->refs)) return true;
+  HM_CowChunk* copy = HM_cow_new_chunk(self);
+  HM_CHECK_ALLOC(copy);
+  memcpy(copy->slots, chunk->slots, HM_COW_CHUNK*HM_cow_stride(self));
+  for(size_t s = 0; s < HM_COW_CHUNK; ++s){
+    HM_CowSlot* slot = (HM_CowSlot*)(copy->slots + s*HM_cow_stride(self));
+    if(slot->key != NULL) HM_ref_inc(&slot->key->refs);
+  }
+  self->chunks[i / HM_COW_CHUNK] = copy;
+  HM_cow_release_chunk(self, chunk);
+  return true;
+}
+
+static size_t HM_cow_probe(const HM_Cow* self, const void* key, size_t key_len, size_t hash){
+  size_t start = hash % self->capacity;
+  size_t i = start;
+  do{
+    HM_CowSlot* slot = HM_cow_slot(self, i);
+    if(slot->key == NULL){
+      if(slot->key_len != HM_TOMBSTONE) break;
+    }else if(slot->key_len == key_len && memcmp(slot->key->bytes, key, key_len) == 0){
+      return i;
+    }
+    i = (i+1) % self->capacity;
+  }while(i != start);
+  return self->capacity;
+}
+
+// moves every element into fresh private chunks of the given capacity, the keys are shared
+static bool HM_cow_rehash(HM_Cow* self, size_t capacity){
+  HM_Cow grown = *self;
+  grown.count = 0;
+  grown.tombstones = 0;
+  HM_CowChunk** chunks = HM_cow_allocate(&grown, capacity) ? grown.chunks : NULL;
+  HM_CHECK_ALLOC(chunks);
+  for(size_t i = 0; i < self->capacity; ++i){
+    HM_CowSlot* slot = HM_cow_slot(self, i);
+    if(slot->key == NULL) continue;
+    size_t j = grown.hash_func(slot->key->bytes, slot->key_len) % grown.capacity;
+    while(HM_cow_slot(&grown, j)->key != NULL){
+      j = (j+1) % grown.capacity;
+    }
+    memcpy(HM_cow_slot(&grown, j), slot, HM_cow_stride(self));
+    HM_ref_inc(&slot->key->refs);
+    grown.count++;
+  }
+  HM_cow_free_chunks(self);
+  *self = grown;
+  return true;
+}
+
+bool HM_cow_init(HM_Cow* self, size_t element_size, size_t capacity){
+  memset(self, 0, sizeof(*self));
+  self->element_size = element_size;
+  self->hash_func = HM_HASH;
+  HM_CowChunk** chunks = HM_cow_allocate(self, capacity > 0 ? capacity : HM_DEFAULT_CAPACITY) ? self->chunks : NULL;
+  HM_CHECK_ALLOC(chunks);
+  return true;
+}
+
+void HM_cow_deinit(HM_Cow* self){
+  HM_cow_free_chunks(self);
+  memset(self, 0, sizeof(*self));
+}
+
+bool HM_cow_fork(HM_Cow* self, HM_Cow* fork){
+  *fork = *self;
+  fork->chunks = (HM_CowChunk**)HM_CALLOC(self->chunk_count, sizeof(HM_CowChunk*));
+  HM_CHECK_ALLOC(fork->chunks, memset(fork, 0, sizeof(*fork)));
+  for(size_t c = 0; c < self->chunk_count; ++c){
+    fork->chunks[c] = self->chunks[c];
+    HM_ref_inc(&self->chunks[c]->refs);
+  }
+  return true;
+}
+
+bool HM_cow_kwl_set(HM_Cow* self, const void* key, size_t key_len, const void* value){
+  size_t hash = self->hash_func((const char*)key, key_len);
+  size_t i = HM_cow_probe(self, key, key_len, hash);
+  if(i == self->capacity){
+    if(self->count + self->tombstones + 1 >= self->capacity/2){
+      // mostly tombstones means rehashing at the same capacity is enough to make room
+      size_t capacity = self->tombstones > self->count ? self->capacity : self->capacity*2;
+      if(!HM_cow_rehash(self, capacity)) return false;
+    }
+    i = hash % self->capacity;
+    while(HM_cow_slot(self, i)->key != NULL){
+      i = (i+1) % self->capacity;
+    }
+    HM_CowKey* stored = (HM_CowKey*)HM_CALLOC(1, sizeof(HM_CowKey) + key_len);
+    HM_CHECK_ALLOC(stored);
+    if(!HM_cow_own(self, i)){
+      HM_FREE(stored);
+      return false;
+    }
+    HM_ref_init(&stored->refs);
+    memcpy(stored->bytes, key, key_len);
+    HM_CowSlot* slot = HM_cow_slot(self, i);
+    if(slot->key_len == HM_TOMBSTONE) self->tombstones--;
+    slot->key = stored;
+    slot->key_len = key_len;
+    self->count++;
+  }else if(!HM_cow_own(self, i)){
+    return false;
+  }
+  memcpy(HM_cow_slot(self, i)->value, value, self->element_size);
+  return true;
+}
+
+bool HM_cow_set(HM_Cow* self, const char* key, const void* value){
+  return HM_cow_kwl_set(self, key, strlen(key), value);
+}
+
+const void* HM_cow_kwl_get(const HM_Cow* self, const void* key, size_t key_len){
+  size_t i = HM_cow_probe(self, key, key_len, self->hash_func((const char*)key, key_len));
+  if(i == self->capacity) return NULL;
+  return HM_cow_slot(self, i)->value;
+}
+
+const void* HM_cow_get(const HM_Cow* self, const char* key){
+  return HM_cow_kwl_get(self, key, strlen(key));
+}
+
+bool HM_cow_kwl_remove(HM_Cow* self, const void* key, size_t key_len){
+  size_t i = HM_cow_probe(self, key, key_len, self->hash_func((const char*)key, key_len));
+  if(i == self->capacity) return true;
+  if(!HM_cow_own(self, i)) return false;
+  HM_CowSlot* slot = HM_cow_slot(self, i);
+  if(HM_ref_dec(&slot->key->refs)) HM_FREE(slot->key);
+  slot->key = NULL;
+  slot->key_len = HM_TOMBSTONE;
+  self->count--;
+  self->tombstones++;
+  return true;
+}
+
+bool HM_cow_remove(HM_Cow* self, const char* key){
+  return HM_cow_kwl_remove(self, key, strlen(key));
+}
+
+bool HM_cow_next(const HM_Cow* self, size_t* position, const char** key, size_t* key_len, const void** value){
+  for(; *position < self->capacity; ++*position){
+    HM_CowSlot* slot = HM_cow_slot(self, *position);
+    if(slot->key == NULL) continue;
+    *key = slot->key->bytes;
+    *key_len = slot->key_len;
+    *value = slot->value;
+    ++*position;
+    return true;
+  }
+  return false;
+}
+
+bool HS_init(HS* self, size_t capacity){
+  return HM_init(self, 0, capacity);
+}
+
+void HS_deinit(HS* self){
+  HM_deinit(self);
+}
+
+bool HS_kwl_insert(HS* self, const void* key, size_t key_len){
+  return HM_claim(self, key, key_len, self->hash_func((const char*)key, key_len), NULL) != NULL;
+}
+
+bool HS_insert(HS* self, const char* key){
+  return HS_kwl_insert(self, key, strlen(key));
+}
+
+bool HS_kwl_contains(HS* self, const void* key, size_t key_len){
+  if(self->count == 0) return false;
+  return HM_probe(self, key, key_len, self->hash_func((const char*)key, key_len)) != self->capacity;
+}
+
+bool HS_contains(HS* self, const char* key){
+  return HS_kwl_contains(self, key, strlen(key));
+}
+
+void HS_kwl_remove(HS* self, const void* key, size_t key_len){
+  HM_kwl_remove(self, key, key_len);
+}
+
+void HS_remove(HS* self, const char* key){
+  HM_kwl_remove(self, key, strlen(key));
+}
+
+// initializes out with the hash function of like, sized to hold estimate keys without growing
+static bool HS_init_like(HS* out, HS* like, size_t estimate){
+  if(!HS_init(out, estimate > 0 ? estimate*2 : 0)) return false;
+  out->hash_func = like->hash_func;
+  return true;
+}
+
+// inserts every key in slots [begin, end) of src whose presence in other equals keep_present,
+// the home slots in other of a whole batch are prefetched before any of them is probed.
+// matching keys are inserted into out or, if out is NULL, their slots are appended to matches
+static bool HS_filter_range(HS* out, HS* src, HS* other, bool keep_present, size_t begin, size_t end, 
+    size_t** matches, size_t* match_count, size_t* match_capacity){
+  size_t slots[HM_BATCH_SIZE];
+  size_t hashes[HM_BATCH_SIZE];
+  size_t i = begin;
+  while(i < end){
+    size_t n = 0;
+    for(; i < end && n < HM_BATCH_SIZE; ++i){
+      HM_Entry* entry = HM_entry_index(src, i);
+      if(entry->key == NULL) continue;
+      hashes[n] = other->hash_func(entry->key, entry->key_len);
+      HM_PREFETCH(HM_entry_index(other, hashes[n] % other->capacity));
+      slots[n++] = i;
+    }
+
+    for(size_t j = 0; j < n; ++j){
+      HM_Entry* entry = HM_entry_index(src, slots[j]);
+      bool present = HM_probe(other, entry->key, entry->key_len, hashes[j]) != other->capacity;
+      if(present != keep_present) continue;
+
+      if(out != NULL){
+        size_t hash = out->hash_func == other->hash_func ? 
+          hashes[j] : out->hash_func(entry->key, entry->key_len);
+        if(HM_claim(out, entry->key, entry->key_len, hash, NULL) == NULL) return false;
+      }else{
+        if(*match_count == *match_capacity){
+          size_t capacity = *match_capacity > 0 ? *match_capacity*2 : 256;
+          size_t* grown = (size_t*)HM_CALLOC(capacity, sizeof(size_t));
+          HM_CHECK_ALLOC(grown);
+          if(*match_count > 0) memcpy(grown, *matches, *match_count*sizeof(size_t));
+          HM_FREE(*matches);
+          *matches = grown;
+          *match_capacity = capacity;
+        }
+        (*matches)[(*match_count)++] = slots[j];
+      }
+    }
+  }
+  return true;
+}
+
+static bool HS_insert_all(HS* out, HS* src){
+  for(size_t i = 0; i < src->capacity; ++i){
+    HM_Entry* entry = HM_entry_index(src, i);
+    if(entry->key == NULL) continue;
+    if(!HS_kwl_insert(out, entry->key, entry->key_len)) return false;
+  }
+  return true;
+}
+
+bool HS_intersect(HS* out, HS* a, HS* b){
+  HS* small = a->count <= b->count ? a : b;
+  HS* large = small == a ? b : a;
+  if(!HS_init_like(out, a, small->count)) return false;
+  if(!HS_filter_range(out, small, large, true, 0, small->capacity, NULL, NULL, NULL)){
+    HS_deinit(out);
+    return false;
+  }
+  return true;
+}
+
+bool HS_union(HS* out, HS* a, HS* b){
+  HS* small = a->count <= b->count ? a : b;
+  HS* large = small == a ? b : a;
+  if(!HS_init_like(out, a, a->count + b->count)) return false;
+  if(!HS_insert_all(out, large) ||
+     !HS_filter_range(out, small, large, false, 0, small->capacity, NULL, NULL, NULL)){
+    HS_deinit(out);
+    return false;
+  }
+  return true;
+}
+
+bool HS_difference(HS* out, HS* a, HS* b){
+  if(!HS_init_like(out, a, a->count)) return false;
+  if(!HS_filter_range(out, a, b, false, 0, a->capacity, NULL, NULL, NULL)){
+    HS_deinit(out);
+    return false;
+  }
+  return true;
+}
+
+HM* HM_new(size_t element_size, size_t capacity){
+  HM* self = (HM*)HM_CALLOC(1, sizeof(HM));
+  HM_CHECK_ALLOC(self);
+  if(!HM_init(self, element_size, capacity)){
+    HM_deinit(self);
+    return NULL;
+  }
+  return self;
+}
+
+void HM_delete(HM* self){
+  HM_deinit(self);
+  HM_FREE(self);
+}
+
+#ifdef HM_ENABLE_THREADS
+
+// runs fn on each of the task_count tasks of task_size bytes on its own thread,
+// tasks whose thread could not be started are run on the calling thread instead
+static void HM_run_tasks(void* tasks, size_t task_size, size_t task_count, void* (*fn)(void*)){
+  pthread_t* threads = (pthread_t*)HM_CALLOC(task_count, sizeof(pthread_t));
+  bool* started = (bool*)HM_CALLOC(task_count, sizeof(bool));
+  for(size_t t = 0; t < task_count; ++t){
+    void* task = (unsigned char*)tasks + t*task_size;
+    if(threads != NULL && started != NULL){
+      started[t] = pthread_create(&threads[t], NULL, fn, task) == 0;
+    }
+    if(started == NULL || !started[t]) fn(task);
+  }
+  for(size_t t = 0; t < task_count && started != NULL; ++t){
+    if(started[t]) pthread_join(threads[t], NULL);
+  }
+  HM_FREE(started);
+  HM_FREE(threads);
+}
+
+typedef struct{
+  HM* self;
+  HM_ForEachFunc func;
+  void* ctx;
+  size_t part;
+  size_t nparts;
+} HM_ForEachTask;
+
+static void* HM_for_each_worker(void* arg){
+  HM_ForEachTask* task = (HM_ForEachTask*)arg;
+  size_t begin, end;
+  HM_part_bounds(task->self->capacity, task->part, task->nparts, &begin, &end);
+  for(size_t i = begin; i < end; ++i){
+    // an iterator to a local copy of the slot index saves looking up the previous entry
+    if(HM_entry_index(task->self, i)->key != NULL) task->func(task->self, &i, task->ctx);
+  }
+  return NULL;
+}
+
+void HM_parallel_for_each(HM* self, HM_ForEachFunc func, void* ctxs, size_t ctx_size, size_t thread_count){
+  if(thread_count == 0) thread_count = 1;
+  HM_ForEachTask* tasks = (HM_ForEachTask*)HM_CALLOC(thread_count, sizeof(HM_ForEachTask));
+  size_t task_count = tasks != NULL ? thread_count : 1;
+  HM_ForEachTask single;
+  if(tasks == NULL) tasks = &single;
+  for(size_t t = 0; t < task_count; ++t){
+    tasks[t] = (HM_ForEachTask){ self, func, (unsigned char*)ctxs + t*ctx_size, t, task_count };
+  }
+  HM_run_tasks(tasks, sizeof(HM_ForEachTask), task_count, HM_for_each_worker);
+  if(tasks != &single) HM_FREE(tasks);
+}
+
+typedef struct{
+  HS* src;
+  HS* other;
+  bool keep_present;
+  size_t begin;
+  size_t end;
+  size_t* matches;
+  size_t match_count;
+  size_t match_capacity;
+  bool ok;
+} HS_FilterTask;
+
+static void* HS_filter_worker(void* arg){
+  HS_FilterTask* task = (HS_FilterTask*)arg;
+  task->ok = HS_filter_range(NULL, task->src, task->other, task->keep_present, task->begin, task->end,
+      &task->matches, &task->match_count, &task->match_capacity);
+  return NULL;
+}
+
+// probes slot ranges of src concurrently, only reading src and other, and then inserts the
+// collected matches into out on the calling thread
+static bool HS_filter_parallel(HS* out, HS* src, HS* other, bool keep_present, size_t thread_count){
+  if(thread_count < 2){
+    return HS_filter_range(out, src, other, keep_present, 0, src->capacity, NULL, NULL, NULL);
+  }
+
+  HS_FilterTask* tasks = (HS_FilterTask*)HM_CALLOC(thread_count, sizeof(HS_FilterTask));
+  HM_CHECK_ALLOC(tasks);
+  for(size_t t = 0; t < thread_count; ++t){
+    tasks[t].src = src;
+    tasks[t].other = other;
+    tasks[t].keep_present = keep_present;
+    HM_part_bounds(src->capacity, t, thread_count, &tasks[t].begin, &tasks[t].end);
+  }
+  HM_run_tasks(tasks, sizeof(HS_FilterTask), thread_count, HS_filter_worker);
+
+  bool ok = true;
+  for(size_t t = 0; t < thread_count; ++t){
+    ok = ok && tasks[t].ok;
+  }
+  for(size_t t = 0; t < thread_count && ok; ++t){
+    for(size_t i = 0; i < tasks[t].match_count && ok; ++i){
+      HM_Entry* entry = HM_entry_index(src, tasks[t].matches[i]);
+      ok = HS_kwl_insert(out, entry->key, entry->key_len);
+    }
+  }
+
+  for(size_t t = 0; t < thread_count; ++t){
+    HM_FREE(tasks[t].matches);
+  }
+  HM_FREE(tasks);
+  return ok;
+}
+
+bool HS_intersect_parallel(HS* out, HS* a, HS* b, size_t thread_count){
+  HS* small = a->count <= b->count ? a : b;
+  HS* large = small == a ? b : a;
+  if(!HS_init_like(out, a, small->count)) return false;
+  if(!HS_filter_parallel(out, small, large, true, thread_count)){
+    HS_deinit(out);
+    return false;
+  }
+  return true;
+}
+
+bool HS_union_parallel(HS* out, HS* a, HS* b, size_t thread_count){
+  HS* small = a->count <= b->count ? a : b;
+  HS* large = small == a ? b : a;
+  if(!HS_init_like(out, a, a->count + b->count)) return false;
+  if(!HS_insert_all(out, large) || !HS_filter_parallel(out, small, large, false, thread_count)){
+    HS_deinit(out);
+    return false;
+  }
+  return true;
+}
+
+bool HS_difference_parallel(HS* out, HS* a, HS* b, size_t thread_count){
+  if(!HS_init_like(out, a, a->count)) return false;
+  if(!HS_filter_parallel(out, a, b, false, thread_count)){
+    HS_deinit(out);
+    return false;
+  }
+  return true;
+}
+
+void HM_epoch_init(HM_Epoch* self){
+  atomic_init(&self->global, 1);
+  for(size_t i = 0; i < HM_MAX_READERS; ++i){
+    atomic_init(&self->readers[i].epoch, 0);
+    atomic_init(&self->readers[i].in_use, false);
+  }
+}
+
+int HM_epoch_register(HM_Epoch* self){
+  for(int i = 0; i < HM_MAX_READERS; ++i){
+    bool expected = false;
+    if(atomic_compare_exchange_strong(&self->readers[i].in_use, &expected, true)){
+      return i;
+    }
+  }
+  return -1;
+}
+
+void HM_epoch_unregister(HM_Epoch* self, int reader){
+  atomic_store(&self->readers[reader].epoch, 0);
+  atomic_store(&self->readers[reader].in_use, false);
+}
+
+void HM_epoch_enter(HM_Epoch* self, int reader){
+  atomic_store(&self->readers[reader].epoch, atomic_load(&self->global));
+}
+
+void HM_epoch_exit(HM_Epoch* self, int reader){
+  atomic_store_explicit(&self->readers[reader].epoch, 0, memory_order_release);
+}
+
+void HM_epoch_synchronize(HM_Epoch* self){
+  size_t target = atomic_fetch_add(&self->global, 1) + 1;
+  for(int i = 0; i < HM_MAX_READERS; ++i){
+    if(!atomic_load(&self->readers[i].in_use)) continue;
+    for(;;){
+      size_t epoch = atomic_load(&self->readers[i].epoch);
+      if(epoch == 0 || epoch >= target) break;
+      sched_yield();
+    }
+  }
+}
+
+bool HM_rcu_init(HM_RCU* self, size_t element_size, size_t capacity){
+  HM* table = (HM*)HM_CALLOC(1, sizeof(HM));
+  HM_CHECK_ALLOC(table);
+  if(!HM_init(table, element_size, capacity)){
+    HM_FREE(table);
+    return false;
+  }
+  atomic_init(&self->table, table);
+  pthread_mutex_init(&self->write_lock, NULL);
+  HM_epoch_init(&self->epoch);
+  return true;
+}
+
+void HM_rcu_deinit(HM_RCU* self){
+  HM* table = atomic_load(&self->table);
+  HM_deinit(table);
+  HM_FREE(table);
+  pthread_mutex_destroy(&self->write_lock);
+}
+
+int HM_rcu_register_reader(HM_RCU* self){
+  return HM_epoch_register(&self->epoch);
+}
+
+void HM_rcu_unregister_reader(HM_RCU* self, int reader){
+  HM_epoch_unregister(&self->epoch, reader);
+}
+
+HM* HM_rcu_read_lock(HM_RCU* self, int reader){
+  HM_epoch_enter(&self->epoch, reader);
+  return atomic_load(&self->table);
+}
+
+void HM_rcu_read_unlock(HM_RCU* self, int reader){
+  HM_epoch_exit(&self->epoch, reader);
+}
+
+bool HM_rcu_kwl_get(HM_RCU* self, int reader, const void* key, size_t key_len, void* value){
+  HM* table = HM_rcu_read_lock(self, reader);
+  void* found = HM_kwl_get(table, key, key_len);
+  if(found != NULL) memcpy(value, found, table->element_size);
+  HM_rcu_read_unlock(self, reader);
+  return found != NULL;
+}
+
+bool HM_rcu_get(HM_RCU* self, int reader, const char* key, void* value){
+  return HM_rcu_kwl_get(self, reader, key, strlen(key), value);
+}
+
+HM* HM_rcu_write_begin(HM_RCU* self){
+  pthread_mutex_lock(&self->write_lock);
+  HM* copy = (HM*)HM_CALLOC(1, sizeof(HM));
+  HM_CHECK_ALLOC(copy, pthread_mutex_unlock(&self->write_lock));
+  if(!HM_clone(copy, atomic_load(&self->table))){
+    HM_FREE(copy);
+    pthread_mutex_unlock(&self->write_lock);
+    return NULL;
+  }
+  return copy;
+}
+
+void HM_rcu_write_commit(HM_RCU* self, HM* table){
+  HM* old = atomic_exchange(&self->table, table);
+  HM_epoch_synchronize(&self->epoch);
+  pthread_mutex_unlock(&self->write_lock);
+  HM_deinit(old);
+  HM_FREE(old);
+}
+
+bool HM_rcu_kwl_set(HM_RCU* self, const void* key, size_t key_len, void* value){
+  HM* table = HM_rcu_write_begin(self);
+  if(table == NULL) return false;
+  if(!HM_kwl_set(table, key, key_len, value)){
+    HM_deinit(table);
+    HM_FREE(table);
+    pthread_mutex_unlock(&self->write_lock);
+    return false;
+  }
+  HM_rcu_write_commit(self, table);
+  return true;
+}
+
+bool HM_rcu_kwl_remove(HM_RCU* self, const void* key, size_t key_len){
+  HM* table = HM_rcu_write_begin(self);
+  if(table == NULL) return false;
+  HM_kwl_remove(table, key, key_len);
+  HM_rcu_write_commit(self, table);
+  return true;
+}
+
+bool HM_double_buffer_publish(HM_DoubleBuffer* self, HM* fresh){
+  HM* table = (HM*)HM_CALLOC(1, sizeof(HM));
+  HM_CHECK_ALLOC(table);
+  *table = *fresh;
+  memset(fresh, 0, sizeof(*fresh));
+  pthread_mutex_lock(&self->write_lock);
+  HM_rcu_write_commit(self, table);
+  return true;
+}
+
+// sets up self and allocates the shard array, returns the capacity of each shard or 0 if the 
+// allocation failed. The shard tables are left to the caller
+static size_t HM_sharded_setup(HM_Sharded* self, size_t element_size, size_t capacity, size_t shard_count){
+  memset(self, 0, sizeof(*self));
+  self->shard_count = 1;
+  size_t bits = 0;
+  while(self->shard_count < shard_count){
+    self->shard_count <<= 1;
+    bits++;
+  }
+  self->shard_shift = sizeof(size_t)*8 - bits;
+  self->element_size = element_size;
+  self->hash_func = HM_HASH;
+  if(capacity == 0) capacity = HM_DEFAULT_CAPACITY;
+  self->shards = (HM_Shard*)HM_CALLOC(self->shard_count, sizeof(HM_Shard));
+  HM_CHECK_ALLOC(self->shards);
+  return capacity / self->shard_count > 2 ? capacity / self->shard_count : 2;
+}
+
+// frees the first initialized shards after a shard table could not be allocated
+static bool HM_sharded_abort(HM_Sharded* self, size_t initialized){
+  for(size_t j = 0; j < initialized; ++j){
+    HM_deinit(&self->shards[j].map);
+    pthread_mutex_destroy(&self->shards[j].lock);
+  }
+  HM_FREE(self->shards);
+  self->shards = NULL;
+  return false;
+}
+
+bool HM_sharded_init(HM_Sharded* self, size_t element_size, size_t capacity, size_t shard_count){
+  size_t shard_capacity = HM_sharded_setup(self, element_size, capacity, shard_count);
+  if(shard_capacity == 0) return false;
+  for(size_t i = 0; i < self->shard_count; ++i){
+    if(!HM_init(&self->shards[i].map, element_size, shard_capacity)) return HM_sharded_abort(self, i);
+    self->shards[i].map.hash_func = self->hash_func;
+    pthread_mutex_init(&self->shards[i].lock, NULL);
+  }
+  return true;
+}
+
+void HM_sharded_deinit(HM_Sharded* self){
+  for(size_t i = 0; i < self->shard_count; ++i){
+    HM_deinit(&self->shards[i].map);
+    pthread_mutex_destroy(&self->shards[i].lock);
+  }
+  HM_FREE(self->shards);
+}
+
+size_t HM_sharded_shard_of(HM_Sharded* self, size_t hash){
+  if(self->shard_count == 1) return 0;
+  return hash >> self->shard_shift;
+}
+
+bool HM_sharded_kwl_set(HM_Sharded* self, const void* key, size_t key_len, void* value){
+  size_t hash = self->hash_func((const char*)key, key_len);
+  HM_Shard* shard = &self->shards[HM_sharded_shard_of(self, hash)];
+  pthread_mutex_lock(&shard->lock);
+  HM_Entry* entry = HM_claim(&shard->map, key, key_len, hash, NULL);
+  if(entry != NULL) memcpy(entry->value, value, self->element_size);
+  pthread_mutex_unlock(&shard->lock);
+  return entry != NULL;
+}
+
+bool HM_sharded_set(HM_Sharded* self, const char* key, void* value){
+  return HM_sharded_kwl_set(self, key, strlen(key), value);
+}
+
+bool HM_sharded_kwl_get(HM_Sharded* self, const void* key, size_t key_len, void* value){
+  size_t hash = self->hash_func((const char*)key, key_len);
+  HM_Shard* shard = &self->shards[HM_sharded_shard_of(self, hash)];
+  pthread_mutex_lock(&shard->lock);
+  bool found = false;
+  if(shard->map.count > 0){
+    size_t i = HM_probe(&shard->map, key, key_len, hash);
+    found = i != shard->map.capacity;
+    if(found) memcpy(value, HM_entry_index(&shard->map, i)->value, self->element_size);
+  }
+  pthread_mutex_unlock(&shard->lock);
+  return found;
+}
+
+bool HM_sharded_get(HM_Sharded* self, const char* key, void* value){
+  return HM_sharded_kwl_get(self, key, strlen(key), value);
+}
+
+void HM_sharded_kwl_remove(HM_Sharded* self, const void* key, size_t key_len){
+  size_t hash = self->hash_func((const char*)key, key_len);
+  HM_Shard* shard = &self->shards[HM_sharded_shard_of(self, hash)];
+  pthread_mutex_lock(&shard->lock);
+  HM_kwl_remove(&shard->map, key, key_len);
+  pthread_mutex_unlock(&shard->lock);
+}
+
+void HM_sharded_remove(HM_Sharded* self, const char* key){
+  HM_sharded_kwl_remove(self, key, strlen(key));
+}
+
+bool HM_sharded_kwl_merge(HM_Sharded* self, const void* key, size_t key_len, const void* value, HM_CombineFunc combine){
+  size_t hash = self->hash_func((const char*)key, key_len);
+  HM_Shard* shard = &self->shards[HM_sharded_shard_of(self, hash)];
+  pthread_mutex_lock(&shard->lock);
+  bool inserted = false;
+  HM_Entry* entry = HM_claim(&shard->map, key, key_len, hash, &inserted);
+  if(entry != NULL){
+    if(inserted){
+      memcpy(entry->value, value, self->element_size);
+    }else{
+      combine(entry->value, value);
+    }
+  }
+  pthread_mutex_unlock(&shard->lock);
+  return entry != NULL;
+}
+
+void HM_sharded_for_each(HM_Sharded* self, HM_ForEachFunc fn, void* ctx){
+  for(size_t s = 0; s < self->shard_count; ++s){
+    HM_Shard* shard = &self->shards[s];
+    pthread_mutex_lock(&shard->lock);
+    for(HM_Iterator i = HM_iterate(&shard->map, NULL); i != NULL; i = HM_iterate(&shard->map, i)){
+      fn(&shard->map, i, ctx);
+    }
+    pthread_mutex_unlock(&shard->lock);
+  }
+}
+
+bool HM_combiner_init(HM_Combiner* self, HM_Sharded* target, HM_CombineFunc combine, size_t flush_threshold){
+  memset(self, 0, sizeof(*self));
+  self->target = target;
+  self->combine = combine;
+  self->flush_threshold = flush_threshold;
+  // room for flush_threshold keys without the buffer ever growing
+  if(!HM_init(&self->local, target->element_size, flush_threshold > 0 ? flush_threshold*2 + 2 : 0)){
+    return false;
+  }
+  self->local.hash_func = target->hash_func;
+  return true;
+}
+
+void HM_combiner_deinit(HM_Combiner* self){
+  HM_deinit(&self->local);
+}
+
+bool HM_combiner_kwl_merge(HM_Combiner* self, const void* key, size_t key_len, const void* value){
+  if(HM_kwl_merge(&self->local, key, key_len, value, self->combine) == NULL) return false;
+  if(self->flush_threshold > 0 && self->local.count >= self->flush_threshold){
+    return HM_combiner_flush(self);
+  }
+  return true;
+}
+
+bool HM_combiner_merge(HM_Combiner* self, const char* key, const void* value){
+  return HM_combiner_kwl_merge(self, key, strlen(key), value);
+}
+
+bool HM_combiner_flush(HM_Combiner* self){
+  HM* local = &self->local;
+  HM_Sharded* target = self->target;
+  if(local->count == 0) return true;
+
+  // bucket the buffered entries by shard so every shard is locked once
+  size_t* slots = (size_t*)HM_CALLOC(local->count*3 + target->shard_count + 1, sizeof(size_t));
+  HM_CHECK_ALLOC(slots);
+  size_t* hashes = slots + local->count;
+  size_t* order = hashes + local->count;
+  size_t* starts = order + local->count;
+  size_t n = 0;
+  for(HM_Iterator it = HM_iterate(local, NULL); it != NULL; it = HM_iterate(local, it), ++n){
+    HM_Entry* entry = HM_entry_index(local, *it);
+    slots[n] = *it;
+    hashes[n] = target->hash_func(entry->key, entry->key_len);
+    starts[HM_sharded_shard_of(target, hashes[n]) + 1]++;
+  }
+  for(size_t s = 0; s < target->shard_count; ++s){
+    starts[s + 1] += starts[s];
+  }
+  for(size_t k = 0; k < n; ++k){
+    order[starts[HM_sharded_shard_of(target, hashes[k])]++] = k;
+  }
+
+  // after scattering starts[s] is the end of the bucket of shard s
+  bool ok = true;
+  size_t merged = 0;
+  for(size_t s = 0; s < target->shard_count && ok; ++s){
+    if(merged == starts[s]) continue;
+    HM_Shard* shard = &target->shards[s];
+    pthread_mutex_lock(&shard->lock);
+    for(; merged < starts[s]; ++merged){
+      HM_Entry* entry = HM_entry_index(local, slots[order[merged]]);
+      bool inserted = false;
+      HM_Entry* shared = HM_claim(&shard->map, entry->key, entry->key_len, hashes[order[merged]], &inserted);
+      if(shared == NULL){
+        ok = false;
+        break;
+      }
+      if(inserted){
+        memcpy(shared->value, entry->value, target->element_size);
+      }else{
+        self->combine(shared->value, entry->value);
+      }
+    }
+    pthread_mutex_unlock(&shard->lock);
+  }
+
+  if(ok){
+    // empty the buffer but keep its table
+    HM_clear(local);
+  }else{
+    for(size_t k = 0; k < merged; ++k){
+      HM_Entry* entry = HM_entry_index(local, slots[order[k]]);
+      HM_kwl_remove(local, entry->key, entry->key_len);
+    }
+  }
+  HM_FREE(slots);
+  HM* flushed = ok ? local : NULL;
+  HM_CHECK_ALLOC(flushed);
+  return true;
+}
+
+bool HM_async_init(HM_Async* self, size_t element_size, size_t capacity){
+  memset(self, 0, sizeof(*self));
+  atomic_init(&self->ready, false);
+  return HM_init(&self->table, element_size, capacity);
+}
+
+void HM_async_deinit(HM_Async* self){
+  if(self->resizing){
+    pthread_join(self->helper, NULL);
+    // the keys of the resized table are still owned by table
+    if(self->resize_ok) HM_FREE(self->resized.entries);
+    HM_deinit(&self->delta);
+    HS_deinit(&self->removed);
+  }
+  HM_deinit(&self->table);
+}
+
+static void* HM_async_helper(void* arg){
+  HM_Async* self = (HM_Async*)arg;
+  self->resize_ok = HM_rehash_to(&self->table, self->resize_capacity, &self->resized);
+  atomic_store(&self->ready, true);
+  return NULL;
+}
+
+// starts the helper once the table is 3/4 of the way to the point where HM_claim() grows it
+static void HM_async_maybe_start(HM_Async* self){
+  HM* table = &self->table;
+  if(self->resizing || (table->count + table->tombstones)*8 < table->capacity*3) return;
+  self->delta_limit = table->capacity/HM_ASYNC_DELTA_DIVISOR;
+  // sized so the delta never grows before the limit makes writes wait
+  if(!HM_init(&self->delta, table->element_size, self->delta_limit*2 + 2)) return;
+  if(!HS_init(&self->removed, 0)){
+    HM_deinit(&self->delta);
+    return;
+  }
+  self->delta.hash_func = table->hash_func;
+  self->removed.hash_func = table->hash_func;
+  self->resize_capacity = table->tombstones > table->count ? table->capacity : table->capacity*2;
+  atomic_store(&self->ready, false);
+  if(pthread_create(&self->helper, NULL, HM_async_helper, self) != 0){
+    // the table simply grows synchronously when it fills up
+    HM_deinit(&self->delta);
+    HS_deinit(&self->removed);
+    return;
+  }
+  self->resizing = true;
+}
+
+static bool HM_async_complete(HM_Async* self){
+  pthread_join(self->helper, NULL);
+  self->resizing = false;
+  if(self->resize_ok){
+    HM_FREE(self->table.entries);
+    self->table = self->resized;
+  }
+  // without a resized table the delta is replayed on the old table, which grows as needed
+
+  bool ok = HM_reserve(&self->table, self->count);
+  for(HM_Iterator it = HM_iterate(&self->removed, NULL); it != NULL; it = HM_iterate(&self->removed, it)){
+    HM_kwl_remove(&self->table, HM_key_at(&self->removed, it), *HM_key_len_at(&self->removed, it));
+  }
+  // the keys of the delta are handed over instead of being copied again
+  if(ok) ok = HM_merge_map_move(&self->table, &self->delta, NULL);
+  HM_deinit(&self->delta);
+  HS_deinit(&self->removed);
+  return ok;
+}
+
+// swaps in the resized table once the helper is done, or waits for it when the delta gets large
+static bool HM_async_poll(HM_Async* self){
+  if(!self->resizing) return true;
+  if(atomic_load(&self->ready) || self->delta.count >= self->delta_limit){
+    return HM_async_complete(self);
+  }
+  return true;
+}
+
+bool HM_async_finish(HM_Async* self){
+  if(!self->resizing) return true;
+  return HM_async_complete(self);
+}
+
+// returns the element of key while a resize is running, NULL if not present
+static void* HM_async_lookup(HM_Async* self, const void* key, size_t key_len){
+  void* value = HM_kwl_get(&self->delta, key, key_len);
+  if(value != NULL) return value;
+  if(HS_kwl_contains(&self->removed, key, key_len)) return NULL;
+  return HM_kwl_get(&self->table, key, key_len);
+}
+
+bool HM_async_kwl_set(HM_Async* self, const void* key, size_t key_len, void* value){
+  if(!HM_async_poll(self)) return false;
+  if(!self->resizing){
+    size_t count = self->table.count;
+    if(!HM_kwl_set(&self->table, key, key_len, value)) return false;
+    self->count += self->table.count - count;
+    HM_async_maybe_start(self);
+    return true;
+  }
+  bool present = HM_async_lookup(self, key, key_len) != NULL;
+  if(!HM_kwl_set(&self->delta, key, key_len, value)) return false;
+  if(!present) self->count++;
+  return true;
+}
+
+bool HM_async_set(HM_Async* self, const char* key, void* value){
+  return HM_async_kwl_set(self, key, strlen(key), value);
+}
+
+bool HM_async_kwl_get(HM_Async* self, const void* key, size_t key_len, void* value){
+  void* found = self->resizing ? HM_async_lookup(self, key, key_len) : HM_kwl_get(&self->table, key, key_len);
+  if(found != NULL) memcpy(value, found, self->table.element_size);
+  return found != NULL;
+}
+
+bool HM_async_get(HM_Async* self, const char* key, void* value){
+  return HM_async_kwl_get(self, key, strlen(key), value);
+}
+
+bool HM_async_kwl_remove(HM_Async* self, const void* key, size_t key_len){
+  if(!HM_async_poll(self)) return false;
+  if(!self->resizing){
+    size_t count = self->table.count;
+    HM_kwl_remove(&self->table, key, key_len);
+    self->count -= count - self->table.count;
+    return true;
+  }
+  bool present = HM_async_lookup(self, key, key_len) != NULL;
+  HM_kwl_remove(&self->delta, key, key_len);
+  // the key may come back later, the replay removes it from the table before reinserting it
+  if(HM_kwl_get(&self->table, key, key_len) != NULL && !HS_kwl_insert(&self->removed, key, key_len)){
+    return false;
+  }
+  if(present) self->count--;
+  return true;
+}
+
+bool HM_async_remove(HM_Async* self, const char* key){
+  return HM_async_kwl_remove(self, key, strlen(key));
+}
+
+#ifdef HM_ENABLE_NUMA
+#ifndef HM_USE_LIBNUMA
+// parses a sysfs list like "0-3,8-11" into set and returns the highest listed number + 1
+static size_t HM_numa_read_list(const char* path, cpu_set_t* set){
+  FILE* file = fopen(path, "r");
+  if(file == NULL) return 0;
+  size_t count = 0;
+  size_t first, last;
+  while(fscanf(file, "%zu", &first) == 1){
+    last = first;
+    int c = fgetc(file);
+    if(c == '-'){
+      if(fscanf(file, "%zu", &last) != 1) break;
+      c = fgetc(file);
+    }
+    for(size_t i = first; i <= last && i < CPU_SETSIZE; ++i){
+      if(set != NULL) CPU_SET(i, set);
+    }
+    if(last + 1 > count) count = last + 1;
+    if(c != ',') break;
+  }
+  fclose(file);
+  return count;
+}
+#endif
+
+static size_t HM_numa_node_count(void){
+#ifdef HM_USE_LIBNUMA
+  if(numa_available() < 0) return 1;
+  return (size_t)numa_max_node() + 1;
+#else
+  size_t count = HM_numa_read_list("/sys/devices/system/node/online", NULL);
+  return count > 0 ? count : 1;
+#endif
+}
+
+typedef struct{
+  size_t node;
+  void* (*fn)(void*);
+  void* arg;
+} HM_NumaTask;
+
+static void* HM_numa_worker(void* arg){
+  HM_NumaTask* task = (HM_NumaTask*)arg;
+#ifdef HM_USE_LIBNUMA
+  if(numa_available() >= 0){
+    numa_run_on_node((int)task->node);
+    numa_set_preferred((int)task->node);
+  }
+#endif
+  return task->fn(task->arg);
+}
+
+// runs fn on a thread bound to node so the memory it touches first is allocated there,
+// falls back to the calling thread if no such thread can be started
+static void HM_numa_run_on(size_t node, void* (*fn)(void*), void* arg){
+  HM_NumaTask task = { node, fn, arg };
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+#ifndef HM_USE_LIBNUMA
+  char path[64];
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  snprintf(path, sizeof(path), "/sys/devices/system/node/node%zu/cpulist", node);
+  if(HM_numa_read_list(path, &cpus) > 0) pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+#endif
+  pthread_t thread;
+  if(pthread_create(&thread, &attr, HM_numa_worker, &task) == 0){
+    pthread_join(thread, NULL);
+  }else{
+    fn(arg);
+  }
+  pthread_attr_destroy(&attr);
+}
+
+typedef struct{
+  HM* dst;
+  HM* src;
+  size_t element_size;
+  size_t capacity;
+  bool ok;
+} HM_NumaPlacement;
+
+// allocates an empty shard table from the node's thread
+static void* HM_numa_place_worker(void* arg){
+  HM_NumaPlacement* placement = (HM_NumaPlacement*)arg;
+  placement->ok = HM_init(placement->dst, placement->element_size, placement->capacity);
+  return NULL;
+}
+
+static void* HM_numa_copy_worker(void* arg){
+  HM_NumaPlacement* placement = (HM_NumaPlacement*)arg;
+  placement->ok = HM_clone(placement->dst, placement->src);
+  return NULL;
+}
+
+bool HM_sharded_init_numa(HM_Sharded* self, size_t element_size, size_t capacity, size_t shard_count){
+  size_t shard_capacity = HM_sharded_setup(self, element_size, capacity, shard_count);
+  if(shard_capacity == 0) return false;
+  size_t node_count = HM_numa_node_count();
+  for(size_t s = 0; s < self->shard_count; ++s){
+    HM_NumaPlacement placement = { &self->shards[s].map, NULL, element_size, shard_capacity, false };
+    HM_numa_run_on(s % node_count, HM_numa_place_worker, &placement);
+    if(!placement.ok) return HM_sharded_abort(self, s);
+    self->shards[s].map.hash_func = self->hash_func;
+    pthread_mutex_init(&self->shards[s].lock, NULL);
+  }
+  return true;
+}
+
+bool HM_replicated_init(HM_Replicated* self, HM* source){
+  memset(self, 0, sizeof(*self));
+  self->node_count = HM_numa_node_count();
+  self->replicas = (HM*)HM_CALLOC(self->node_count, sizeof(HM));
+  HM_CHECK_ALLOC(self->replicas);
+#ifdef HM_USE_LIBNUMA
+  self->cpu_count = numa_available() >= 0 ? (size_t)numa_num_configured_cpus() : 0;
+#else
+  self->cpu_count = CPU_SETSIZE;
+#endif
+  self->cpu_nodes = (int*)HM_CALLOC(self->cpu_count > 0 ? self->cpu_count : 1, sizeof(int));
+  HM_CHECK_ALLOC(self->cpu_nodes, HM_FREE(self->replicas));
+
+  for(size_t node = 0; node < self->node_count; ++node){
+#ifdef HM_USE_LIBNUMA
+    for(size_t cpu = 0; cpu < self->cpu_count; ++cpu){
+      if(numa_node_of_cpu((int)cpu) == (int)node) self->cpu_nodes[cpu] = (int)node;
+    }
+#else
+    char path[64];
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%zu/cpulist", node);
+    HM_numa_read_list(path, &cpus);
+    for(size_t cpu = 0; cpu < self->cpu_count; ++cpu){
+      if(CPU_ISSET(cpu, &cpus)) self->cpu_nodes[cpu] = (int)node;
+    }
+#endif
+
+    HM_NumaPlacement placement = { &self->replicas[node], source, 0, 0, false };
+    HM_numa_run_on(node, HM_numa_copy_worker, &placement);
+    if(!placement.ok){
+      for(size_t i = 0; i < node; ++i){
+        HM_deinit(&self->replicas[i]);
+      }
+      HM_FREE(self->cpu_nodes);
+      HM_FREE(self->replicas);
+      return false;
+    }
+  }
+  return true;
+}
+
+void HM_replicated_deinit(HM_Replicated* self){
+  for(size_t node = 0; node < self->node_count; ++node){
+    HM_deinit(&self->replicas[node]);
+  }
+  HM_FREE(self->cpu_nodes);
+  HM_FREE(self->replicas);
+}
+
+HM* HM_replicated_local(HM_Replicated* self){
+  int cpu = sched_getcpu();
+  size_t node = cpu >= 0 && (size_t)cpu < self->cpu_count ? (size_t)self->cpu_nodes[cpu] : 0;
+  return &self->replicas[node < self->node_count ? node : 0];
+}
+
+void* HM_replicated_kwl_get(HM_Replicated* self, const void* key, size_t key_len){
+  return HM_kwl_get(HM_replicated_local(self), key, key_len);
+}
+
+void* HM_replicated_get(HM_Replicated* self, const char* key){
+  return HM_replicated_kwl_get(self, key, strlen(key));
+}
+#endif // HM_ENABLE_NUMA
+
+typedef struct{
+  HM* self;
+  HM* source;           // table being rehashed into self, inputs are then its slots
+  const void* const* keys;
+  const size_t* input_lens; // NULL if keys are null terminated strings
+  size_t* key_lens;
+  const unsigned char* values;
+  size_t* hashes;
+  size_t* slots;        // slot every input ended up in, self->capacity while deferred
+  size_t* order;        // input indices grouped by partition, in input order within a partition
+  size_t* offsets;      // [chunk*thread_count + part] histogram, then scatter position
+  size_t* part_offsets; // start of every partition in order
+  size_t thread_count;
+  size_t count;
+} HM_BuildShared;
+
+typedef struct{
+  HM_BuildShared* shared;
+  size_t index;
+  bool ok;
+} HM_BuildTask;
+
+// slots[] marker for inputs that are empty slots of the source table
+#define HM_BUILD_SKIP ((size_t)-1)
+
+static size_t HM_build_part_of(HM_BuildShared* build, size_t hash){
+  size_t part = (hash % build->self->capacity) / (build->self->capacity / build->thread_count);
+  return part < build->thread_count ? part : build->thread_count - 1;
+}
+
+static const void* HM_build_key(HM_BuildShared* build, size_t input){
+  return build->source != NULL ? HM_entry_index(build->source, input)->key : build->keys[input];
+}
+
+static const void* HM_build_value(HM_BuildShared* build, size_t input){
+  return build->source != NULL ? 
+    HM_entry_index(build->source, input)->value : build->values + input*build->self->element_size;
+}
+
+// stores key in a free slot, keys of a source table are handed over instead of copied
+static bool HM_build_store(HM_BuildShared* build, HM_Entry* entry, size_t input){
+  if(build->source == NULL) return HM_store_key(entry, build->keys[input], build->key_lens[input]);
+  entry->key = HM_entry_index(build->source, input)->key;
+  entry->key_len = build->key_lens[input];
+  return true;
+}
+
+// hashes an input chunk and counts how many of its keys fall into every partition
+static void* HM_build_hash_worker(void* arg){
+  HM_BuildTask* task = (HM_BuildTask*)arg;
+  HM_BuildShared* build = task->shared;
+  size_t begin, end;
+  HM_part_bounds(build->count, task->index, build->thread_count, &begin, &end);
+  size_t* histogram = &build->offsets[task->index*build->thread_count];
+  for(size_t i = begin; i < end; ++i){
+    const void* key = HM_build_key(build, i);
+    if(key == NULL){
+      build->slots[i] = HM_BUILD_SKIP;
+      continue;
+    }
+    if(build->source != NULL) build->key_lens[i] = HM_entry_index(build->source, i)->key_len;
+    else if(build->input_lens != NULL) build->key_lens[i] = build->input_lens[i];
+    else build->key_lens[i] = strlen((const char*)key);
+    build->hashes[i] = build->self->hash_func((const char*)key, build->key_lens[i]);
+    histogram[HM_build_part_of(build, build->hashes[i])]++;
+  }
+  return NULL;
+}
+
+static void* HM_build_scatter_worker(void* arg){
+  HM_BuildTask* task = (HM_BuildTask*)arg;
+  HM_BuildShared* build = task->shared;
+  size_t begin, end;
+  HM_part_bounds(build->count, task->index, build->thread_count, &begin, &end);
+  size_t* positions = &build->offsets[task->index*build->thread_count];
+  for(size_t i = begin; i < end; ++i){
+    if(build->slots[i] == HM_BUILD_SKIP) continue;
+    build->order[positions[HM_build_part_of(build, build->hashes[i])]++] = i;
+  }
+  return NULL;
+}
+
+// inserts the inputs of one partition without ever probing outside of its slot range
+static void* HM_build_insert_worker(void* arg){
+  HM_BuildTask* task = (HM_BuildTask*)arg;
+  HM_BuildShared* build = task->shared;
+  HM* self = build->self;
+  size_t begin, end;
+  HM_part_bounds(self->capacity, task->index, build->thread_count, &begin, &end);
+  task->ok = true;
+  for(size_t k = build->part_offsets[task->index]; k < build->part_offsets[task->index + 1]; ++k){
+    size_t input = build->order[k];
+    size_t i = build->hashes[input] % self->capacity;
+    for(; i < end; ++i){
+      HM_Entry* entry = HM_entry_index(self, i);
+      if(entry->key == NULL){
+        if(!HM_build_store(build, entry, input)){
+          task->ok = false;
+          return NULL;
+        }
+        break;
+      }
+      // keys of a source table are unique
+      if(build->source == NULL && HM_key_eq(entry, build->keys[input], build->key_lens[input])) break;
+    }
+    build->slots[input] = i < end ? i : self->capacity;
+    if(i < end){
+      memcpy(HM_entry_index(self, i)->value, HM_build_value(build, input), self->element_size);
+    }
+  }
+  return NULL;
+}
+
+// translates the insertion order of the source table to the slots its entries moved to
+static void* HM_build_relink_worker(void* arg){
+  HM_BuildTask* task = (HM_BuildTask*)arg;
+  HM_BuildShared* build = task->shared;
+  size_t begin, end;
+  HM_part_bounds(build->count, task->index, build->thread_count, &begin, &end);
+  for(size_t i = begin; i < end; ++i){
+    if(build->slots[i] == HM_BUILD_SKIP) continue;
+    HM_Entry* entry = HM_entry_index(build->source, i);
+    HM_Entry* moved = HM_entry_index(build->self, build->slots[i]);
+    moved->next = build->slots[entry->next];
+    moved->prev = build->slots[entry->prev];
+  }
+  return NULL;
+}
+
+// inserts count inputs into the empty table build->self using thread_count threads, on 
+// failure the keys stored so far are left in self for the caller to clean up
+static bool HM_build_run(HM_BuildShared* build, size_t thread_count){
+  HM* self = build->self;
+  if(thread_count == 0) thread_count = 1;
+  if(thread_count > self->capacity) thread_count = self->capacity;
+  build->thread_count = thread_count;
+
+  size_t n = build->count > 0 ? build->count : 1;
+  build->key_lens = (size_t*)HM_CALLOC(n, sizeof(size_t));
+  build->hashes = (size_t*)HM_CALLOC(n, sizeof(size_t));
+  build->slots = (size_t*)HM_CALLOC(n, sizeof(size_t));
+  build->order = (size_t*)HM_CALLOC(n, sizeof(size_t));
+  build->offsets = (size_t*)HM_CALLOC(thread_count*thread_count, sizeof(size_t));
+  build->part_offsets = (size_t*)HM_CALLOC(thread_count + 1, sizeof(size_t));
+  HM_BuildTask* tasks = (HM_BuildTask*)HM_CALLOC(thread_count, sizeof(HM_BuildTask));
+  unsigned char* linked = build->source == NULL ? 
+    (unsigned char*)HM_CALLOC(self->capacity, sizeof(unsigned char)) : NULL;
+  bool ok = build->key_lens != NULL && build->hashes != NULL && build->slots != NULL && 
+    build->order != NULL && build->offsets != NULL && build->part_offsets != NULL && 
+    tasks != NULL && (linked != NULL || build->source != NULL);
+
+  if(ok){
+    for(size_t t = 0; t < thread_count; ++t){
+      tasks[t].shared = build;
+      tasks[t].index = t;
+    }
+    HM_run_tasks(tasks, sizeof(HM_BuildTask), thread_count, HM_build_hash_worker);
+
+    // turn the per chunk histograms into scatter positions, partition major
+    size_t position = 0;
+    for(size_t part = 0; part < thread_count; ++part){
+      build->part_offsets[part] = position;
+      for(size_t chunk = 0; chunk < thread_count; ++chunk){
+        size_t part_count = build->offsets[chunk*thread_count + part];
+        build->offsets[chunk*thread_count + part] = position;
+        position += part_count;
+      }
+    }
+    build->part_offsets[thread_count] = position;
+    HM_run_tasks(tasks, sizeof(HM_BuildTask), thread_count, HM_build_scatter_worker);
+    HM_run_tasks(tasks, sizeof(HM_BuildTask), thread_count, HM_build_insert_worker);
+    for(size_t t = 0; t < thread_count; ++t){
+      ok = ok && tasks[t].ok;
+    }
+  }
+
+  // inputs that ran past the end of their partition, in input order so the last value wins
+  for(size_t input = 0; input < build->count && ok; ++input){
+    if(build->slots[input] != self->capacity) continue;
+    const void* key = HM_build_key(build, input);
+    size_t i = build->hashes[input] % self->capacity;
+    HM_Entry* entry = HM_entry_index(self, i);
+    while(entry->key != NULL && !HM_key_eq(entry, key, build->key_lens[input])){
+      i = (i+1) % self->capacity;
+      entry = HM_entry_index(self, i);
+    }
+    if(entry->key == NULL) ok = HM_build_store(build, entry, input);
+    if(ok) memcpy(entry->value, HM_build_value(build, input), self->element_size);
+    build->slots[input] = i;
+  }
+
+  if(ok && build->source != NULL){
+    HM_run_tasks(tasks, sizeof(HM_BuildTask), thread_count, HM_build_relink_worker);
+    if(build->source->count > 0){
+      self->first = build->slots[build->source->first];
+      self->last = build->slots[build->source->last];
+    }
+    self->count = build->source->count;
+  }else{
+    // insertion order follows the first occurrence of every key
+    for(size_t input = 0; input < build->count && ok; ++input){
+      if(linked[build->slots[input]]) continue;
+      linked[build->slots[input]] = 1;
+      HM_link(self, build->slots[input]);
+    }
+  }
+
+  HM_FREE(linked);
+  HM_FREE(tasks);
+  HM_FREE(build->part_offsets);
+  HM_FREE(build->offsets);
+  HM_FREE(build->order);
+  HM_FREE(build->slots);
+  HM_FREE(build->hashes);
+  HM_FREE(build->key_lens);
+  return ok;
+}
+
+bool HM_build_parallel(HM* self, size_t element_size, const void* const* keys, const size_t* key_lens, 
+    const void* values, size_t count, size_t thread_count){
+  if(!HM_init(self, element_size, count > 0 ? count*2 : 0)) return false;
+
+  HM_BuildShared build = {0};
+  build.self = self;
+  build.keys = keys;
+  build.input_lens = key_lens;
+  build.values = (const unsigned char*)values;
+  build.count = count;
+  bool ok = HM_build_run(&build, thread_count);
+  if(!ok){
+    for(size_t i = 0; i < self->capacity; ++i){
+      HM_FREE(HM_entry_index(self, i)->key);
+    }
+    HM_FREE(self->entries);
+  }
+  HM* built = ok ? self : NULL;
+  HM_CHECK_ALLOC(built);
+  return true;
 }
 
-HM_Iterator HM_kwl_find(HM* self, const void* key, size_t key_len){
-  size_t hash = self->hash_func((const char*)key, key_len) % self->capacity;
-  size_t i = hash;
-  HM_Entry* entry = HM_entry_index(self, i);
-  while(entry->key == NULL || 
-      (entry->key_len != key_len || 
-      (entry->key[0] != ((const char*)key)[0] ||
-       memcmp(entry->key, key, key_len) != 0))
-  ){
-    i = (i+1) % self->capacity;
-    if(i == hash){
-      return NULL;
+static bool HM_rehash_parallel_to(HM* self, size_t capacity, size_t thread_count, HM* out){
+  memset(out, 0, sizeof(*out));
+  out->hash_func = self->hash_func != NULL ? self->hash_func : HM_HASH;
+  out->grow_threads = self->grow_threads;
+  out->key_block = self->key_block;
+  out->key_block_size = self->key_block_size;
+  if(!HM_allocate(out, self->element_size, capacity)){
+    return false;
+  }
+
+  HM_BuildShared build = {0};
+  build.self = out;
+  build.source = self;
+  build.count = self->capacity;
+  if(!HM_build_run(&build, thread_count)){
+    // keys were only handed over, self still owns all of them
+    HM_FREE(out->entries);
+    HM_CHECK_ALLOC(NULL);
+  }
+  return true;
+}
+
+void HM_set_grow_threads(HM* self, size_t thread_count){
+  self->grow_threads = thread_count;
+}
+
+// slot values of HM_LockFree above HM_LF_VALUE_MAX, a slot starts out as NEVER and only becomes 
+// TOMBSTONE after holding a value. PRIME is set on a value while it is copied to the next table
+// and MOVED marks a slot whose contents now live in the next table
+#define HM_LF_NEVER ((uint64_t)INT64_MAX)
+#define HM_LF_TOMBSTONE ((uint64_t)INT64_MAX - 1)
+#define HM_LF_PRIME ((uint64_t)1 << 63)
+#define HM_LF_MOVED ((uint64_t)-1)
+
+#define HM_LF_COPY_CHUNK 1024
+
+typedef enum{
+  HM_LF_OP_SET,
+  HM_LF_OP_ADD,
+  HM_LF_OP_REMOVE,
+  HM_LF_OP_COPY, // only writes a slot that never held a value
+} HM_LFOp;
+
+static uint64_t HM_lf_hash(uint64_t key){
+  key ^= key >> 30;
+  key *= 0xbf58476d1ce4e5b9ULL;
+  key ^= key >> 27;
+  key *= 0x94d049bb133111ebULL;
+  key ^= key >> 31;
+  return key;
+}
+
+static HM_LFTable* HM_lf_table_new(size_t capacity){
+  HM_LFTable* table = (HM_LFTable*)HM_CALLOC(1, sizeof(HM_LFTable) + capacity*sizeof(HM_LFSlot));
+  if(table == NULL) return NULL;
+  table->capacity = capacity;
+  atomic_init(&table->used, 0);
+  atomic_init(&table->copy_index, 0);
+  atomic_init(&table->copied, 0);
+  atomic_init(&table->next, NULL);
+  for(size_t i = 0; i < capacity; ++i){
+    atomic_init(&table->slots[i].key, HM_LF_EMPTY_KEY);
+    atomic_init(&table->slots[i].value, HM_LF_NEVER);
+  }
+  return table;
+}
+
+static size_t HM_lf_reprobe_limit(HM_LFTable* table){
+  return 10 + (table->capacity >> 2);
+}
+
+// returns the table following table, allocating it if no resize was started yet
+static HM_LFTable* HM_lf_resize(HM_LockFree* self, HM_LFTable* table){
+  HM_LFTable* next = atomic_load(&table->next);
+  if(next != NULL) return next;
+
+  // a table that is mostly filled with removed keys is copied at the same size
+  size_t capacity = table->capacity;
+  if(atomic_load(&self->count)*4 >= capacity) capacity *= 2;
+  HM_LFTable* fresh = HM_lf_table_new(capacity);
+  if(fresh == NULL) return NULL;
+  if(!atomic_compare_exchange_strong(&table->next, &next, fresh)){
+    HM_FREE(fresh);
+    return next;
+  }
+  atomic_fetch_add(&self->table_count, 1);
+  return fresh;
+}
+
+static atomic_size_t HM_lf_thread_count;
+static _Thread_local size_t HM_lf_thread_slot = SIZE_MAX;
+
+// counts an operation in the current epoch, returns the counter to pass to HM_lf_exit()
+static _Atomic size_t* HM_lf_enter(HM_LockFree* self){
+  if(HM_lf_thread_slot == SIZE_MAX){
+    HM_lf_thread_slot = atomic_fetch_add(&HM_lf_thread_count, 1) % HM_MAX_READERS;
+  }
+  HM_LFReaderSlot* slot = &self->readers[HM_lf_thread_slot];
+  for(;;){
+    size_t epoch = atomic_load(&self->epoch);
+    _Atomic size_t* active = &slot->active[epoch % 3];
+    atomic_fetch_add(active, 1);
+    // only count in an epoch that is still current, or the reclaimer could miss us
+    if(atomic_load(&self->epoch) == epoch) return active;
+    atomic_fetch_sub(active, 1);
+  }
+}
+
+static void HM_lf_exit(_Atomic size_t* active){
+  atomic_fetch_sub(active, 1);
+}
+
+static void HM_lf_retire(HM_LockFree* self, HM_LFTable* table){
+  HM_LFTable* head = atomic_load(&self->retired);
+  do{
+    table->retired_next = head;
+  }while(!atomic_compare_exchange_weak(&self->retired, &head, table));
+}
+
+// advances the epoch once no operation of the previous epoch is running and frees the tables 
+// retired at least two epochs ago, every operation that could have reached them has finished
+static void HM_lf_reclaim(HM_LockFree* self){
+  size_t epoch = atomic_load(&self->epoch);
+  bool drained = true;
+  for(size_t i = 0; i < HM_MAX_READERS && drained; ++i){
+    drained = atomic_load(&self->readers[i].active[(epoch + 2) % 3]) == 0;
+  }
+  if(drained) atomic_compare_exchange_strong(&self->epoch, &epoch, epoch + 1);
+  epoch = atomic_load(&self->epoch);
+
+  HM_LFTable* table = atomic_exchange(&self->retired, NULL);
+  while(table != NULL){
+    HM_LFTable* next = table->retired_next;
+    if(table->retired_epoch + 2 <= epoch){
+      HM_FREE(table);
+      atomic_fetch_sub(&self->table_count, 1);
+    }else{
+      HM_lf_retire(self, table);
     }
-    entry = HM_entry_index(self, i);
+    table = next;
   }
-  HM_Iterator it = &self->first;
-  HM_Entry* prev = HM_entry_index(self, entry->prev);
-  if(i != self->first){
-    it = &prev->next;
+}
+
+// makes the next table the top table once every slot of table has been moved
+static void HM_lf_promote(HM_LockFree* self, HM_LFTable* table){
+  if(atomic_load(&table->copied) == table->capacity){
+    HM_LFTable* expected = table;
+    if(atomic_compare_exchange_strong(&self->top, &expected, atomic_load(&table->next))){
+      // new operations can't reach table anymore, running ones may still be using it
+      table->retired_epoch = atomic_load(&self->epoch);
+      HM_lf_retire(self, table);
+      HM_lf_reclaim(self);
+    }
   }
-  return it;
 }
 
-HM_Iterator HM_find(HM* self, const char* key){
-  return HM_kwl_find(self, key, strlen(key));
+static bool HM_lf_update(HM_LockFree* self, HM_LFTable* table, uint64_t key, HM_LFOp op, uint64_t arg, uint64_t* result);
+
+// moves slot i of table to the next table, on return the slot is guaranteed to be MOVED
+static void HM_lf_copy_slot(HM_LockFree* self, HM_LFTable* table, size_t i){
+  HM_LFSlot* slot = &table->slots[i];
+  uint64_t value = atomic_load(&slot->value);
+  while(!(value & HM_LF_PRIME)){
+    uint64_t boxed = value == HM_LF_NEVER || value == HM_LF_TOMBSTONE ? HM_LF_MOVED : (value | HM_LF_PRIME);
+    if(atomic_compare_exchange_strong(&slot->value, &value, boxed)){
+      value = boxed;
+      if(boxed == HM_LF_MOVED && atomic_fetch_add(&table->copied, 1) + 1 == table->capacity){
+        HM_lf_promote(self, table);
+      }
+    }
+  }
+  if(value == HM_LF_MOVED) return;
+
+  // the value can't change anymore, any newer value already in the next table wins
+  HM_lf_update(self, atomic_load(&table->next), atomic_load(&slot->key), HM_LF_OP_COPY, value & ~HM_LF_PRIME, NULL);
+  if(atomic_compare_exchange_strong(&slot->value, &value, HM_LF_MOVED) &&
+     atomic_fetch_add(&table->copied, 1) + 1 == table->capacity){
+    HM_lf_promote(self, table);
+  }
 }
 
-void* HM_get(HM* self, const char* key){
-  if(self->count == 0) return NULL;
-  return HM_value_at(self, HM_kwl_find(self, key, strlen(key)));
+// copies a chunk of slots of table that no other thread has claimed yet
+static void HM_lf_help_copy(HM_LockFree* self, HM_LFTable* table){
+  size_t begin = atomic_fetch_add(&table->copy_index, HM_LF_COPY_CHUNK);
+  if(begin >= table->capacity) return;
+  size_t end = begin + HM_LF_COPY_CHUNK < table->capacity ? begin + HM_LF_COPY_CHUNK : table->capacity;
+  for(size_t i = begin; i < end; ++i){
+    HM_lf_copy_slot(self, table, i);
+  }
 }
 
-void* HM_kwl_get(HM* self, const void* key, size_t key_len){
-  if(self->count == 0) return NULL;
-  return HM_value_at(self, HM_kwl_find(self, key, key_len));
+static HM_LFTable* HM_lf_top(HM_LockFree* self){
+  HM_LFTable* top = atomic_load(&self->top);
+  while(atomic_load(&top->copied) == top->capacity){
+    HM_lf_promote(self, top);
+    top = atomic_load(&self->top);
+  }
+  return top;
 }
 
-void HM_kwl_remove(HM* self, const void* key, size_t key_len){
-  if(self->count == 0) return;
+// applies op to key starting at table, moving on to newer tables whenever the key's slot has 
+// been (or is being) migrated. returns false only if a required resize failed to allocate
+static bool HM_lf_update(HM_LockFree* self, HM_LFTable* table, uint64_t key, HM_LFOp op, uint64_t arg, uint64_t* result){
+  uint64_t hash = HM_lf_hash(key);
+  for(;;){
+    size_t mask = table->capacity - 1;
+    size_t limit = HM_lf_reprobe_limit(table);
+    size_t i = table->capacity;
+    bool moved = false;
+    for(size_t n = 0; n < limit; ++n){
+      size_t candidate = (hash + n) & mask;
+      HM_LFSlot* slot = &table->slots[candidate];
+      uint64_t slot_key = atomic_load(&slot->key);
+      if(slot_key == HM_LF_EMPTY_KEY){
+        if(atomic_load(&slot->value) == HM_LF_MOVED){
+          moved = true;
+          break;
+        }
+        if(op == HM_LF_OP_REMOVE) return true;
+        if(atomic_compare_exchange_strong(&slot->key, &slot_key, key)){
+          if((atomic_fetch_add(&table->used, 1) + 1)*2 >= table->capacity){
+            HM_lf_resize(self, table);
+          }
+          i = candidate;
+          break;
+        }
+      }
+      if(slot_key == key){
+        i = candidate;
+        break;
+      }
+    }
 
-  HM_Iterator it = HM_kwl_find(self, key, key_len);
-  if(it == NULL) return;
-  size_t i = *it;
+    if(moved){
+      table = atomic_load(&table->next);
+      continue;
+    }
+    if(i == table->capacity){
+      // probe window is full, the key can only live in a newer table
+      if(op == HM_LF_OP_REMOVE && atomic_load(&table->next) == NULL) return true;
+      HM_LFTable* next = HM_lf_resize(self, table);
+      HM_CHECK_ALLOC(next);
+      HM_lf_help_copy(self, table);
+      table = next;
+      continue;
+    }
 
-  HM_FREE(HM_entry_index(self, i)->key);
-  HM_entry_index(self, i)->key = NULL;
-  HM_entry_index(self, i)->key_len = 0;
-  
-  size_t prev_index = HM_entry_index(self, i)->prev;
-  size_t next_index = HM_entry_index(self, i)->next;
-  
-  if(i == self->first){
-    self->first = next_index;
-  }else if (i == self->last){
-    self->last = prev_index;
-  }else{
-    HM_entry_index(self, next_index)->prev = prev_index;
-    HM_entry_index(self, prev_index)->next = next_index;
+    HM_LFSlot* slot = &table->slots[i];
+    if(atomic_load(&table->next) != NULL){
+      // the key has to be moved out of this table before it can be updated in the next one
+      HM_lf_copy_slot(self, table, i);
+      HM_lf_help_copy(self, table);
+      table = atomic_load(&table->next);
+      continue;
+    }
+
+    uint64_t current = atomic_load(&slot->value);
+    for(;;){
+      if(current & HM_LF_PRIME) break;
+
+      bool absent = current == HM_LF_NEVER || current == HM_LF_TOMBSTONE;
+      uint64_t desired;
+      switch(op){
+        case HM_LF_OP_SET:    desired = arg; break;
+        case HM_LF_OP_ADD:    desired = (absent ? 0 : current) + arg; break;
+        case HM_LF_OP_REMOVE: if(absent) return true; desired = HM_LF_TOMBSTONE; break;
+        case HM_LF_OP_COPY:   if(current != HM_LF_NEVER) return true; desired = arg; break;
+        default:              return false;
+      }
+      HM_ASSERT(desired <= HM_LF_VALUE_MAX || desired == HM_LF_TOMBSTONE);
+
+      if(atomic_compare_exchange_strong(&slot->value, &current, desired)){
+        if(op != HM_LF_OP_COPY){
+          if(absent && desired != HM_LF_TOMBSTONE) atomic_fetch_add(&self->count, 1);
+          if(!absent && desired == HM_LF_TOMBSTONE) atomic_fetch_sub(&self->count, 1);
+        }
+        if(result != NULL) *result = desired;
+        return true;
+      }
+    }
+
+    // a migration started in between, follow the value to the next table
+    HM_lf_copy_slot(self, table, i);
+    table = atomic_load(&table->next);
   }
+}
 
-  self->count--;
+bool HM_lf_init(HM_LockFree* self, size_t capacity){
+  if(capacity == 0) capacity = HM_DEFAULT_CAPACITY;
+  size_t pow2 = 16;
+  while(pow2 < capacity) pow2 <<= 1;
+  HM_LFTable* table = HM_lf_table_new(pow2);
+  HM_CHECK_ALLOC(table);
+  atomic_init(&self->top, table);
+  atomic_init(&self->retired, NULL);
+  atomic_init(&self->epoch, 1);
+  atomic_init(&self->count, 0);
+  atomic_init(&self->table_count, 1);
+  for(size_t i = 0; i < HM_MAX_READERS; ++i){
+    for(size_t e = 0; e < 3; ++e){
+      atomic_init(&self->readers[i].active[e], 0);
+    }
+  }
+  return true;
 }
 
-void HM_remove(HM* self, const char* key){
-  HM_kwl_remove(self, key, strlen(key));
+void HM_lf_deinit(HM_LockFree* self){
+  HM_LFTable* table = atomic_load(&self->retired);
+  while(table != NULL){
+    HM_LFTable* next = table->retired_next;
+    HM_FREE(table);
+    table = next;
+  }
+  table = atomic_load(&self->top);
+  while(table != NULL){
+    HM_LFTable* next = atomic_load(&table->next);
+    HM_FREE(table);
+    table = next;
+  }
 }
 
-bool HM_allocate(HM* self, size_t element_size, size_t capacity){
-  self->capacity = capacity;
-  element_size = element_size+(element_size%sizeof(void*)); // make sure memory is aligned
+static bool HM_lf_lookup(HM_LockFree* self, uint64_t key, uint64_t* value){
+  uint64_t hash = HM_lf_hash(key);
+  for(HM_LFTable* table = HM_lf_top(self); table != NULL; table = atomic_load(&table->next)){
+    size_t mask = table->capacity - 1;
+    size_t limit = HM_lf_reprobe_limit(table);
+    for(size_t n = 0; n < limit; ++n){
+      HM_LFSlot* slot = &table->slots[(hash + n) & mask];
+      uint64_t slot_key = atomic_load(&slot->key);
+      if(slot_key == HM_LF_EMPTY_KEY){
+        if(atomic_load(&slot->value) != HM_LF_MOVED) return false;
+        break;
+      }
+      if(slot_key == key){
+        uint64_t current = atomic_load(&slot->value);
+        if(current == HM_LF_NEVER || current == HM_LF_TOMBSTONE) return false;
+        if(current == HM_LF_MOVED) break;
+        // a primed value is still the latest one, nothing can update it until it is copied
+        *value = current & ~HM_LF_PRIME;
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+bool HM_lf_get(HM_LockFree* self, uint64_t key, uint64_t* value){
+  HM_ASSERT(key != HM_LF_EMPTY_KEY);
+  _Atomic size_t* active = HM_lf_enter(self);
+  bool found = HM_lf_lookup(self, key, value);
+  HM_lf_exit(active);
+  return found;
+}
+
+bool HM_lf_set(HM_LockFree* self, uint64_t key, uint64_t value){
+  HM_ASSERT(key != HM_LF_EMPTY_KEY);
+  HM_ASSERT(value <= HM_LF_VALUE_MAX);
+  _Atomic size_t* active = HM_lf_enter(self);
+  bool ok = HM_lf_update(self, HM_lf_top(self), key, HM_LF_OP_SET, value, NULL);
+  HM_lf_exit(active);
+  return ok;
+}
+
+bool HM_lf_add(HM_LockFree* self, uint64_t key, uint64_t delta, uint64_t* result){
+  HM_ASSERT(key != HM_LF_EMPTY_KEY);
+  _Atomic size_t* active = HM_lf_enter(self);
+  bool ok = HM_lf_update(self, HM_lf_top(self), key, HM_LF_OP_ADD, delta, result);
+  HM_lf_exit(active);
+  return ok;
+}
+
+void HM_lf_remove(HM_LockFree* self, uint64_t key){
+  HM_ASSERT(key != HM_LF_EMPTY_KEY);
+  _Atomic size_t* active = HM_lf_enter(self);
+  HM_lf_update(self, HM_lf_top(self), key, HM_LF_OP_REMOVE, 0, NULL);
+  HM_lf_exit(active);
+}
+
+size_t HM_lf_count(HM_LockFree* self){
+  return atomic_load(&self->count);
+}
+
+#endif // HM_ENABLE_THREADS
+
+#ifdef HM_ENABLE_POSIX
+bool HM_frozen_open(HM_Frozen* self, const char* path, HM_HashFunc hash_func){
+  memset(self, 0, sizeof(*self));
+  int fd = open(path, O_RDONLY);
+  if(fd < 0) return false;
+  struct stat info;
+  if(fstat(fd, &info) != 0 || info.st_size <= 0){
+    close(fd);
+    return false;
+  }
+  void* data = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  // the mapping stays valid after the descriptor is closed
+  close(fd);
+  if(data == MAP_FAILED) return false;
+  if(!HM_frozen_from_memory(self, data, (size_t)info.st_size, hash_func)){
+    munmap(data, (size_t)info.st_size);
+    return false;
+  }
+  self->mapped = true;
+  return true;
+}
+
+void HM_frozen_close(HM_Frozen* self){
+  if(self->mapped) munmap((void*)self->data, self->size);
+  memset(self, 0, sizeof(*self));
+}
+
+#define HM_PERSISTENT_VERSION 1
+#define HM_PERSISTENT_KEY_HEAP 4096
+// set on the key offset of entries that still have to be moved while the table grows
+#define HM_PERSISTENT_UNPLACED ((uint64_t)1 << 63)
+
+typedef struct{
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint64_t element_size;
+  uint64_t capacity;
+  uint64_t count;
+  uint64_t tombstones;
+  uint64_t key_bytes;
+  uint64_t hash_check;
+} HM_PersistentHeader;
+
+// slots keep the hash so growing never has to read the keys back from the key heap
+typedef struct{
+  uint64_t key_offset;    // offset + 1 into the key heap, 0 for empty slots and tombstones
+  uint64_t key_len;       // UINT64_MAX for tombstones
+  uint64_t hash;
+  unsigned char value[];
+} HM_PersistentSlot;
+
+#define HM_persistent_header(self) ((HM_PersistentHeader*)(self)->table)
+
+static HM_PersistentSlot* HM_persistent_slot(HM_Persistent* self, size_t i){
+  return (HM_PersistentSlot*)(self->table + sizeof(HM_PersistentHeader) + i*self->slot_size);
+}
+
+// grows the file to size and maps it again, the old mapping stays valid if this fails
+static bool HM_persistent_remap(int fd, void** mapping, size_t* mapped_size, size_t size){
+  if(ftruncate(fd, (off_t)size) != 0) return false;
+  void* data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if(data == MAP_FAILED) return false;
+  if(*mapping != NULL) munmap(*mapping, *mapped_size);
+  *mapping = data;
+  *mapped_size = size;
+  return true;
+}
+
+static bool HM_persistent_map_existing(int fd, void** mapping, size_t* mapped_size){
+  struct stat info;
+  if(fstat(fd, &info) != 0) return false;
+  if(info.st_size == 0) return true;
+  void* data = mmap(NULL, (size_t)info.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if(data == MAP_FAILED) return false;
+  *mapping = data;
+  *mapped_size = (size_t)info.st_size;
+  return true;
+}
+
+bool HM_persistent_open(HM_Persistent* self, const char* path, size_t element_size, HM_HashFunc hash_func){
+  memset(self, 0, sizeof(*self));
+  self->fd = -1;
+  self->key_fd = -1;
   self->element_size = element_size;
-  
-  //self->entries = (unsigned char*)HM_CALLOC(capacity, sizeof(HM_Entry)+element_size);
-  self->entries = (unsigned char*)HM_CALLOC(capacity, (sizeof(HM_Entry)+element_size));
-  HM_CHECK_ALLOC(self->entries);
-  memset(self->entries, 0, capacity*(sizeof(HM_Entry)+element_size));
- return true;
+  self->slot_size = sizeof(HM_PersistentSlot) + ((element_size + 7) & ~(size_t)7);
+  self->hash_func = hash_func != NULL ? hash_func : HM_HASH;
+
+  size_t path_len = strlen(path);
+  char* key_path = (char*)HM_CALLOC(path_len + sizeof(".keys"), 1);
+  if(key_path == NULL) return false;
+  memcpy(key_path, path, path_len);
+  memcpy(key_path + path_len, ".keys", sizeof(".keys"));
+  self->fd = open(path, O_RDWR | O_CREAT, 0644);
+  self->key_fd = open(key_path, O_RDWR | O_CREAT, 0644);
+  HM_FREE(key_path);
+
+  void* table = NULL;
+  void* keys = NULL;
+  bool ok = self->fd >= 0 && self->key_fd >= 0 && 
+    HM_persistent_map_existing(self->fd, &table, &self->table_size) &&
+    HM_persistent_map_existing(self->key_fd, &keys, &self->keys_size);
+  self->table = (unsigned char*)table;
+  self->keys = (char*)keys;
+
+  if(ok && self->table == NULL){
+    HM_PersistentHeader header = {{'H', 'M', 'P', 'E', 'R', 'S', 'I', 'S'}, HM_PERSISTENT_VERSION, 0x01020304, 
+      element_size, HM_DEFAULT_CAPACITY, 0, 0, 0, HM_hash_check(self->hash_func)};
+    if(self->keys != NULL){
+      munmap(self->keys, self->keys_size);
+      self->keys = NULL;
+    }
+    ok = HM_persistent_remap(self->fd, &table, &self->table_size, 
+        sizeof(HM_PersistentHeader) + HM_DEFAULT_CAPACITY*self->slot_size) &&
+      HM_persistent_remap(self->key_fd, &keys, &self->keys_size, HM_PERSISTENT_KEY_HEAP);
+    self->table = (unsigned char*)table;
+    self->keys = (char*)keys;
+    if(ok) memcpy(self->table, &header, sizeof(header));
+  }else if(ok){
+    const HM_PersistentHeader* header = HM_persistent_header(self);
+    ok = self->table_size >= sizeof(*header) && memcmp(header->magic, "HMPERSIS", 8) == 0 &&
+      header->version == HM_PERSISTENT_VERSION && header->byte_order == 0x01020304 &&
+      header->element_size == element_size && header->hash_check == HM_hash_check(self->hash_func) &&
+      header->capacity > 0 && header->count + header->tombstones < header->capacity &&
+      (self->table_size - sizeof(*header)) / self->slot_size >= header->capacity &&
+      self->keys != NULL && header->key_bytes <= self->keys_size;
+  }
+  if(!ok) HM_persistent_close(self);
+  return ok;
 }
 
-bool HM_grow(HM* self){
-  HM new_hm = {0};
-  new_hm.hash_func = self->hash_func;
-  if(!HM_allocate(&new_hm, self->element_size, self->capacity * 2)){
+void HM_persistent_close(HM_Persistent* self){
+  if(self->table != NULL) munmap(self->table, self->table_size);
+  if(self->keys != NULL) munmap(self->keys, self->keys_size);
+  if(self->fd >= 0) close(self->fd);
+  if(self->key_fd >= 0) close(self->key_fd);
+  memset(self, 0, sizeof(*self));
+  self->fd = -1;
+  self->key_fd = -1;
+}
+
+bool HM_persistent_sync(HM_Persistent* self){
+  return msync(self->table, self->table_size, MS_SYNC) == 0 && 
+    msync(self->keys, self->keys_size, MS_SYNC) == 0;
+}
+
+static size_t HM_persistent_probe(HM_Persistent* self, const void* key, size_t key_len, uint64_t hash, size_t* free_slot){
+  size_t capacity = HM_persistent_header(self)->capacity;
+  size_t start = hash % capacity;
+  size_t i = start;
+  *free_slot = capacity;
+  do{
+    HM_PersistentSlot* slot = HM_persistent_slot(self, i);
+    if(slot->key_offset == 0){
+      if(*free_slot == capacity) *free_slot = i;
+      if(slot->key_len != UINT64_MAX) break;
+    }else if(slot->hash == hash && slot->key_len == key_len && 
+        memcmp(self->keys + slot->key_offset - 1, key, key_len) == 0){
+      return i;
+    }
+    i = (i+1) % capacity;
+  }while(i != start);
+  return capacity;
+}
+
+// rehashes the table in place after growing the file, every entry is marked unplaced and then 
+// moved to the first slot of its probe sequence that is empty or still holds an unplaced entry, 
+// which is picked up and moved next, so the slots between an entry and its home are never freed
+static bool HM_persistent_grow(HM_Persistent* self){
+  size_t old_capacity = HM_persistent_header(self)->capacity;
+  size_t capacity = HM_persistent_header(self)->count >= old_capacity/4 ? old_capacity*2 : old_capacity;
+  HM_PersistentSlot* carried = (HM_PersistentSlot*)HM_CALLOC(2, self->slot_size);
+  if(carried == NULL) return false;
+  HM_PersistentSlot* spare = (HM_PersistentSlot*)((unsigned char*)carried + self->slot_size);
+  void* table = self->table;
+  if(capacity != old_capacity && 
+      !HM_persistent_remap(self->fd, &table, &self->table_size, sizeof(HM_PersistentHeader) + capacity*self->slot_size)){
+    HM_FREE(carried);
     return false;
   }
+  self->table = (unsigned char*)table;
 
-  // rehash and deinit
-  for(HM_Iterator i = HM_iterate(self, NULL); i != NULL; i = HM_iterate(self, i)){
-    HM_kwl_set(&new_hm, HM_key_at(self, i), *HM_key_len_at(self, i), HM_value_at(self, i));
+  for(size_t i = 0; i < old_capacity; ++i){
+    HM_PersistentSlot* slot = HM_persistent_slot(self, i);
+    if(slot->key_offset != 0) slot->key_offset |= HM_PERSISTENT_UNPLACED;
+    else slot->key_len = 0;
   }
-  HM_deinit(self);
-  
-  *self = new_hm;
+  HM_persistent_header(self)->capacity = capacity;
+  HM_persistent_header(self)->tombstones = 0;
+
+  for(size_t i = 0; i < old_capacity; ++i){
+    HM_PersistentSlot* slot = HM_persistent_slot(self, i);
+    if((slot->key_offset & HM_PERSISTENT_UNPLACED) == 0) continue;
+    memcpy(carried, slot, self->slot_size);
+    memset(slot, 0, self->slot_size);
+    while(true){
+      carried->key_offset &= ~HM_PERSISTENT_UNPLACED;
+      size_t j = carried->hash % capacity;
+      HM_PersistentSlot* target = HM_persistent_slot(self, j);
+      while(target->key_offset != 0 && (target->key_offset & HM_PERSISTENT_UNPLACED) == 0){
+        j = (j+1) % capacity;
+        target = HM_persistent_slot(self, j);
+      }
+      if(target->key_offset == 0){
+        memcpy(target, carried, self->slot_size);
+        break;
+      }
+      memcpy(spare, target, self->slot_size);
+      memcpy(target, carried, self->slot_size);
+      HM_PersistentSlot* swap = carried;
+      carried = spare;
+      spare = swap;
+    }
+  }
+  HM_FREE(carried < spare ? carried : spare);
   return true;
 }
 
-void HM_override_hash_func(HM* self, HM_HashFunc func){
-  self->hash_func = func;
+static bool HM_persistent_store_key(HM_Persistent* self, const void* key, size_t key_len, uint64_t* offset){
+  size_t used = HM_persistent_header(self)->key_bytes;
+  if(self->keys_size - used < key_len){
+    size_t size = self->keys_size*2;
+    while(size - used < key_len) size *= 2;
+    void* keys = self->keys;
+    if(!HM_persistent_remap(self->key_fd, &keys, &self->keys_size, size)) return false;
+    self->keys = (char*)keys;
+  }
+  memcpy(self->keys + used, key, key_len);
+  HM_persistent_header(self)->key_bytes = used + key_len;
+  *offset = used;
+  return true;
 }
 
-bool HM_init(HM* self, size_t element_size, size_t capacity){
+bool HM_persistent_kwl_set(HM_Persistent* self, const void* key, size_t key_len, const void* value){
+  uint64_t hash = (uint64_t)self->hash_func((const char*)key, key_len);
+  size_t free_slot;
+  size_t i = HM_persistent_probe(self, key, key_len, hash, &free_slot);
+  if(i == HM_persistent_header(self)->capacity){
+    HM_PersistentHeader* header = HM_persistent_header(self);
+    if(header->count + header->tombstones + 1 >= header->capacity/2){
+      if(!HM_persistent_grow(self)) return false;
+      HM_persistent_probe(self, key, key_len, hash, &free_slot);
+    }
+    uint64_t offset;
+    if(!HM_persistent_store_key(self, key, key_len, &offset)) return false;
+    header = HM_persistent_header(self);
+    HM_PersistentSlot* slot = HM_persistent_slot(self, free_slot);
+    if(slot->key_len == UINT64_MAX) header->tombstones--;
+    slot->key_offset = offset + 1;
+    slot->key_len = key_len;
+    slot->hash = hash;
+    header->count++;
+    i = free_slot;
+  }
+  memcpy(HM_persistent_slot(self, i)->value, value, self->element_size);
+  return true;
+}
+
+bool HM_persistent_set(HM_Persistent* self, const char* key, const void* value){
+  return HM_persistent_kwl_set(self, key, strlen(key), value);
+}
+
+void* HM_persistent_kwl_get(HM_Persistent* self, const void* key, size_t key_len){
+  size_t free_slot;
+  size_t i = HM_persistent_probe(self, key, key_len, (uint64_t)self->hash_func((const char*)key, key_len), &free_slot);
+  if(i == HM_persistent_header(self)->capacity) return NULL;
+  return HM_persistent_slot(self, i)->value;
+}
+
+void* HM_persistent_get(HM_Persistent* self, const char* key){
+  return HM_persistent_kwl_get(self, key, strlen(key));
+}
+
+void HM_persistent_kwl_remove(HM_Persistent* self, const void* key, size_t key_len){
+  size_t free_slot;
+  size_t i = HM_persistent_probe(self, key, key_len, (uint64_t)self->hash_func((const char*)key, key_len), &free_slot);
+  if(i == HM_persistent_header(self)->capacity) return;
+  HM_PersistentSlot* slot = HM_persistent_slot(self, i);
+  slot->key_offset = 0;
+  slot->key_len = UINT64_MAX;
+  HM_persistent_header(self)->count--;
+  HM_persistent_header(self)->tombstones++;
+}
+
+void HM_persistent_remove(HM_Persistent* self, const char* key){
+  HM_persistent_kwl_remove(self, key, strlen(key));
+}
+
+size_t HM_persistent_count(HM_Persistent* self){
+  return HM_persistent_header(self)->count;
+}
+
+#define HM_JOURNAL_VERSION 1
+#ifndef HM_JOURNAL_GROUP_SIZE
+#define HM_JOURNAL_GROUP_SIZE 64
+#endif
+
+#define HM_JOURNAL_SET 1
+#define HM_JOURNAL_REMOVE 2
+
+typedef struct{
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint64_t element_size;
+} HM_JournalHeader;
+
+// a record is its type, the key length as a varint, the key, the value for sets and the low 
+// 32 bits of the checksum over all of that
+static bool HM_journal_append(HM_Journal* self, unsigned char type, const void* key, size_t key_len, const void* value){
+  unsigned char head[1 + 10];
+  size_t head_len = 0;
+  head[head_len++] = type;
+  for(uint64_t len = key_len; ; len >>= 7){
+    head[head_len++] = (unsigned char)((len & 0x7f) | (len >= 0x80 ? 0x80 : 0));
+    if(len < 0x80) break;
+  }
+  uint64_t checksum = 0xcbf29ce484222325ULL;
+  bool ok = HM_write_checked(self->log, head, head_len, &checksum) &&
+    HM_write_checked(self->log, key, key_len, &checksum) &&
+    (type != HM_JOURNAL_SET || HM_write_checked(self->log, value, self->map.element_size, &checksum));
+  uint32_t check = (uint32_t)checksum;
+  ok = ok && fwrite(&check, sizeof(check), 1, self->log) == 1;
+  if(ok && self->group_size > 0 && ++self->pending >= self->group_size) ok = HM_journal_commit(self);
+  return ok;
+}
+
+// applies the records of the log, returns the offset after the last intact record
+static long HM_journal_replay(HM_Journal* self, long size, bool* ok){
+  long end = ftell(self->log);
+  char* key = NULL;
+  size_t key_capacity = 0;
+  void* value = HM_CALLOC(1, self->map.element_size > 0 ? self->map.element_size : 1);
+  *ok = value != NULL;
+  while(*ok){
+    uint64_t checksum = 0xcbf29ce484222325ULL;
+    unsigned char type;
+    if(!HM_read_checked(self->log, &type, 1, &checksum) || (type != HM_JOURNAL_SET && type != HM_JOURNAL_REMOVE)) break;
+    uint64_t key_len = 0;
+    unsigned char byte = 0x80;
+    for(unsigned shift = 0; (byte & 0x80) && shift < 64; shift += 7){
+      if(!HM_read_checked(self->log, &byte, 1, &checksum)) break;
+      key_len |= (uint64_t)(byte & 0x7f) << shift;
+    }
+    if((byte & 0x80) || key_len > (uint64_t)size) break;
+    if(key_len > key_capacity){
+      char* grown = (char*)HM_CALLOC(key_len, 1);
+      if(grown == NULL){
+        *ok = false;
+        break;
+      }
+      HM_FREE(key);
+      key = grown;
+      key_capacity = key_len;
+    }
+    uint32_t check;
+    if(!HM_read_checked(self->log, key, key_len, &checksum) ||
+        (type == HM_JOURNAL_SET && !HM_read_checked(self->log, value, self->map.element_size, &checksum)) ||
+        fread(&check, sizeof(check), 1, self->log) != 1 || check != (uint32_t)checksum){
+      break;
+    }
+    if(type == HM_JOURNAL_SET) *ok = HM_kwl_set(&self->map, key, key_len, value);
+    else HM_kwl_remove(&self->map, key, key_len);
+    end = ftell(self->log);
+  }
+  HM_FREE(value);
+  HM_FREE(key);
+  return end;
+}
+
+bool HM_journal_open(HM_Journal* self, const char* snapshot_path, const char* log_path, size_t element_size, HM_HashFunc hash_func){
   memset(self, 0, sizeof(*self));
-  self->hash_func = HM_HASH;
-  return HM_allocate(self, element_size, capacity > 0 ? capacity : HM_DEFAULT_CAPACITY);
+  self->group_size = HM_JOURNAL_GROUP_SIZE;
+  size_t path_len = strlen(snapshot_path);
+  self->snapshot_path = (char*)HM_CALLOC(path_len + 1, 1);
+  HM_CHECK_ALLOC(self->snapshot_path);
+  memcpy(self->snapshot_path, snapshot_path, path_len);
+
+  bool ok = true;
+  FILE* snapshot = fopen(snapshot_path, "rb");
+  if(snapshot != NULL){
+    ok = HM_load(&self->map, snapshot, hash_func);
+    fclose(snapshot);
+    if(ok && self->map.element_size != element_size){
+      HM_deinit(&self->map);
+      ok = false;
+    }
+  }else{
+    ok = HM_init(&self->map, element_size, 0);
+    if(ok && hash_func != NULL) self->map.hash_func = hash_func;
+  }
+  if(!ok){
+    HM_FREE(self->snapshot_path);
+    self->snapshot_path = NULL;
+    return false;
+  }
+
+  HM_JournalHeader header = {{'H', 'M', 'J', 'O', 'U', 'R', 'N', 'L'}, HM_JOURNAL_VERSION, 0x01020304, element_size};
+  self->log = fopen(log_path, "r+b");
+  if(self->log != NULL){
+    HM_JournalHeader saved;
+    ok = fseek(self->log, 0, SEEK_END) == 0;
+    long size = ftell(self->log);
+    ok = ok && size >= 0 && fseek(self->log, 0, SEEK_SET) == 0 &&
+      fread(&saved, sizeof(saved), 1, self->log) == 1 && memcmp(&saved, &header, sizeof(header)) == 0;
+    long end = ok ? HM_journal_replay(self, size, &ok) : 0;
+    // cut off a record torn by a crash so new records follow the last intact one
+    if(ok && end < size) ok = ftruncate(fileno(self->log), (off_t)end) == 0;
+    ok = ok && fseek(self->log, end, SEEK_SET) == 0;
+  }else{
+    self->log = fopen(log_path, "w+b");
+    ok = self->log != NULL && fwrite(&header, sizeof(header), 1, self->log) == 1 && HM_journal_commit(self);
+  }
+  if(!ok){
+    if(self->log != NULL) fclose(self->log);
+    self->log = NULL;
+    HM_journal_close(self);
+  }
+  return ok;
 }
 
-void HM_deinit(HM* self){
-  for(HM_Iterator i = HM_iterate(self, NULL); i != NULL; i = HM_iterate(self, i)){
-    HM_FREE((void*)HM_key_at(self, i));
+void HM_journal_close(HM_Journal* self){
+  if(self->log != NULL){
+    HM_journal_commit(self);
+    fclose(self->log);
   }
-  HM_FREE(self->entries);
+  HM_deinit(&self->map);
+  HM_FREE(self->snapshot_path);
+  memset(self, 0, sizeof(*self));
 }
 
-HM* HM_new(size_t element_size, size_t capacity){
-  HM* self = (HM*)HM_CALLOC(1, sizeof(HM));
-  HM_CHECK_ALLOC(self);
-  if(!HM_init(self, element_size, capacity)){
-    HM_deinit(self);
-    return NULL;
+bool HM_journal_commit(HM_Journal* self){
+  self->pending = 0;
+  return fflush(self->log) == 0 && fsync(fileno(self->log)) == 0;
+}
+
+// makes a rename in the directory of path durable
+static bool HM_journal_sync_dir(const char* path){
+  const char* slash = strrchr(path, '/');
+  char* dir = (char*)HM_CALLOC(slash != NULL ? (size_t)(slash - path) + 2 : 2, 1);
+  if(dir == NULL) return false;
+  if(slash == NULL) dir[0] = '.';
+  else if(slash == path) dir[0] = '/';
+  else memcpy(dir, path, (size_t)(slash - path));
+  int fd = open(dir, O_RDONLY);
+  HM_FREE(dir);
+  if(fd < 0) return false;
+  bool ok = fsync(fd) == 0;
+  close(fd);
+  return ok;
+}
+
+bool HM_journal_compact(HM_Journal* self){
+  size_t path_len = strlen(self->snapshot_path);
+  char* temp_path = (char*)HM_CALLOC(path_len + sizeof(".tmp"), 1);
+  if(temp_path == NULL) return false;
+  memcpy(temp_path, self->snapshot_path, path_len);
+  memcpy(temp_path + path_len, ".tmp", sizeof(".tmp"));
+
+  FILE* file = fopen(temp_path, "wb");
+  bool ok = file != NULL && HM_save(&self->map, file) && fflush(file) == 0 && fsync(fileno(file)) == 0;
+  if(file != NULL) ok = fclose(file) == 0 && ok;
+  // the log may only be emptied once the snapshot that replaces it is durable
+  ok = ok && rename(temp_path, self->snapshot_path) == 0 && HM_journal_sync_dir(self->snapshot_path);
+  if(!ok) remove(temp_path);
+  HM_FREE(temp_path);
+
+  ok = ok && fflush(self->log) == 0 && ftruncate(fileno(self->log), (off_t)sizeof(HM_JournalHeader)) == 0 &&
+    fseek(self->log, (long)sizeof(HM_JournalHeader), SEEK_SET) == 0;
+  return ok && HM_journal_commit(self);
+}
+
+bool HM_journal_kwl_set(HM_Journal* self, const void* key, size_t key_len, const void* value){
+  return HM_journal_append(self, HM_JOURNAL_SET, key, key_len, value) && 
+    HM_kwl_set(&self->map, key, key_len, (void*)value);
+}
+
+bool HM_journal_set(HM_Journal* self, const char* key, const void* value){
+  return HM_journal_kwl_set(self, key, strlen(key), value);
+}
+
+void* HM_journal_kwl_merge(HM_Journal* self, const void* key, size_t key_len, const void* value, HM_CombineFunc combine){
+  void* element = HM_kwl_get(&self->map, key, key_len);
+  if(element == NULL){
+    if(!HM_journal_kwl_set(self, key, key_len, value)) return NULL;
+    return HM_kwl_get(&self->map, key, key_len);
   }
-  return self;
+  // the combined value is logged as a set so replaying the log stays idempotent, and the map is 
+  // only changed once that record has been written
+  void* combined = HM_CALLOC(1, self->map.element_size);
+  HM_CHECK_ALLOC(combined);
+  memcpy(combined, element, self->map.element_size);
+  combine(combined, value);
+  bool ok = HM_journal_append(self, HM_JOURNAL_SET, key, key_len, combined);
+  if(ok) memcpy(element, combined, self->map.element_size);
+  HM_FREE(combined);
+  return ok ? element : NULL;
 }
 
-void HM_delete(HM* self){
-  HM_deinit(self);
-  HM_FREE(self);
+void* HM_journal_merge(HM_Journal* self, const char* key, const void* value, HM_CombineFunc combine){
+  return HM_journal_kwl_merge(self, key, strlen(key), value, combine);
+}
+
+bool HM_journal_kwl_remove(HM_Journal* self, const void* key, size_t key_len){
+  if(!HM_journal_append(self, HM_JOURNAL_REMOVE, key, key_len, NULL)) return false;
+  HM_kwl_remove(&self->map, key, key_len);
+  return true;
+}
+
+bool HM_journal_remove(HM_Journal* self, const char* key){
+  return HM_journal_kwl_remove(self, key, strlen(key));
+}
+
+void* HM_journal_kwl_get(HM_Journal* self, const void* key, size_t key_len){
+  return HM_kwl_get(&self->map, key, key_len);
+}
+
+void* HM_journal_get(HM_Journal* self, const char* key){
+  return HM_journal_kwl_get(self, key, strlen(key));
 }
+#endif // HM_ENABLE_POSIX
 
 #endif // HM_IMPLEMENTATION
 #endif // HM_H_
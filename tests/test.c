@@ -1,7 +1,13 @@
+#define _GNU_SOURCE
 #include <stdint.h>
 #include <stdio.h>
 #define HM_IMPLEMENTATION
 #define HM_DISABLE_ALLOC_PANIC
+#define HM_ENABLE_THREADS
+#define HM_PARALLEL_GROW_MIN 4096
+#define HM_LOAD_CHUNK 4096
+#define HM_ENABLE_NUMA
+#define HM_ENABLE_POSIX
 #include "hm.h"
 
 HM_GEN_WRAPPER_PROTOTYPE(int);
@@ -96,6 +102,1416 @@ UTEST(HM_Basic_key_with_length, resize){
   ASSERT_GE(hm.capacity, 3ULL);
 }
 
+UTEST(HM_Get_or_insert, insert_zero_initialized){
+  HM hm = {0};
+  ASSERT_TRUE(HM_int_init(&hm, 0));
+
+  bool inserted = false;
+  int* value = HM_int_get_or_insert(&hm, "key", &inserted);
+  ASSERT_NE(value, NULL);
+  ASSERT_TRUE(inserted);
+  ASSERT_EQ(*value, 0);
+  *value = 5;
+
+  value = HM_int_get_or_insert(&hm, "key", &inserted);
+  ASSERT_FALSE(inserted);
+  ASSERT_EQ(*value, 5);
+  ASSERT_EQ(hm.count, 1ULL);
+  HM_deinit(&hm);
+}
+
+UTEST(HM_Get_or_insert, counting){
+  HM hm = {0};
+  ASSERT_TRUE(HM_int_init(&hm, 2));
+
+  for(int i = 0; i < 1000; ++i){
+    int key = i % 7;
+    int* count = HM_sk_get_or_insert(&hm, key, NULL);
+    ASSERT_NE(count, NULL);
+    (*count)++;
+  }
+
+  ASSERT_EQ(hm.count, 7ULL);
+  int total = 0;
+  for(HM_Iterator i = HM_iterate(&hm, NULL); i != NULL; i = HM_iterate(&hm, i)){
+    total += *HM_int_value_at(&hm, i);
+  }
+  ASSERT_EQ(total, 1000);
+  HM_deinit(&hm);
+}
+
+UTEST(HM_Get_or_insert, reinsert_after_removal){
+  HM hm = {0};
+  ASSERT_TRUE(HM_int_init(&hm, 64));
+
+  // with a constant capacity every key collides with some others, removals leave holes
+  for(int i = 0; i < 30; ++i){
+    ASSERT_TRUE(HM_int_kwl_set(&hm, &i, sizeof(i), i));
+  }
+  for(int i = 0; i < 30; i += 2){
+    HM_kwl_remove(&hm, &i, sizeof(i));
+  }
+  for(int i = 0; i < 30; ++i){
+    bool inserted = false;
+    int* value = HM_int_kwl_get_or_insert(&hm, &i, sizeof(i), &inserted);
+    ASSERT_EQ(inserted, i % 2 == 0);
+    if(inserted) *value = i;
+  }
+  ASSERT_EQ(hm.count, 30ULL);
+
+  for(int i = 0; i < 30; ++i){
+    ASSERT_EQ(*HM_int_kwl_get(&hm, &i, sizeof(i)), i);
+  }
+  int missing = 1000;
+  ASSERT_EQ(HM_sk_get(&hm, missing), NULL);
+  HM_deinit(&hm);
+}
+
+typedef struct{
+  int id;
+  char payload[512];
+} Record;
+
+HM_GEN_WRAPPER_PROTOTYPE(Record);
+HM_GEN_WRAPPER_IMPLEMENTATION(Record);
+
+UTEST(HM_Emplace, fill_in_place){
+  HM hm = {0};
+  ASSERT_TRUE(HM_Record_init(&hm, 2));
+
+  for(int i = 0; i < 100; ++i){
+    Record* record = HM_Record_kwl_emplace(&hm, &i, sizeof(i));
+    ASSERT_NE(record, NULL);
+    record->id = i;
+    memset(record->payload, 'a' + i % 26, sizeof(record->payload));
+  }
+  ASSERT_EQ(hm.count, 100ULL);
+
+  for(int i = 0; i < 100; ++i){
+    Record* record = HM_Record_kwl_get(&hm, &i, sizeof(i));
+    ASSERT_NE(record, NULL);
+    ASSERT_EQ(record->id, i);
+    ASSERT_EQ(record->payload[511], 'a' + i % 26);
+  }
+  HM_deinit(&hm);
+}
+
+UTEST(HM_Emplace, existing_key_returns_same_slot){
+  HM hm = {0};
+  ASSERT_TRUE(HM_int_init(&hm, 0));
+
+  *HM_int_emplace(&hm, "key") = 1;
+  int* slot = HM_int_emplace(&hm, "key");
+  ASSERT_EQ(*slot, 1);
+  *slot = 2;
+  ASSERT_EQ(*HM_int_get(&hm, "key"), 2);
+  ASSERT_EQ(hm.count, 1ULL);
+  HM_deinit(&hm);
+}
+
+static void combine_max(void* existing, const void* value){
+  if(*(const int*)value > *(int*)existing) *(int*)existing = *(const int*)value;
+}
+
+UTEST(HM_Merge, combine_existing){
+  HM hm = {0};
+  ASSERT_TRUE(HM_int_init(&hm, 0));
+
+  int values[] = {3, 9, 4, 1};
+  for(size_t i = 0; i < sizeof(values)/sizeof(values[0]); ++i){
+    ASSERT_NE(HM_int_kwl_merge(&hm, "max", 3, values[i], combine_max), NULL);
+  }
+  ASSERT_EQ(*HM_int_kwl_get(&hm, "max", 3), 9);
+  ASSERT_EQ(hm.count, 1ULL);
+  HM_deinit(&hm);
+}
+
+UTEST(HM_Merge, add_i64){
+  HM hm = {0};
+  ASSERT_TRUE(HM_init(&hm, sizeof(int64_t), 2));
+
+  for(int i = 0; i < 1000; ++i){
+    int key = i % 10;
+    ASSERT_NE(HM_sk_add_i64(&hm, key, i), NULL);
+  }
+  ASSERT_EQ(hm.count, 10ULL);
+
+  int64_t total = 0;
+  for(HM_Iterator i = HM_iterate(&hm, NULL); i != NULL; i = HM_iterate(&hm, i)){
+    total += *(int64_t*)HM_value_at(&hm, i);
+  }
+  ASSERT_EQ(total, 999*1000/2);
+  ASSERT_EQ(*HM_add_i64(&hm, "new", -5), -5);
+  HM_deinit(&hm);
+}
+
+UTEST(HS_Basic, insert_contains_remove){
+  HS hs = {0};
+  ASSERT_TRUE(HS_init(&hs, 2));
+  ASSERT_EQ(hs.element_size, 0ULL);
+
+  ASSERT_TRUE(HS_insert(&hs, "a"));
+  ASSERT_TRUE(HS_insert(&hs, "b"));
+  ASSERT_TRUE(HS_insert(&hs, "a"));
+  ASSERT_EQ(hs.count, 2ULL);
+
+  ASSERT_TRUE(HS_contains(&hs, "a"));
+  ASSERT_TRUE(HS_contains(&hs, "b"));
+  ASSERT_FALSE(HS_contains(&hs, "c"));
+
+  HS_remove(&hs, "a");
+  ASSERT_FALSE(HS_contains(&hs, "a"));
+  ASSERT_EQ(hs.count, 1ULL);
+  HS_deinit(&hs);
+}
+
+UTEST(HS_Basic, sized_keys){
+  HS hs = {0};
+  ASSERT_TRUE(HS_init(&hs, 0));
+
+  for(int i = 0; i < 1000; i += 3){
+    ASSERT_TRUE(HS_sk_insert(&hs, i));
+  }
+  for(int i = 0; i < 1000; ++i){
+    ASSERT_EQ(HS_sk_contains(&hs, i), i % 3 == 0);
+  }
+
+  size_t count = 0;
+  for(HM_Iterator i = HM_iterate(&hs, NULL); i != NULL; i = HM_iterate(&hs, i)){
+    ASSERT_EQ(*HM_key_len_at(&hs, i), sizeof(int));
+    count++;
+  }
+  ASSERT_EQ(count, hs.count);
+  HS_deinit(&hs);
+}
+
+static void fill_range(HS* hs, int from, int to){
+  HS_init(hs, 0);
+  for(int i = from; i < to; ++i){
+    HS_sk_insert(hs, i);
+  }
+}
+
+UTEST(HS_Algebra, intersect_union_difference){
+  HS a = {0}, b = {0}, out = {0};
+  fill_range(&a, 0, 1000);
+  fill_range(&b, 500, 3000);
+
+  ASSERT_TRUE(HS_intersect(&out, &a, &b));
+  ASSERT_EQ(out.count, 500ULL);
+  for(int i = 0; i < 3000; ++i){
+    ASSERT_EQ(HS_sk_contains(&out, i), i >= 500 && i < 1000);
+  }
+  HS_deinit(&out);
+
+  ASSERT_TRUE(HS_union(&out, &a, &b));
+  ASSERT_EQ(out.count, 3000ULL);
+  HS_deinit(&out);
+
+  ASSERT_TRUE(HS_difference(&out, &a, &b));
+  ASSERT_EQ(out.count, 500ULL);
+  for(int i = 0; i < 3000; ++i){
+    ASSERT_EQ(HS_sk_contains(&out, i), i < 500);
+  }
+  HS_deinit(&out);
+
+  HS_deinit(&a);
+  HS_deinit(&b);
+}
+
+UTEST(HS_Algebra, parallel_matches_serial){
+  HS a = {0}, b = {0}, serial = {0}, parallel = {0};
+  fill_range(&a, 0, 20000);
+  fill_range(&b, 15000, 40000);
+
+  ASSERT_TRUE(HS_intersect(&serial, &a, &b));
+  ASSERT_TRUE(HS_intersect_parallel(&parallel, &a, &b, 4));
+  ASSERT_EQ(serial.count, parallel.count);
+  for(HM_Iterator i = HM_iterate(&serial, NULL); i != NULL; i = HM_iterate(&serial, i)){
+    ASSERT_TRUE(HS_kwl_contains(&parallel, HM_key_at(&serial, i), *HM_key_len_at(&serial, i)));
+  }
+  HS_deinit(&serial);
+  HS_deinit(&parallel);
+
+  ASSERT_TRUE(HS_union_parallel(&parallel, &a, &b, 4));
+  ASSERT_EQ(parallel.count, 40000ULL);
+  HS_deinit(&parallel);
+
+  ASSERT_TRUE(HS_difference_parallel(&parallel, &b, &a, 3));
+  ASSERT_EQ(parallel.count, 20000ULL);
+  HS_deinit(&parallel);
+
+  HS_deinit(&a);
+  HS_deinit(&b);
+}
+
+UTEST(HM_Basic, reserve){
+  HM hm = {0};
+  ASSERT_TRUE(HM_int_init(&hm, 2));
+  ASSERT_TRUE(HM_reserve(&hm, 100));
+  size_t capacity = hm.capacity;
+  for(int i = 0; i < 100; ++i){
+    ASSERT_TRUE(HM_int_kwl_set(&hm, &i, sizeof(i), i));
+  }
+  ASSERT_EQ(hm.capacity, capacity);
+  HM_deinit(&hm);
+}
+
+#define RCU_KEYS 64
+#define RCU_VERSIONS 200
+
+typedef struct{
+  HM_RCU* rcu;
+  atomic_bool* done;
+  bool consistent;
+  size_t reads;
+} RCUReader;
+
+static void* rcu_reader(void* arg){
+  RCUReader* ctx = (RCUReader*)arg;
+  int reader = HM_rcu_register_reader(ctx->rcu);
+  ctx->consistent = reader >= 0;
+  while(ctx->consistent && !atomic_load(ctx->done)){
+    // every commit updates all keys, a single read section must observe one version only
+    HM* table = HM_rcu_read_lock(ctx->rcu, reader);
+    int version = *HM_int_kwl_get(table, &(int){0}, sizeof(int));
+    for(int k = 1; k < RCU_KEYS; ++k){
+      int* value = HM_int_kwl_get(table, &k, sizeof(k));
+      if(value == NULL || *value != version) ctx->consistent = false;
+    }
+    HM_rcu_read_unlock(ctx->rcu, reader);
+    ctx->reads++;
+  }
+  HM_rcu_unregister_reader(ctx->rcu, reader);
+  return NULL;
+}
+
+UTEST(HM_RCU, readers_see_consistent_snapshots){
+  HM_RCU rcu;
+  ASSERT_TRUE(HM_rcu_init(&rcu, sizeof(int), 0));
+  HM* table = HM_rcu_write_begin(&rcu);
+  for(int k = 0; k < RCU_KEYS; ++k){
+    HM_int_kwl_set(table, &k, sizeof(k), 0);
+  }
+  HM_rcu_write_commit(&rcu, table);
+
+  atomic_bool done;
+  atomic_init(&done, false);
+  pthread_t threads[4];
+  RCUReader readers[4];
+  for(int i = 0; i < 4; ++i){
+    readers[i] = (RCUReader){ .rcu = &rcu, .done = &done };
+    ASSERT_EQ(pthread_create(&threads[i], NULL, rcu_reader, &readers[i]), 0);
+  }
+
+  for(int version = 1; version <= RCU_VERSIONS; ++version){
+    table = HM_rcu_write_begin(&rcu);
+    ASSERT_NE(table, NULL);
+    for(int k = 0; k < RCU_KEYS; ++k){
+      HM_int_kwl_set(table, &k, sizeof(k), version);
+    }
+    HM_rcu_write_commit(&rcu, table);
+  }
+  atomic_store(&done, true);
+
+  for(int i = 0; i < 4; ++i){
+    pthread_join(threads[i], NULL);
+    ASSERT_TRUE(readers[i].consistent);
+  }
+
+  int reader = HM_rcu_register_reader(&rcu);
+  int value = 0;
+  ASSERT_TRUE(HM_rcu_kwl_get(&rcu, reader, &(int){5}, sizeof(int), &value));
+  ASSERT_EQ(value, RCU_VERSIONS);
+  ASSERT_TRUE(HM_rcu_kwl_remove(&rcu, &(int){5}, sizeof(int)));
+  ASSERT_FALSE(HM_rcu_kwl_get(&rcu, reader, &(int){5}, sizeof(int), &value));
+  HM_rcu_unregister_reader(&rcu, reader);
+  HM_rcu_deinit(&rcu);
+}
+
+#define SHARDED_THREADS 8
+#define SHARDED_KEYS_PER_THREAD 5000
+
+typedef struct{
+  HM_Sharded* map;
+  int thread;
+} ShardedWriter;
+
+static void combine_add_int(void* existing, const void* value){
+  *(int*)existing += *(const int*)value;
+}
+
+static void* sharded_writer(void* arg){
+  ShardedWriter* ctx = (ShardedWriter*)arg;
+  for(int i = 0; i < SHARDED_KEYS_PER_THREAD; ++i){
+    int key = ctx->thread * SHARDED_KEYS_PER_THREAD + i;
+    HM_sharded_kwl_set(ctx->map, &key, sizeof(key), &key);
+    int one = 1;
+    HM_sharded_kwl_merge(ctx->map, "shared", 6, &one, combine_add_int);
+  }
+  return NULL;
+}
+
+static void count_sharded(HM* self, HM_Iterator it, void* ctx){
+  (void)self;
+  (void)it;
+  (*(size_t*)ctx)++;
+}
+
+UTEST(HM_Sharded, concurrent_writers){
+  HM_Sharded map;
+  ASSERT_TRUE(HM_sharded_init(&map, sizeof(int), 64, 6));
+  ASSERT_EQ(map.shard_count, 8ULL);
+
+  pthread_t threads[SHARDED_THREADS];
+  ShardedWriter writers[SHARDED_THREADS];
+  for(int t = 0; t < SHARDED_THREADS; ++t){
+    writers[t] = (ShardedWriter){ .map = &map, .thread = t };
+    ASSERT_EQ(pthread_create(&threads[t], NULL, sharded_writer, &writers[t]), 0);
+  }
+  for(int t = 0; t < SHARDED_THREADS; ++t){
+    pthread_join(threads[t], NULL);
+  }
+
+  int value = 0;
+  for(int key = 0; key < SHARDED_THREADS * SHARDED_KEYS_PER_THREAD; ++key){
+    ASSERT_TRUE(HM_sharded_kwl_get(&map, &key, sizeof(key), &value));
+    ASSERT_EQ(value, key);
+  }
+  ASSERT_TRUE(HM_sharded_get(&map, "shared", &value));
+  ASSERT_EQ(value, SHARDED_THREADS * SHARDED_KEYS_PER_THREAD);
+
+  size_t count = 0;
+  HM_sharded_for_each(&map, count_sharded, &count);
+  ASSERT_EQ(count, (size_t)SHARDED_THREADS * SHARDED_KEYS_PER_THREAD + 1);
+
+  HM_sharded_remove(&map, "shared");
+  ASSERT_FALSE(HM_sharded_get(&map, "shared", &value));
+  HM_sharded_deinit(&map);
+}
+
+#define LF_THREADS 4
+#define LF_KEYS_PER_THREAD 2000
+#define LF_ROUNDS 5
+#define LF_COUNTERS 8
+#define LF_MONOTONIC_KEY ((uint64_t)1 << 40)
+
+typedef struct{
+  HM_LockFree* map;
+  uint64_t thread;
+  bool ok;
+} LFWorker;
+
+// every thread owns a key range so it must always read back its own latest write, while the 
+// shared counters check that no increment is lost while tables are being migrated
+static void* lf_worker(void* arg){
+  LFWorker* ctx = (LFWorker*)arg;
+  ctx->ok = true;
+  uint64_t base = 1 + ctx->thread * LF_KEYS_PER_THREAD;
+  for(uint64_t round = 0; round < LF_ROUNDS; ++round){
+    for(uint64_t i = 0; i < LF_KEYS_PER_THREAD; ++i){
+      uint64_t key = base + i;
+      uint64_t value = 0;
+      if(!HM_lf_set(ctx->map, key, key * 10 + round)) ctx->ok = false;
+      if(!HM_lf_get(ctx->map, key, &value) || value != key * 10 + round) ctx->ok = false;
+      if(i % 3 == 0){
+        HM_lf_remove(ctx->map, key);
+        if(HM_lf_get(ctx->map, key, &value)) ctx->ok = false;
+      }
+      HM_lf_add(ctx->map, LF_MONOTONIC_KEY + i % LF_COUNTERS, 1, NULL);
+    }
+  }
+  return NULL;
+}
+
+typedef struct{
+  HM_LockFree* map;
+  atomic_bool* done;
+  bool ok;
+} LFObserver;
+
+// values of the counters only ever increase, observing a decrease means a stale read
+static void* lf_observer(void* arg){
+  LFObserver* ctx = (LFObserver*)arg;
+  uint64_t last[LF_COUNTERS] = {0};
+  ctx->ok = true;
+  while(!atomic_load(ctx->done)){
+    for(uint64_t c = 0; c < LF_COUNTERS; ++c){
+      uint64_t value = 0;
+      if(HM_lf_get(ctx->map, LF_MONOTONIC_KEY + c, &value)){
+        if(value < last[c]) ctx->ok = false;
+        last[c] = value;
+      }else if(last[c] != 0){
+        ctx->ok = false;
+      }
+    }
+  }
+  return NULL;
+}
+
+UTEST(HM_LockFree, linearizability_stress){
+  HM_LockFree map;
+  ASSERT_TRUE(HM_lf_init(&map, 16));
+
+  atomic_bool done;
+  atomic_init(&done, false);
+  LFObserver observer = { .map = &map, .done = &done };
+  pthread_t observer_thread;
+  ASSERT_EQ(pthread_create(&observer_thread, NULL, lf_observer, &observer), 0);
+
+  pthread_t threads[LF_THREADS];
+  LFWorker workers[LF_THREADS];
+  for(uint64_t t = 0; t < LF_THREADS; ++t){
+    workers[t] = (LFWorker){ .map = &map, .thread = t };
+    ASSERT_EQ(pthread_create(&threads[t], NULL, lf_worker, &workers[t]), 0);
+  }
+  for(int t = 0; t < LF_THREADS; ++t){
+    pthread_join(threads[t], NULL);
+    ASSERT_TRUE(workers[t].ok);
+  }
+  atomic_store(&done, true);
+  pthread_join(observer_thread, NULL);
+  ASSERT_TRUE(observer.ok);
+
+  uint64_t total = 0;
+  for(uint64_t c = 0; c < LF_COUNTERS; ++c){
+    uint64_t value = 0;
+    ASSERT_TRUE(HM_lf_get(&map, LF_MONOTONIC_KEY + c, &value));
+    total += value;
+  }
+  ASSERT_EQ(total, (uint64_t)LF_THREADS * LF_KEYS_PER_THREAD * LF_ROUNDS);
+
+  size_t live = 0;
+  for(uint64_t key = 1; key <= LF_THREADS * LF_KEYS_PER_THREAD; ++key){
+    uint64_t value = 0;
+    bool removed = (key - 1) % LF_KEYS_PER_THREAD % 3 == 0;
+    ASSERT_EQ(HM_lf_get(&map, key, &value), !removed);
+    if(!removed){
+      ASSERT_EQ(value, key * 10 + LF_ROUNDS - 1);
+      live++;
+    }
+  }
+  ASSERT_EQ(HM_lf_count(&map), live + LF_COUNTERS);
+  HM_lf_deinit(&map);
+}
+
+#define LF_CHURN_OPS 2000000
+#define LF_CHURN_WINDOW 100
+
+static void* lf_churner(void* arg){
+  LFWorker* ctx = (LFWorker*)arg;
+  uint64_t base = (ctx->thread + 1) << 32;
+  for(uint64_t i = 0; i < LF_CHURN_OPS / LF_THREADS; ++i){
+    ctx->ok &= HM_lf_set(ctx->map, base + i, i);
+    if(i >= LF_CHURN_WINDOW) HM_lf_remove(ctx->map, base + i - LF_CHURN_WINDOW);
+  }
+  return NULL;
+}
+
+// every resize retires a table, reclamation has to keep up with insert/remove churn
+UTEST(HM_LockFree, churn_reclaims_tables){
+  HM_LockFree map;
+  ASSERT_TRUE(HM_lf_init(&map, 16));
+  size_t max_tables = 0;
+  for(uint64_t i = 1; i <= LF_CHURN_OPS; ++i){
+    ASSERT_TRUE(HM_lf_set(&map, i, i));
+    if(i > LF_CHURN_WINDOW) HM_lf_remove(&map, i - LF_CHURN_WINDOW);
+    size_t tables = atomic_load(&map.table_count);
+    if(tables > max_tables) max_tables = tables;
+  }
+  ASSERT_EQ(HM_lf_count(&map), (size_t)LF_CHURN_WINDOW);
+  ASSERT_LE(max_tables, (size_t)4);
+
+  pthread_t threads[LF_THREADS];
+  LFWorker workers[LF_THREADS];
+  for(uint64_t t = 0; t < LF_THREADS; ++t){
+    workers[t] = (LFWorker){ .map = &map, .thread = t, .ok = true };
+    ASSERT_EQ(pthread_create(&threads[t], NULL, lf_churner, &workers[t]), 0);
+  }
+  for(int t = 0; t < LF_THREADS; ++t){
+    pthread_join(threads[t], NULL);
+    ASSERT_TRUE(workers[t].ok);
+  }
+  ASSERT_LE(atomic_load(&map.table_count), (size_t)4);
+  HM_lf_deinit(&map);
+}
+
+#define BUILD_KEYS 5000
+
+// duplicates every 7th key so the parallel build has to keep the first position and last value
+UTEST(HM_Build, parallel_matches_serial){
+  static int keys[BUILD_KEYS];
+  static const void* key_ptrs[BUILD_KEYS];
+  static size_t key_lens[BUILD_KEYS];
+  static int values[BUILD_KEYS];
+  for(int i = 0; i < BUILD_KEYS; ++i){
+    keys[i] = i % 7 == 6 ? i / 2 : i;
+    key_ptrs[i] = &keys[i];
+    key_lens[i] = sizeof(int);
+    values[i] = i;
+  }
+
+  HM serial;
+  ASSERT_TRUE(HM_init(&serial, sizeof(int), 0));
+  for(int i = 0; i < BUILD_KEYS; ++i){
+    ASSERT_TRUE(HM_kwl_set(&serial, key_ptrs[i], key_lens[i], &values[i]));
+  }
+
+  for(size_t threads = 1; threads <= 8; threads *= 2){
+    HM parallel;
+    ASSERT_TRUE(HM_build_parallel(&parallel, sizeof(int), key_ptrs, key_lens, values, BUILD_KEYS, threads));
+    ASSERT_EQ(parallel.count, serial.count);
+    HM_Iterator a = HM_iterate(&serial, NULL);
+    HM_Iterator b = HM_iterate(&parallel, NULL);
+    for(; a != NULL && b != NULL; a = HM_iterate(&serial, a), b = HM_iterate(&parallel, b)){
+      ASSERT_EQ(*(const int*)HM_key_at(&serial, a), *(const int*)HM_key_at(&parallel, b));
+      ASSERT_EQ(*(int*)HM_value_at(&serial, a), *(int*)HM_value_at(&parallel, b));
+    }
+    ASSERT_TRUE(a == NULL && b == NULL);
+    HM_deinit(&parallel);
+  }
+  HM_deinit(&serial);
+
+  const char* words[] = {"apple", "banana", "apple", "cherry"};
+  int counts[] = {1, 2, 3, 4};
+  HM strings;
+  ASSERT_TRUE(HM_build_parallel(&strings, sizeof(int), (const void* const*)words, NULL, counts, 4, 3));
+  ASSERT_EQ(strings.count, 3ULL);
+  ASSERT_EQ(*(int*)HM_get(&strings, "apple"), 3);
+  ASSERT_EQ(*(const char*)HM_key_at(&strings, HM_iterate(&strings, NULL)), 'a');
+  HM_deinit(&strings);
+}
+
+UTEST(HM_Build, parallel_grow){
+  HM map;
+  ASSERT_TRUE(HM_init(&map, sizeof(int), 0));
+  HM_set_grow_threads(&map, 4);
+
+  // removals leave tombstones behind so some of the rehashes keep the capacity
+  const int total = 3 * HM_PARALLEL_GROW_MIN;
+  for(int i = 0; i < total; ++i){
+    ASSERT_TRUE(HM_kwl_set(&map, &i, sizeof(i), &i));
+    if(i % 5 == 4){
+      int removed = i - 2;
+      HM_kwl_remove(&map, &removed, sizeof(removed));
+    }
+  }
+  ASSERT_TRUE(HM_reserve(&map, 8 * HM_PARALLEL_GROW_MIN));
+  ASSERT_EQ(map.grow_threads, 4ULL);
+
+  int expected = 0;
+  size_t count = 0;
+  for(HM_Iterator it = HM_iterate(&map, NULL); it != NULL; it = HM_iterate(&map, it)){
+    if(expected % 5 == 2 && expected + 2 < total) expected++;
+    ASSERT_EQ(*(const int*)HM_key_at(&map, it), expected);
+    ASSERT_EQ(*(int*)HM_value_at(&map, it), expected);
+    expected++;
+    count++;
+  }
+  ASSERT_EQ(count, map.count);
+  for(int i = 0; i < total; ++i){
+    int* value = (int*)HM_kwl_get(&map, &i, sizeof(i));
+    if(i % 5 == 2 && i + 2 < total){
+      ASSERT_TRUE(value == NULL);
+    }else{
+      ASSERT_TRUE(value != NULL);
+      ASSERT_EQ(*value, i);
+    }
+  }
+  HM_deinit(&map);
+}
+
+typedef struct{
+  long long sum;
+  size_t count;
+} RangeSum;
+
+static void sum_range(HM* self, HM_Iterator it, void* ctx){
+  RangeSum* sum = (RangeSum*)ctx;
+  sum->sum += *(int*)HM_value_at(self, it);
+  sum->count++;
+}
+
+UTEST(HM_Iteration, ranges){
+  HM map;
+  ASSERT_TRUE(HM_init(&map, sizeof(int), 0));
+  long long expected = 0;
+  for(int i = 0; i < 1000; ++i){
+    ASSERT_TRUE(HM_kwl_set(&map, &i, sizeof(i), &i));
+    expected += i;
+  }
+  for(int i = 0; i < 1000; i += 3){
+    HM_kwl_remove(&map, &i, sizeof(i));
+    expected -= i;
+  }
+
+  // the ranges have to cover every element exactly once
+  RangeSum total = {0};
+  for(size_t part = 0; part < 3; ++part){
+    for(HM_Iterator it = HM_iter_range(&map, NULL, part, 3); it != NULL; it = HM_iter_range(&map, it, part, 3)){
+      int key = *(const int*)HM_key_at(&map, it);
+      ASSERT_EQ(*(int*)HM_value_at(&map, it), key);
+      sum_range(&map, it, &total);
+    }
+  }
+  ASSERT_EQ(total.count, map.count);
+  ASSERT_EQ(total.sum, expected);
+
+  RangeSum sums[4] = {0};
+  HM_parallel_for_each(&map, sum_range, sums, sizeof(RangeSum), 4);
+  total = (RangeSum){0};
+  for(int t = 0; t < 4; ++t){
+    total.sum += sums[t].sum;
+    total.count += sums[t].count;
+  }
+  ASSERT_EQ(total.count, map.count);
+  ASSERT_EQ(total.sum, expected);
+  HM_deinit(&map);
+}
+
+#define COMBINER_THREADS 4
+#define COMBINER_EVENTS 20000
+#define COMBINER_HOT_KEYS 8
+
+static void* combiner_writer(void* arg){
+  HM_Combiner* combiner = (HM_Combiner*)arg;
+  for(int i = 0; i < COMBINER_EVENTS; ++i){
+    int key = i % COMBINER_HOT_KEYS;
+    int one = 1;
+    HM_combiner_sk_merge(combiner, key, &one);
+    // a cold key per event forces threshold flushes in between
+    int cold = COMBINER_HOT_KEYS + i;
+    HM_combiner_sk_merge(combiner, cold, &one);
+  }
+  HM_combiner_flush(combiner);
+  return NULL;
+}
+
+UTEST(HM_Combiner, exact_after_flush){
+  HM_Sharded map;
+  ASSERT_TRUE(HM_sharded_init(&map, sizeof(int), 0, 16));
+
+  HM_Combiner local;
+  ASSERT_TRUE(HM_combiner_init(&local, &map, combine_add_int, 0));
+  int two = 2;
+  ASSERT_TRUE(HM_combiner_merge(&local, "requests", &two));
+  ASSERT_TRUE(HM_combiner_merge(&local, "requests", &two));
+  int value = 0;
+  ASSERT_FALSE(HM_sharded_get(&map, "requests", &value));
+  ASSERT_TRUE(HM_combiner_flush(&local));
+  ASSERT_EQ(local.local.count, 0ULL);
+  ASSERT_TRUE(HM_sharded_get(&map, "requests", &value));
+  ASSERT_EQ(value, 4);
+  HM_combiner_deinit(&local);
+
+  pthread_t threads[COMBINER_THREADS];
+  HM_Combiner combiners[COMBINER_THREADS];
+  for(int t = 0; t < COMBINER_THREADS; ++t){
+    ASSERT_TRUE(HM_combiner_init(&combiners[t], &map, combine_add_int, 100));
+    ASSERT_EQ(pthread_create(&threads[t], NULL, combiner_writer, &combiners[t]), 0);
+  }
+  for(int t = 0; t < COMBINER_THREADS; ++t){
+    pthread_join(threads[t], NULL);
+    HM_combiner_deinit(&combiners[t]);
+  }
+
+  for(int key = 0; key < COMBINER_HOT_KEYS; ++key){
+    ASSERT_TRUE(HM_sharded_kwl_get(&map, &key, sizeof(key), &value));
+    ASSERT_EQ(value, COMBINER_THREADS * COMBINER_EVENTS / COMBINER_HOT_KEYS);
+  }
+  for(int key = COMBINER_HOT_KEYS; key < COMBINER_HOT_KEYS + COMBINER_EVENTS; ++key){
+    ASSERT_TRUE(HM_sharded_kwl_get(&map, &key, sizeof(key), &value));
+    ASSERT_EQ(value, COMBINER_THREADS);
+  }
+  HM_sharded_deinit(&map);
+}
+
+UTEST(HM_Numa, sharded_and_replicated){
+  HM_Sharded sharded;
+  ASSERT_TRUE(HM_sharded_init_numa(&sharded, sizeof(int), 1024, 8));
+  for(int i = 0; i < 1000; ++i){
+    ASSERT_TRUE(HM_sharded_kwl_set(&sharded, &i, sizeof(i), &i));
+  }
+  int value = 0;
+  ASSERT_TRUE(HM_sharded_kwl_get(&sharded, &(int){999}, sizeof(int), &value));
+  ASSERT_EQ(value, 999);
+  HM_sharded_deinit(&sharded);
+
+  HM source;
+  ASSERT_TRUE(HM_init(&source, sizeof(int), 0));
+  for(int i = 0; i < 1000; ++i){
+    ASSERT_TRUE(HM_kwl_set(&source, &i, sizeof(i), &i));
+  }
+  HM_Replicated replicated;
+  ASSERT_TRUE(HM_replicated_init(&replicated, &source));
+  HM_deinit(&source);
+
+  ASSERT_TRUE(replicated.node_count >= 1);
+  for(size_t node = 0; node < replicated.node_count; ++node){
+    ASSERT_EQ(replicated.replicas[node].count, 1000ULL);
+  }
+  HM* local = HM_replicated_local(&replicated);
+  ASSERT_TRUE(local >= replicated.replicas && local < replicated.replicas + replicated.node_count);
+  for(int i = 0; i < 1000; ++i){
+    int* found = (int*)HM_replicated_sk_get(&replicated, i);
+    ASSERT_TRUE(found != NULL);
+    ASSERT_EQ(*found, i);
+  }
+  ASSERT_TRUE(HM_replicated_get(&replicated, "missing") == NULL);
+  HM_replicated_deinit(&replicated);
+}
+
+#define DOUBLE_BUFFER_KEYS 256
+#define DOUBLE_BUFFER_GENERATIONS 50
+
+typedef struct{
+  HM_DoubleBuffer* buffer;
+  atomic_bool* done;
+  bool ok;
+  size_t batches;
+} DoubleBufferReader;
+
+// every published table holds all keys with the value of a single generation
+static void* double_buffer_reader(void* arg){
+  DoubleBufferReader* ctx = (DoubleBufferReader*)arg;
+  int reader = HM_rcu_register_reader(ctx->buffer);
+  ctx->ok = reader >= 0;
+  while(ctx->ok && !atomic_load(ctx->done)){
+    HM* table = HM_rcu_read_lock(ctx->buffer, reader);
+    int* first = (int*)HM_sk_get(table, (int){0});
+    int generation = first != NULL ? *first : 0;
+    if(table->count != 0 && table->count != DOUBLE_BUFFER_KEYS) ctx->ok = false;
+    for(int key = 0; key < DOUBLE_BUFFER_KEYS && table->count > 0; ++key){
+      int* value = (int*)HM_sk_get(table, key);
+      if(value == NULL || *value != generation) ctx->ok = false;
+    }
+    HM_rcu_read_unlock(ctx->buffer, reader);
+    ctx->batches++;
+  }
+  HM_rcu_unregister_reader(ctx->buffer, reader);
+  return NULL;
+}
+
+UTEST(HM_DoubleBuffer, publish){
+  HM_DoubleBuffer buffer;
+  ASSERT_TRUE(HM_rcu_init(&buffer, sizeof(int), 0));
+
+  atomic_bool done;
+  atomic_init(&done, false);
+  pthread_t threads[2];
+  DoubleBufferReader readers[2];
+  for(int t = 0; t < 2; ++t){
+    readers[t] = (DoubleBufferReader){ .buffer = &buffer, .done = &done };
+    ASSERT_EQ(pthread_create(&threads[t], NULL, double_buffer_reader, &readers[t]), 0);
+  }
+
+  for(int generation = 1; generation <= DOUBLE_BUFFER_GENERATIONS; ++generation){
+    HM fresh;
+    ASSERT_TRUE(HM_init(&fresh, sizeof(int), 0));
+    for(int key = 0; key < DOUBLE_BUFFER_KEYS; ++key){
+      ASSERT_TRUE(HM_sk_set(&fresh, key, &generation));
+    }
+    ASSERT_TRUE(HM_double_buffer_publish(&buffer, &fresh));
+    ASSERT_TRUE(fresh.entries == NULL);
+  }
+  atomic_store(&done, true);
+  for(int t = 0; t < 2; ++t){
+    pthread_join(threads[t], NULL);
+    ASSERT_TRUE(readers[t].ok);
+  }
+
+  int reader = HM_rcu_register_reader(&buffer);
+  int value = 0;
+  ASSERT_TRUE(HM_rcu_kwl_get(&buffer, reader, &(int){7}, sizeof(int), &value));
+  ASSERT_EQ(value, DOUBLE_BUFFER_GENERATIONS);
+  HM_rcu_deinit(&buffer);
+}
+
+UTEST(HM_Async, matches_serial_map){
+  HM_Async async;
+  ASSERT_TRUE(HM_async_init(&async, sizeof(int), 64));
+  HM serial;
+  ASSERT_TRUE(HM_init(&serial, sizeof(int), 64));
+
+  // every operation is mirrored on a regular HM, reads are checked throughout all resizes
+  for(int i = 0; i < 20000; ++i){
+    int key = (i * 7) % 5000;
+    if(i % 3 == 2){
+      ASSERT_TRUE(HM_async_kwl_remove(&async, &key, sizeof(key)));
+      HM_kwl_remove(&serial, &key, sizeof(key));
+    }else{
+      ASSERT_TRUE(HM_async_kwl_set(&async, &key, sizeof(key), &i));
+      ASSERT_TRUE(HM_kwl_set(&serial, &key, sizeof(key), &i));
+    }
+    ASSERT_EQ(async.count, serial.count);
+    int probe = (i * 13) % 5000;
+    int value = 0;
+    int* expected = (int*)HM_kwl_get(&serial, &probe, sizeof(probe));
+    ASSERT_EQ(HM_async_kwl_get(&async, &probe, sizeof(probe), &value), expected != NULL);
+    if(expected != NULL) ASSERT_EQ(value, *expected);
+  }
+
+  ASSERT_TRUE(HM_async_finish(&async));
+  ASSERT_FALSE(async.resizing);
+  ASSERT_EQ(async.table.count, serial.count);
+  HM_Iterator a = HM_iterate(&serial, NULL);
+  HM_Iterator b = HM_iterate(&async.table, NULL);
+  for(; a != NULL && b != NULL; a = HM_iterate(&serial, a), b = HM_iterate(&async.table, b)){
+    ASSERT_EQ(*(const int*)HM_key_at(&serial, a), *(const int*)HM_key_at(&async.table, b));
+    ASSERT_EQ(*(int*)HM_value_at(&serial, a), *(int*)HM_value_at(&async.table, b));
+  }
+  ASSERT_TRUE(a == NULL && b == NULL);
+
+  ASSERT_TRUE(HM_async_set(&async, "name", &(int){1}));
+  HM_async_deinit(&async);
+  HM_deinit(&serial);
+}
+
+static size_t other_hash(const char* key, size_t key_len){
+  size_t hash = 7;
+  for(size_t i = 0; i < key_len; ++i) hash = hash * 31 + (unsigned char)key[i];
+  return hash;
+}
+
+UTEST(HM_Snapshot, save_load){
+  HM map;
+  ASSERT_TRUE(HM_init(&map, sizeof(Record), 0));
+  for(int i = 0; i < 3000; ++i){
+    char key[32];
+    snprintf(key, sizeof(key), "key-%d", i);
+    Record record = { .id = i };
+    snprintf(record.payload, sizeof(record.payload), "payload-%d", i);
+    ASSERT_TRUE(HM_set(&map, key, &record));
+    if(i % 4 == 0) HM_remove(&map, key);
+  }
+
+  FILE* file = tmpfile();
+  ASSERT_TRUE(file != NULL);
+  ASSERT_TRUE(HM_save(&map, file));
+  long size = ftell(file);
+
+  rewind(file);
+  HM loaded;
+  ASSERT_TRUE(HM_load(&loaded, file, NULL));
+  ASSERT_EQ(loaded.count, map.count);
+  ASSERT_EQ(loaded.capacity, map.capacity);
+  HM_Iterator a = HM_iterate(&map, NULL);
+  HM_Iterator b = HM_iterate(&loaded, NULL);
+  for(; a != NULL && b != NULL; a = HM_iterate(&map, a), b = HM_iterate(&loaded, b)){
+    ASSERT_EQ(*HM_key_len_at(&map, a), *HM_key_len_at(&loaded, b));
+    ASSERT_EQ(memcmp(HM_key_at(&map, a), HM_key_at(&loaded, b), *HM_key_len_at(&map, a)), 0);
+    ASSERT_EQ(memcmp(HM_value_at(&map, a), HM_value_at(&loaded, b), sizeof(Record)), 0);
+  }
+  ASSERT_TRUE(a == NULL && b == NULL);
+  ASSERT_TRUE(HM_get(&loaded, "key-4") == NULL);
+  ASSERT_EQ(((Record*)HM_get(&loaded, "key-2999"))->id, 2999);
+
+  // loaded keys live in one block, removing them and growing past them has to work as usual
+  HM_remove(&loaded, "key-1");
+  for(int i = 3000; i < 6000; ++i){
+    char key[32];
+    snprintf(key, sizeof(key), "key-%d", i);
+    ASSERT_TRUE(HM_set(&loaded, key, &(Record){ .id = i }));
+  }
+  ASSERT_TRUE(HM_get(&loaded, "key-1") == NULL);
+  ASSERT_EQ(((Record*)HM_get(&loaded, "key-2"))->id, 2);
+  HM_deinit(&loaded);
+
+  rewind(file);
+  ASSERT_FALSE(HM_load(&loaded, file, other_hash));
+
+  // flip a byte in the key bytes, the checksum has to catch it
+  fseek(file, size - 20, SEEK_SET);
+  int c = fgetc(file);
+  fseek(file, size - 20, SEEK_SET);
+  fputc(c ^ 0x40, file);
+  rewind(file);
+  ASSERT_FALSE(HM_load(&loaded, file, NULL));
+  fclose(file);
+
+  // a zero-length key sits at the end of the loaded key block and must not be freed on its own
+  HM empty;
+  ASSERT_TRUE(HM_init(&empty, sizeof(Record), 0));
+  ASSERT_TRUE(HM_kwl_set(&empty, "", 0, &(Record){ .id = 1 }));
+  file = tmpfile();
+  ASSERT_TRUE(file != NULL);
+  ASSERT_TRUE(HM_save(&empty, file));
+  rewind(file);
+  ASSERT_TRUE(HM_load(&loaded, file, NULL));
+  ASSERT_EQ(((Record*)HM_kwl_get(&loaded, "", 0))->id, 1);
+  HM_deinit(&loaded);
+  rewind(file);
+  ASSERT_TRUE(HM_load(&loaded, file, NULL));
+  HM_kwl_remove(&loaded, "", 0);
+  HM_deinit(&loaded);
+  HM_deinit(&empty);
+  fclose(file);
+  HM_deinit(&map);
+}
+
+UTEST(HM_Frozen, write_open){
+  HM map;
+  ASSERT_TRUE(HM_init(&map, sizeof(int), 0));
+  for(int i = 0; i < 2000; ++i){
+    char key[32];
+    snprintf(key, sizeof(key), "word-%d", i);
+    ASSERT_TRUE(HM_set(&map, key, &i));
+  }
+  HM_remove(&map, "word-7");
+
+  char path[] = "/tmp/hm_frozen_XXXXXX";
+  int fd = mkstemp(path);
+  ASSERT_TRUE(fd >= 0);
+  FILE* file = fdopen(fd, "wb");
+  ASSERT_TRUE(HM_frozen_write(&map, file));
+  fclose(file);
+
+  HM_Frozen frozen;
+  ASSERT_FALSE(HM_frozen_open(&frozen, path, other_hash));
+  ASSERT_TRUE(HM_frozen_open(&frozen, path, NULL));
+  ASSERT_EQ(frozen.count, map.count);
+  for(int i = 0; i < 2000; ++i){
+    char key[32];
+    snprintf(key, sizeof(key), "word-%d", i);
+    const int* value = (const int*)HM_frozen_get(&frozen, key);
+    if(i == 7){
+      ASSERT_TRUE(value == NULL);
+    }else{
+      ASSERT_TRUE(value != NULL);
+      ASSERT_EQ(*value, i);
+    }
+  }
+  ASSERT_TRUE(HM_frozen_get(&frozen, "word-2000") == NULL);
+  ASSERT_TRUE(HM_frozen_get(&frozen, "") == NULL);
+
+  // a truncated file must be rejected instead of read out of bounds
+  HM_Frozen truncated;
+  ASSERT_FALSE(HM_frozen_from_memory(&truncated, frozen.data, frozen.size - 64, NULL));
+  HM_frozen_close(&frozen);
+  unlink(path);
+  HM_deinit(&map);
+}
+
+static size_t constant_hash(const char* key, size_t key_len){
+  (void)key;
+  (void)key_len;
+  return 42;
+}
+
+UTEST(HM_Perfect, build_lookup){
+  HM map;
+  ASSERT_TRUE(HM_init(&map, sizeof(int), 0));
+  for(int i = 0; i < 5000; ++i){
+    char key[32];
+    snprintf(key, sizeof(key), "word-%d", i);
+    ASSERT_TRUE(HM_set(&map, key, &i));
+  }
+  HM_remove(&map, "word-7");
+
+  HM_Perfect perfect;
+  ASSERT_TRUE(HM_perfect_build(&perfect, &map));
+  ASSERT_EQ(perfect.count, map.count);
+  for(int i = 0; i < 5000; ++i){
+    char key[32];
+    snprintf(key, sizeof(key), "word-%d", i);
+    const int* value = (const int*)HM_perfect_get(&perfect, key);
+    if(i == 7){
+      ASSERT_TRUE(value == NULL);
+    }else{
+      ASSERT_TRUE(value != NULL);
+      ASSERT_EQ(*value, i);
+    }
+  }
+  ASSERT_TRUE(HM_perfect_get(&perfect, "word-5000") == NULL);
+  HM_perfect_deinit(&perfect);
+
+  // every key hashing to the same value can never be separated
+  HM same;
+  ASSERT_TRUE(HM_init(&same, sizeof(int), 0));
+  same.hash_func = constant_hash;
+  int one = 1;
+  ASSERT_TRUE(HM_set(&same, "a", &one));
+  ASSERT_TRUE(HM_set(&same, "b", &one));
+  ASSERT_FALSE(HM_perfect_build(&perfect, &same));
+  HM_deinit(&same);
+
+  HM empty;
+  ASSERT_TRUE(HM_init(&empty, sizeof(int), 0));
+  ASSERT_TRUE(HM_perfect_build(&perfect, &empty));
+  ASSERT_TRUE(HM_perfect_get(&perfect, "word-1") == NULL);
+  HM_perfect_deinit(&perfect);
+  HM_deinit(&empty);
+  HM_deinit(&map);
+}
+
+// generated from tests/keywords.tsv by the hm_gen tool, see the test target of the Makefile
+extern const HM_Perfect test_keywords;
+
+UTEST(HM_Perfect, generated_table){
+  const char* keywords[] = {"if", "else", "while", "for", "return", "switch", "case", "default", "break", "continue"};
+  ASSERT_EQ(test_keywords.count, 10u);
+  for(int i = 0; i < 10; ++i){
+    const int* token = (const int*)HM_perfect_get(&test_keywords, keywords[i]);
+    ASSERT_TRUE(token != NULL);
+    ASSERT_EQ(*token, i + 1);
+  }
+  ASSERT_TRUE(HM_perfect_get(&test_keywords, "goto") == NULL);
+  ASSERT_TRUE(HM_perfect_get(&test_keywords, "") == NULL);
+}
+
+UTEST(HM_Persistent, grow_and_reopen){
+  char path[] = "/tmp/hm_persistent_XXXXXX";
+  int fd = mkstemp(path);
+  ASSERT_TRUE(fd >= 0);
+  close(fd);
+  unlink(path);
+  char key_path[64];
+  snprintf(key_path, sizeof(key_path), "%s.keys", path);
+
+  HM_Persistent map;
+  ASSERT_TRUE(HM_persistent_open(&map, path, sizeof(int), NULL));
+  for(int i = 0; i < 20000; ++i){
+    char key[32];
+    snprintf(key, sizeof(key), "url-%d", i);
+    ASSERT_TRUE(HM_persistent_set(&map, key, &i));
+    if(i % 3 == 0) HM_persistent_remove(&map, key);
+  }
+  int updated = -1;
+  ASSERT_TRUE(HM_persistent_set(&map, "url-1", &updated));
+  ASSERT_TRUE(HM_persistent_sync(&map));
+  HM_persistent_close(&map);
+
+  ASSERT_FALSE(HM_persistent_open(&map, path, sizeof(double), NULL));
+  ASSERT_FALSE(HM_persistent_open(&map, path, sizeof(int), other_hash));
+  ASSERT_TRUE(HM_persistent_open(&map, path, sizeof(int), NULL));
+  ASSERT_EQ(HM_persistent_count(&map), 20000u - 6667u);
+  for(int i = 0; i < 20000; ++i){
+    char key[32];
+    snprintf(key, sizeof(key), "url-%d", i);
+    const int* value = (const int*)HM_persistent_get(&map, key);
+    if(i % 3 == 0){
+      ASSERT_TRUE(value == NULL);
+    }else{
+      ASSERT_TRUE(value != NULL);
+      ASSERT_EQ(*value, i == 1 ? -1 : i);
+    }
+  }
+  HM_persistent_close(&map);
+  unlink(path);
+  unlink(key_path);
+}
+
+UTEST(HM_Journal, replay_and_compact){
+  char snapshot_path[] = "/tmp/hm_journal_XXXXXX";
+  int fd = mkstemp(snapshot_path);
+  ASSERT_TRUE(fd >= 0);
+  close(fd);
+  unlink(snapshot_path);
+  char log_path[64];
+  snprintf(log_path, sizeof(log_path), "%s.log", snapshot_path);
+
+  HM_Journal journal;
+  ASSERT_TRUE(HM_journal_open(&journal, snapshot_path, log_path, sizeof(int), NULL));
+  for(int i = 0; i < 1000; ++i){
+    char key[32];
+    snprintf(key, sizeof(key), "key-%d", i);
+    ASSERT_TRUE(HM_journal_set(&journal, key, &i));
+  }
+  ASSERT_TRUE(HM_journal_remove(&journal, "key-3"));
+  int one = 1;
+  ASSERT_TRUE(HM_journal_merge(&journal, "key-4", &one, combine_add_int) != NULL);
+  HM_journal_close(&journal);
+
+  // a record torn by a crash is dropped on replay
+  FILE* log = fopen(log_path, "ab");
+  ASSERT_TRUE(log != NULL);
+  fwrite("\x01\x05key", 1, 5, log);
+  fclose(log);
+
+  ASSERT_TRUE(HM_journal_open(&journal, snapshot_path, log_path, sizeof(int), NULL));
+  ASSERT_EQ(journal.map.count, 999u);
+  ASSERT_TRUE(HM_journal_get(&journal, "key-3") == NULL);
+  ASSERT_EQ(*(int*)HM_journal_get(&journal, "key-4"), 5);
+  ASSERT_EQ(*(int*)HM_journal_get(&journal, "key-999"), 999);
+  int last = -1;
+  ASSERT_TRUE(HM_journal_set(&journal, "key-0", &last));
+  ASSERT_TRUE(HM_journal_compact(&journal));
+  struct stat info;
+  ASSERT_EQ(stat(log_path, &info), 0);
+  ASSERT_EQ((size_t)info.st_size, sizeof(HM_JournalHeader));
+  ASSERT_TRUE(HM_journal_remove(&journal, "key-5"));
+  HM_journal_close(&journal);
+
+  ASSERT_FALSE(HM_journal_open(&journal, snapshot_path, log_path, sizeof(double), NULL));
+  ASSERT_TRUE(HM_journal_open(&journal, snapshot_path, log_path, sizeof(int), NULL));
+  ASSERT_EQ(journal.map.count, 998u);
+  ASSERT_EQ(*(int*)HM_journal_get(&journal, "key-0"), -1);
+  ASSERT_TRUE(HM_journal_get(&journal, "key-5") == NULL);
+  ASSERT_EQ(*(int*)HM_journal_get(&journal, "key-6"), 6);
+
+  // a merge that can't be logged must leave the map as it was
+  FILE* writable = journal.log;
+  journal.log = fopen(log_path, "rb");
+  ASSERT_TRUE(HM_journal_merge(&journal, "key-6", &one, combine_add_int) == NULL);
+  ASSERT_EQ(*(int*)HM_journal_get(&journal, "key-6"), 6);
+  fclose(journal.log);
+  journal.log = writable;
+  HM_journal_close(&journal);
+  unlink(snapshot_path);
+  unlink(log_path);
+}
+
+static bool parse_int(void* element, const char* text, size_t len){
+  int value = 0;
+  if(len == 0) return false;
+  for(size_t i = 0; i < len; ++i){
+    if(text[i] < '0' || text[i] > '9') return false;
+    value = value * 10 + (text[i] - '0');
+  }
+  *(int*)element = value;
+  return true;
+}
+
+UTEST(HM_Load, tsv_and_records){
+  // chunks of 4096 bytes make lines and records straddle chunk boundaries
+  FILE* tsv = tmpfile();
+  ASSERT_TRUE(tsv != NULL);
+  for(int i = 0; i < 20000; ++i){
+    fprintf(tsv, "key-%d\t%d%s", i, i, i % 7 == 0 ? "\r\n\n" : "\n");
+  }
+  char long_key[10000];
+  memset(long_key, 'k', sizeof(long_key));
+  fwrite(long_key, 1, sizeof(long_key), tsv);
+  fprintf(tsv, "\t42");
+  rewind(tsv);
+
+  HM map;
+  ASSERT_TRUE(HM_init(&map, sizeof(int), 0));
+  ASSERT_TRUE(HM_load_tsv(&map, tsv, parse_int));
+  ASSERT_EQ(map.count, 20001u);
+  for(int i = 0; i < 20000; ++i){
+    char key[32];
+    snprintf(key, sizeof(key), "key-%d", i);
+    int* value = (int*)HM_get(&map, key);
+    ASSERT_TRUE(value != NULL);
+    ASSERT_EQ(*value, i);
+  }
+  ASSERT_EQ(*(int*)HM_kwl_get(&map, long_key, sizeof(long_key)), 42);
+
+  fprintf(tsv, "\nbad-line\n");
+  rewind(tsv);
+  ASSERT_FALSE(HM_load_tsv(&map, tsv, parse_int));
+  fclose(tsv);
+
+  FILE* records = tmpfile();
+  ASSERT_TRUE(records != NULL);
+  for(int i = 0; i < 20000; ++i){
+    char key[32];
+    uint32_t key_len = (uint32_t)snprintf(key, sizeof(key), "record-%d", i);
+    int value = -i;
+    fwrite(&key_len, sizeof(key_len), 1, records);
+    fwrite(key, 1, key_len, records);
+    fwrite(&value, sizeof(value), 1, records);
+  }
+  rewind(records);
+  HM loaded;
+  ASSERT_TRUE(HM_init(&loaded, sizeof(int), 0));
+  ASSERT_TRUE(HM_load_records(&loaded, records));
+  ASSERT_EQ(loaded.count, 20000u);
+  ASSERT_EQ(*(int*)HM_get(&loaded, "record-12345"), -12345);
+
+  // a record cut short is an error
+  fwrite("\x05\0\0\0ab", 1, 6, records);
+  rewind(records);
+  ASSERT_FALSE(HM_load_records(&loaded, records));
+  fclose(records);
+  HM_deinit(&loaded);
+  HM_deinit(&map);
+}
+
+// removed keys leave tombstones behind, they must not make the table grow forever
+UTEST(HM_Cow, churn_keeps_capacity){
+  HM_Cow map;
+  ASSERT_TRUE(HM_cow_init(&map, sizeof(int), 0));
+  for(int i = 0; i < 100000; ++i){
+    ASSERT_TRUE(HM_cow_sk_set(&map, i, &i));
+    int old = i - 100;
+    if(old >= 0) ASSERT_TRUE(HM_cow_sk_remove(&map, old));
+  }
+  ASSERT_EQ(map.count, 100u);
+  ASSERT_EQ(map.capacity, (size_t)HM_DEFAULT_CAPACITY);
+  int last = 99999;
+  ASSERT_EQ(*(const int*)HM_cow_sk_get(&map, last), last);
+  HM_cow_deinit(&map);
+}
+
+UTEST(HM_Cow, fork_is_independent){
+  HM_Cow live;
+  ASSERT_TRUE(HM_cow_init(&live, sizeof(int), 0));
+  for(int i = 0; i < 1000; ++i){
+    char key[32];
+    snprintf(key, sizeof(key), "key-%d", i);
+    ASSERT_TRUE(HM_cow_set(&live, key, &i));
+  }
+
+  HM_Cow snapshot;
+  ASSERT_TRUE(HM_cow_fork(&live, &snapshot));
+  int changed = -1;
+  ASSERT_TRUE(HM_cow_set(&live, "key-1", &changed));
+  ASSERT_TRUE(HM_cow_remove(&live, "key-2"));
+  for(int i = 1000; i < 5000; ++i){
+    char key[32];
+    snprintf(key, sizeof(key), "key-%d", i);
+    ASSERT_TRUE(HM_cow_set(&live, key, &i));
+  }
+  ASSERT_TRUE(HM_cow_set(&snapshot, "only-in-snapshot", &changed));
+
+  ASSERT_EQ(live.count, 4999u);
+  ASSERT_EQ(*(const int*)HM_cow_get(&live, "key-1"), -1);
+  ASSERT_TRUE(HM_cow_get(&live, "key-2") == NULL);
+  ASSERT_TRUE(HM_cow_get(&live, "only-in-snapshot") == NULL);
+
+  ASSERT_EQ(snapshot.count, 1001u);
+  ASSERT_EQ(*(const int*)HM_cow_get(&snapshot, "key-1"), 1);
+  ASSERT_EQ(*(const int*)HM_cow_get(&snapshot, "key-2"), 2);
+  ASSERT_TRUE(HM_cow_get(&snapshot, "key-1000") == NULL);
+
+  // the original outlives its fork being released and the other way around
+  HM_cow_deinit(&live);
+  size_t position = 0;
+  size_t seen = 0;
+  long long sum = 0;
+  const char* key;
+  size_t key_len;
+  const void* value;
+  while(HM_cow_next(&snapshot, &position, &key, &key_len, &value)){
+    ASSERT_TRUE(key_len > 0);
+    sum += *(const int*)value;
+    seen++;
+  }
+  ASSERT_EQ(seen, 1001u);
+  ASSERT_EQ(sum, 999LL*1000/2 - 1);
+  HM_cow_deinit(&snapshot);
+}
+
+UTEST(HM, clone_and_clear){
+  HM map;
+  ASSERT_TRUE(HM_init(&map, sizeof(int), 0));
+  for(int i = 0; i < 1000; ++i){
+    char key[32];
+    snprintf(key, sizeof(key), "key-%d", i);
+    ASSERT_TRUE(HM_set(&map, key, &i));
+  }
+  HM_remove(&map, "key-10");
+
+  HM clone;
+  ASSERT_TRUE(HM_clone(&clone, &map));
+  ASSERT_EQ(clone.count, map.count);
+  ASSERT_EQ(clone.capacity, map.capacity);
+  HM_Iterator a = HM_iterate(&map, NULL);
+  HM_Iterator b = HM_iterate(&clone, NULL);
+  for(; a != NULL && b != NULL; a = HM_iterate(&map, a), b = HM_iterate(&clone, b)){
+    ASSERT_EQ(*HM_key_len_at(&map, a), *HM_key_len_at(&clone, b));
+    ASSERT_EQ(0, memcmp(HM_key_at(&map, a), HM_key_at(&clone, b), *HM_key_len_at(&map, a)));
+    ASSERT_EQ(*(int*)HM_value_at(&map, a), *(int*)HM_value_at(&clone, b));
+  }
+  ASSERT_TRUE(a == NULL && b == NULL);
+
+  // the clone is independent of the original and its keys can be removed and replaced
+  int changed = -1;
+  ASSERT_TRUE(HM_set(&clone, "key-1", &changed));
+  HM_remove(&clone, "key-2");
+  ASSERT_TRUE(HM_set(&clone, "new", &changed));
+  ASSERT_EQ(*(int*)HM_get(&map, "key-1"), 1);
+  ASSERT_EQ(*(int*)HM_get(&map, "key-2"), 2);
+  ASSERT_TRUE(HM_get(&map, "new") == NULL);
+  HM_deinit(&map);
+  ASSERT_EQ(*(int*)HM_get(&clone, "key-999"), 999);
+
+  size_t capacity = clone.capacity;
+  HM_clear(&clone);
+  ASSERT_EQ(clone.count, 0u);
+  ASSERT_EQ(clone.capacity, capacity);
+  ASSERT_TRUE(HM_iterate(&clone, NULL) == NULL);
+  ASSERT_TRUE(HM_get(&clone, "key-999") == NULL);
+  for(int i = 0; i < 10; ++i){
+    char key[32];
+    snprintf(key, sizeof(key), "again-%d", i);
+    ASSERT_TRUE(HM_set(&clone, key, &i));
+  }
+  ASSERT_EQ(clone.count, 10u);
+  ASSERT_EQ(*(int*)HM_get(&clone, "again-9"), 9);
+  HM_deinit(&clone);
+
+  // a zero-length key at the end of the key block still belongs to the block
+  HM small;
+  ASSERT_TRUE(HM_init(&small, sizeof(int), 0));
+  ASSERT_TRUE(HM_kwl_set(&small, "", 0, &changed));
+  ASSERT_TRUE(HM_clone(&clone, &small));
+  ASSERT_EQ(*(int*)HM_kwl_get(&clone, "", 0), -1);
+  HM_deinit(&clone);
+  ASSERT_TRUE(HM_set(&small, "a", &changed));
+  HM_kwl_remove(&small, "", 0);
+  ASSERT_TRUE(HM_kwl_set(&small, "", 0, &changed));
+  ASSERT_TRUE(HM_clone(&clone, &small));
+  HM_kwl_remove(&clone, "", 0);
+  ASSERT_TRUE(HM_kwl_get(&clone, "", 0) == NULL);
+  ASSERT_EQ(*(int*)HM_get(&clone, "a"), -1);
+  HM_deinit(&clone);
+  HM_deinit(&small);
+}
+
+UTEST(HM, merge_maps){
+  HM totals;
+  HM partial;
+  ASSERT_TRUE(HM_init(&totals, sizeof(int), 0));
+  ASSERT_TRUE(HM_init(&partial, sizeof(int), 0));
+  for(int i = 0; i < 3000; ++i){
+    char key[32];
+    snprintf(key, sizeof(key), "key-%d", i);
+    if(i < 2000) ASSERT_TRUE(HM_set(&totals, key, &i));
+    if(i >= 1000) ASSERT_TRUE(HM_set(&partial, key, &i));
+  }
+
+  ASSERT_TRUE(HM_merge_map(&totals, &partial, combine_add_int));
+  ASSERT_EQ(totals.count, 3000u);
+  ASSERT_EQ(partial.count, 2000u);
+  ASSERT_EQ(*(int*)HM_get(&totals, "key-10"), 10);
+  ASSERT_EQ(*(int*)HM_get(&totals, "key-1500"), 3000);
+  ASSERT_EQ(*(int*)HM_get(&totals, "key-2500"), 2500);
+  ASSERT_EQ(*(int*)HM_get(&partial, "key-1500"), 1500);
+
+  // moving also works for keys that live in the key block of a clone, including a zero-length 
+  // key at the very end of it
+  int empty = 5;
+  ASSERT_TRUE(HM_kwl_set(&partial, "", 0, &empty));
+  HM cloned;
+  ASSERT_TRUE(HM_clone(&cloned, &partial));
+  HM_kwl_remove(&partial, "", 0);
+  int extra = 7;
+  ASSERT_TRUE(HM_set(&partial, "only-moved", &extra));
+  ASSERT_TRUE(HM_merge_map_move(&totals, &partial, NULL));
+  ASSERT_EQ(partial.count, 0u);
+  ASSERT_TRUE(HM_iterate(&partial, NULL) == NULL);
+  ASSERT_EQ(totals.count, 3001u);
+  ASSERT_EQ(*(int*)HM_get(&totals, "key-1500"), 1500);
+  ASSERT_EQ(*(int*)HM_get(&totals, "only-moved"), 7);
+
+  ASSERT_TRUE(HM_merge_map_move(&totals, &cloned, combine_add_int));
+  ASSERT_EQ(cloned.count, 0u);
+  ASSERT_EQ(totals.count, 3002u);
+  ASSERT_EQ(*(int*)HM_get(&totals, "key-2999"), 2*2999);
+  ASSERT_EQ(*(int*)HM_kwl_get(&totals, "", 0), 5);
+  HM_deinit(&cloned);
+
+  // the emptied map is reusable
+  ASSERT_TRUE(HM_set(&partial, "key-0", &extra));
+  ASSERT_TRUE(HM_merge_map(&totals, &partial, combine_add_int));
+  ASSERT_EQ(*(int*)HM_get(&totals, "key-0"), 7);
+  HM_deinit(&partial);
+  HM_deinit(&totals);
+}
+
 UTEST(HM_Iteration, iterate){
   HM hm = {0};
   HM_int_init(&hm, 0);
@@ -0,0 +1,163 @@
+// hm_gen: turns a key/value list into a C file holding a pre-built HM_Perfect table
+//
+// usage: hm_gen_app <table name> <value type> [header to include] < input > table.c
+//
+// Every non-empty input line is a key, a tab and a C initializer for its value, for example
+// 'while\tTOKEN_WHILE'. The emitted table is const, needs no initialization and is queried with 
+// HM_perfect_get(&name, key) after declaring 'extern const HM_Perfect name;'.
+// The table is hashed with HM_HASH, so the program using it must be built with the same HM_HASH.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HM_IMPLEMENTATION
+#include "hm.h"
+
+typedef struct{
+  char** items;
+  size_t count;
+  size_t capacity;
+} Lines;
+
+static char* read_line(FILE* file){
+  size_t len = 0;
+  size_t capacity = 128;
+  char* line = (char*)malloc(capacity);
+  int c;
+  while(line != NULL && (c = fgetc(file)) != EOF && c != '\n'){
+    if(len + 1 == capacity){
+      capacity *= 2;
+      char* grown = (char*)realloc(line, capacity);
+      if(grown == NULL) free(line);
+      line = grown;
+    }
+    if(line != NULL) line[len++] = (char)c;
+  }
+  if(line == NULL) return NULL;
+  if(len == 0 && c == EOF){
+    free(line);
+    return NULL;
+  }
+  if(len > 0 && line[len - 1] == '\r') len--;
+  line[len] = '\0';
+  return line;
+}
+
+static void push(Lines* lines, char* item){
+  if(lines->count == lines->capacity){
+    lines->capacity = lines->capacity > 0 ? lines->capacity * 2 : 64;
+    lines->items = (char**)realloc(lines->items, lines->capacity * sizeof(char*));
+    if(lines->items == NULL){
+      fprintf(stderr, "hm_gen: out of memory\n");
+      exit(1);
+    }
+  }
+  lines->items[lines->count++] = item;
+}
+
+// keys are written byte for byte, everything but plain printable characters as octal escapes
+static void print_key(const char* key, size_t len){
+  putchar('"');
+  for(size_t i = 0; i < len; ++i){
+    unsigned char c = (unsigned char)key[i];
+    if(c >= 0x20 && c < 0x7f && c != '"' && c != '\\' && c != '?') putchar(c);
+    else printf("\\%03o", c);
+  }
+  putchar('"');
+}
+
+int main(int argc, char** argv){
+  if(argc < 3 || argc > 4){
+    fprintf(stderr, "usage: %s <table name> <value type> [header] < input > table.c\n", argv[0]);
+    return 1;
+  }
+  const char* name = argv[1];
+  const char* type = argv[2];
+
+  HM map;
+  if(!HM_init(&map, sizeof(size_t), 0)) return 1;
+  Lines values = {0};
+  char* line;
+  for(size_t number = 1; (line = read_line(stdin)) != NULL; ++number){
+    char* tab = strchr(line, '\t');
+    if(line[0] == '\0'){
+      free(line);
+      continue;
+    }
+    if(tab == NULL || tab[1] == '\0'){
+      fprintf(stderr, "hm_gen: line %zu: expected 'key<tab>value'\n", number);
+      return 1;
+    }
+    *tab = '\0';
+    if(HM_get(&map, line) != NULL){
+      fprintf(stderr, "hm_gen: line %zu: duplicate key '%s'\n", number, line);
+      return 1;
+    }
+    size_t index = values.count;
+    push(&values, line);
+    if(!HM_set(&map, line, &index)) return 1;
+  }
+
+  HM_Perfect perfect;
+  if(!HM_perfect_build(&perfect, &map)){
+    fprintf(stderr, "hm_gen: could not find a perfect hash for the keys\n");
+    return 1;
+  }
+
+  printf("// generated by hm_gen, do not edit\n");
+  printf("#include \"hm.h\"\n");
+  if(argc == 4) printf("#include \"%s\"\n", argv[3]);
+  printf("\n");
+  if(perfect.count > 0){
+    printf("static const HM_PerfectKey %s_keys[%zu] = {\n", name, perfect.count);
+    for(size_t i = 0; i < perfect.count; ++i){
+      printf("  {");
+      print_key(perfect.keys[i].key, perfect.keys[i].key_len);
+      printf(", %zu},\n", perfect.keys[i].key_len);
+    }
+    printf("};\n\n");
+
+    printf("static const %s %s_values[%zu] = {\n", type, name, perfect.count);
+    for(size_t i = 0; i < perfect.count; ++i){
+      const char* key = values.items[*(const size_t*)(perfect.values + i * perfect.element_size)];
+      printf("  %s,\n", key + strlen(key) + 1);
+    }
+    printf("};\n\n");
+
+    printf("static const uint32_t %s_displacements[%zu] = {\n", name, perfect.bucket_count);
+    for(size_t b = 0; b < perfect.bucket_count; ++b){
+      printf("%s%u,%s", b % 16 == 0 ? "  " : " ", (unsigned)perfect.displacements[b], 
+          b % 16 == 15 || b + 1 == perfect.bucket_count ? "\n" : "");
+    }
+    printf("};\n\n");
+
+    size_t remap_count = perfect.table_size - perfect.count;
+    printf("static const size_t %s_remap[%zu] = {\n", name, remap_count);
+    for(size_t i = 0; i < remap_count; ++i){
+      printf("%s%zu,%s", i % 16 == 0 ? "  " : " ", perfect.remap[i], 
+          i % 16 == 15 || i + 1 == remap_count ? "\n" : "");
+    }
+    printf("};\n\n");
+  }
+
+  printf("const HM_Perfect %s = {\n", name);
+  if(perfect.count > 0){
+    printf("  .keys = %s_keys,\n", name);
+    printf("  .values = (const unsigned char*)%s_values,\n", name);
+    printf("  .displacements = %s_displacements,\n", name);
+    printf("  .remap = %s_remap,\n", name);
+  }
+  printf("  .count = %zu,\n", perfect.count);
+  printf("  .table_size = %zu,\n", perfect.table_size);
+  printf("  .bucket_count = %zu,\n", perfect.bucket_count);
+  printf("  .element_size = sizeof(%s),\n", type);
+  printf("  .seed = 0x%016llxULL,\n", (unsigned long long)perfect.seed);
+  printf("  .hash_func = HM_HASH,\n");
+  printf("};\n");
+
+  HM_perfect_deinit(&perfect);
+  for(size_t i = 0; i < values.count; ++i) free(values.items[i]);
+  free(values.items);
+  HM_deinit(&map);
+  return 0;
+}